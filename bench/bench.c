@@ -0,0 +1,1033 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/param.h>
+
+#include "bps.h"
+#include "bps_create.h"
+#include "crc32.h"
+#include "cursor.h"
+#include "io.h"
+#include "ips.h"
+#include "ips_create.h"
+#include "librombp.h"
+#include "log.h"
+#include "patch.h"
+
+// Microbenchmarks for the patch engines. Run all of them with no
+// arguments, or pass the names of the benchmarks to run.
+
+typedef struct rombp_bench {
+    const char* name;
+    int (*run)(void);
+} rombp_bench;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t encode_varint(uint8_t* out, uint64_t data) {
+    size_t n = 0;
+    while (1) {
+        uint8_t x = data & 0x7F;
+        data >>= 7;
+        if (data == 0) {
+            out[n++] = 0x80 | x;
+            return n;
+        }
+        out[n++] = x;
+        data--;
+    }
+}
+
+// The patch reader before the cursor: one fread call per varint byte.
+static int decode_varint_stdio(FILE* file, uint64_t* out) {
+    uint64_t data = 0;
+    uint64_t shift = 1;
+
+    for (int i = 0; i < sizeof(uint64_t); i++) {
+        uint8_t ch;
+        if (fread(&ch, 1, 1, file) != 1) {
+            return -1;
+        }
+        data += (ch & 0x7F) * shift;
+        if (ch & 0x80) {
+            break;
+        }
+        shift <<= 7;
+        data += shift;
+    }
+
+    *out = data;
+    return 0;
+}
+
+static int decode_varint_cursor(rombp_patch_cursor* cursor, uint64_t* out) {
+    uint64_t data = 0;
+    uint64_t shift = 1;
+
+    for (int i = 0; i < sizeof(uint64_t); i++) {
+        int ch = patch_cursor_byte(cursor);
+        if (ch == -1) {
+            return -1;
+        }
+        data += (ch & 0x7F) * shift;
+        if (ch & 0x80) {
+            break;
+        }
+        shift <<= 7;
+        data += shift;
+    }
+
+    *out = data;
+    return 0;
+}
+
+static const size_t CURSOR_BENCH_COMMANDS = 2000000;
+
+// Decode a stream of small BPS style commands, each a command varint
+// followed by a relative offset varint.
+static int bench_cursor() {
+    FILE* file = tmpfile();
+    if (file == NULL) {
+        rombp_log_err("Failed to create temporary patch file: %d\n", errno);
+        return -1;
+    }
+
+    uint8_t buf[20];
+    srand(1);
+    for (size_t i = 0; i < CURSOR_BENCH_COMMANDS; i++) {
+        size_t n = encode_varint(buf, ((rand() % 64) << 2) | 3);
+        n += encode_varint(buf + n, rand() % 100000);
+        fwrite(buf, 1, n, file);
+    }
+
+    uint64_t data;
+    uint64_t sum_stdio = 0;
+    rewind(file);
+    double start = now_seconds();
+    for (size_t i = 0; i < CURSOR_BENCH_COMMANDS * 2; i++) {
+        if (decode_varint_stdio(file, &data) != 0) {
+            rombp_log_err("stdio decode failed at: %ld\n", (long)i);
+            fclose(file);
+            return -1;
+        }
+        sum_stdio += data;
+    }
+    double stdio_elapsed = now_seconds() - start;
+
+    rombp_io io;
+    rombp_patch_cursor cursor;
+    uint64_t sum_cursor = 0;
+    rombp_io_open_fd(&io, fileno(file));
+    fflush(file);
+    start = now_seconds();
+    if (patch_cursor_init(&cursor, &io, 0) != 0) {
+        fclose(file);
+        return -1;
+    }
+    for (size_t i = 0; i < CURSOR_BENCH_COMMANDS * 2; i++) {
+        if (decode_varint_cursor(&cursor, &data) != 0) {
+            rombp_log_err("cursor decode failed at: %ld\n", (long)i);
+            patch_cursor_destroy(&cursor);
+            fclose(file);
+            return -1;
+        }
+        sum_cursor += data;
+    }
+    double cursor_elapsed = now_seconds() - start;
+    patch_cursor_destroy(&cursor);
+    fclose(file);
+
+    if (sum_stdio != sum_cursor) {
+        rombp_log_err("cursor and stdio decoding disagree\n");
+        return -1;
+    }
+
+    printf("cursor: stdio varint decode:  %12.0f commands/sec\n", CURSOR_BENCH_COMMANDS / stdio_elapsed);
+    printf("cursor: cursor varint decode: %12.0f commands/sec (%.1fx)\n",
+           CURSOR_BENCH_COMMANDS / cursor_elapsed, stdio_elapsed / cursor_elapsed);
+
+    return 0;
+}
+
+static void put_le32(uint8_t* buf, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        buf[i] = value >> (i * 8);
+    }
+}
+
+static size_t encode_relative(uint8_t* out, int64_t delta) {
+    return encode_varint(out, (uint64_t)(delta < 0 ? -delta : delta) << 1 | (delta < 0));
+}
+
+static const size_t IO_BENCH_SIZE = 32 * 1024 * 1024;
+
+// Build a BPS patch that mixes all four commands over a target the size of
+// the source, along with the target it should produce.
+static uint8_t* io_bench_patch(const uint8_t* source, uint8_t* target, size_t* patch_size) {
+    uint8_t* patch = malloc(IO_BENCH_SIZE);
+    if (patch == NULL) {
+        return NULL;
+    }
+    size_t n = 0;
+    memcpy(patch, "BPS1", 4);
+    n += 4;
+    n += encode_varint(patch + n, IO_BENCH_SIZE);
+    n += encode_varint(patch + n, IO_BENCH_SIZE);
+    n += encode_varint(patch + n, 0);
+
+    uint64_t output_offset = 0;
+    uint64_t source_relative_offset = 0;
+    uint64_t target_relative_offset = 0;
+    for (int i = 0; output_offset < IO_BENCH_SIZE; i++) {
+        int command = i % 4;
+        uint64_t length = 32 * 1024 >> command;
+        if (command == 3 && output_offset < 16 * 1024) {
+            command = 0;
+        }
+        length = MIN(length, IO_BENCH_SIZE - output_offset);
+        n += encode_varint(patch + n, ((length - 1) << 2) | command);
+
+        uint8_t* dest = target + output_offset;
+        uint64_t offset;
+        switch (command) {
+            case 0:
+                memcpy(dest, source + output_offset, length);
+                break;
+            case 1:
+                for (uint64_t j = 0; j < length; j++) {
+                    dest[j] = rand();
+                }
+                memcpy(patch + n, dest, length);
+                n += length;
+                break;
+            case 2:
+                offset = rand() % (IO_BENCH_SIZE - length);
+                n += encode_relative(patch + n, offset - source_relative_offset);
+                memcpy(dest, source + offset, length);
+                source_relative_offset = offset + length;
+                break;
+            case 3:
+                offset = output_offset - 16 * 1024;
+                n += encode_relative(patch + n, offset - target_relative_offset);
+                memcpy(dest, target + offset, length);
+                target_relative_offset = offset + length;
+                break;
+        }
+        output_offset += length;
+    }
+    put_le32(patch + n, rombp_crc32_update(0, source, IO_BENCH_SIZE));
+    put_le32(patch + n + 4, rombp_crc32_update(0, target, IO_BENCH_SIZE));
+    put_le32(patch + n + 8, rombp_crc32_update(0, patch, n + 8));
+    *patch_size = n + 12;
+
+    return patch;
+}
+
+// Threads of 0 keeps the number of threads bps_start() picked.
+static int io_bench_apply(rombp_io* input, rombp_io* output, rombp_io* patch, int threads) {
+    bps_file_header header;
+    rombp_hunk_iter_status status;
+
+    if (bps_start(&header, input, output, patch) != PATCH_OK) {
+        return -1;
+    }
+    if (threads > 0 && header.target_map != NULL) {
+        header.threads = threads;
+        header.output_crc32_threads = threads;
+    }
+    do {
+        status = bps_next(&header);
+    } while (status == HUNK_NEXT);
+    if (status != HUNK_DONE) {
+        bps_release(&header);
+        return -1;
+    }
+
+    return bps_end(&header) == PATCH_OK ? 0 : -1;
+}
+
+// Apply the same BPS patch through every I/O backend. The file backends
+// run on the page cache, so this measures the cost of the backends rather
+// than the storage. The last run maps the files a few windows at a time.
+static int bench_io() {
+    static const rombp_io_backend FILE_BACKENDS[] = { ROMBP_IO_STDIO, ROMBP_IO_FD, ROMBP_IO_MMAP, ROMBP_IO_MMAP };
+    static const char* FILE_BACKEND_NAMES[] = { "stdio", "fd", "mmap", "window" };
+    static const uint64_t FILE_BACKEND_MAP_LIMITS[] = { 0, 0, 0, IO_BENCH_SIZE / 4 };
+    int rc = -1;
+    size_t patch_size = 0;
+    uint8_t* patch = NULL;
+    rombp_io input;
+    rombp_io output;
+    rombp_io patch_io;
+
+    uint8_t* source = malloc(IO_BENCH_SIZE);
+    uint8_t* target = malloc(IO_BENCH_SIZE);
+    uint8_t* check = malloc(IO_BENCH_SIZE);
+    FILE* source_file = tmpfile();
+    FILE* patch_file = tmpfile();
+    if (source == NULL || target == NULL || check == NULL || source_file == NULL || patch_file == NULL) {
+        rombp_log_err("Failed to set up I/O benchmark\n");
+        goto out;
+    }
+    srand(2);
+    for (size_t i = 0; i < IO_BENCH_SIZE; i++) {
+        source[i] = rand();
+    }
+    patch = io_bench_patch(source, target, &patch_size);
+    if (patch == NULL ||
+        fwrite(source, 1, IO_BENCH_SIZE, source_file) < IO_BENCH_SIZE ||
+        fwrite(patch, 1, patch_size, patch_file) < patch_size ||
+        fflush(source_file) != 0 || fflush(patch_file) != 0) {
+        rombp_log_err("Failed to write I/O benchmark files\n");
+        goto out;
+    }
+
+    rombp_io_open_mem(&input, source, IO_BENCH_SIZE);
+    rombp_io_open_mem(&patch_io, patch, patch_size);
+    rombp_io_open_mem_growable(&output, IO_BENCH_SIZE);
+    double start = now_seconds();
+    int apply_rc = io_bench_apply(&input, &output, &patch_io, 0);
+    double elapsed = now_seconds() - start;
+    if (apply_rc != 0 || memcmp(output.data, target, IO_BENCH_SIZE) != 0) {
+        rombp_log_err("memory backend output is wrong\n");
+        rombp_io_close(&output);
+        goto out;
+    }
+    rombp_io_close(&output);
+    printf("io: %-6s %8.1f MB/s\n", "memory", IO_BENCH_SIZE / elapsed / 1e6);
+
+    for (size_t i = 0; i < sizeof(FILE_BACKENDS) / sizeof(FILE_BACKENDS[0]); i++) {
+        FILE* output_file = tmpfile();
+        if (output_file == NULL) {
+            rombp_log_err("Failed to create temporary output file: %d\n", errno);
+            goto out;
+        }
+        rombp_io_open_file(&input, source_file, FILE_BACKENDS[i], 0, FILE_BACKEND_MAP_LIMITS[i]);
+        rombp_io_open_file(&patch_io, patch_file, FILE_BACKENDS[i], 0, FILE_BACKEND_MAP_LIMITS[i]);
+        rombp_io_open_file(&output, output_file, FILE_BACKENDS[i], 1, FILE_BACKEND_MAP_LIMITS[i]);
+
+        start = now_seconds();
+        apply_rc = io_bench_apply(&input, &output, &patch_io, 0);
+        elapsed = now_seconds() - start;
+        if (apply_rc == 0) {
+            apply_rc = rombp_io_read_full(&output, check, IO_BENCH_SIZE, 0);
+        }
+
+        rombp_io_close(&input);
+        rombp_io_close(&patch_io);
+        rombp_io_close(&output);
+        fclose(output_file);
+        if (apply_rc != 0 || memcmp(check, target, IO_BENCH_SIZE) != 0) {
+            rombp_log_err("%s backend output is wrong\n", FILE_BACKEND_NAMES[i]);
+            goto out;
+        }
+        printf("io: %-6s %8.1f MB/s\n", FILE_BACKEND_NAMES[i], IO_BENCH_SIZE / elapsed / 1e6);
+    }
+    rc = 0;
+
+out:
+    if (source_file != NULL) {
+        fclose(source_file);
+    }
+    if (patch_file != NULL) {
+        fclose(patch_file);
+    }
+    free(check);
+    free(target);
+    free(source);
+    free(patch);
+    return rc;
+}
+
+// 0 is the number of CPUs
+static const int BPS_BENCH_THREADS[] = { 1, 2, 4, 0 };
+
+// Apply the I/O benchmark patch in memory on several threads. Every thread
+// count has to give the same output.
+static int bench_bps() {
+    int rc = -1;
+    size_t patch_size = 0;
+    uint8_t* patch = NULL;
+    rombp_io input;
+    rombp_io output;
+    rombp_io patch_io;
+
+    uint8_t* source = malloc(IO_BENCH_SIZE);
+    uint8_t* target = malloc(IO_BENCH_SIZE);
+    if (source == NULL || target == NULL) {
+        rombp_log_err("Failed to set up BPS benchmark\n");
+        goto out;
+    }
+    srand(5);
+    for (size_t i = 0; i < IO_BENCH_SIZE; i++) {
+        source[i] = rand();
+    }
+    patch = io_bench_patch(source, target, &patch_size);
+    if (patch == NULL) {
+        rombp_log_err("Failed to build BPS benchmark patch\n");
+        goto out;
+    }
+
+    rombp_io_open_mem(&input, source, IO_BENCH_SIZE);
+    rombp_io_open_mem(&patch_io, patch, patch_size);
+    for (size_t i = 0; i < sizeof(BPS_BENCH_THREADS) / sizeof(BPS_BENCH_THREADS[0]); i++) {
+        int threads = BPS_BENCH_THREADS[i] > 0 ? BPS_BENCH_THREADS[i] : patch_worker_count();
+        rombp_io_open_mem_growable(&output, IO_BENCH_SIZE);
+        double start = now_seconds();
+        int apply_rc = io_bench_apply(&input, &output, &patch_io, threads);
+        double elapsed = now_seconds() - start;
+        if (apply_rc != 0 || memcmp(output.data, target, IO_BENCH_SIZE) != 0) {
+            rombp_log_err("BPS output is wrong with %d threads\n", threads);
+            rombp_io_close(&output);
+            goto out;
+        }
+        rombp_io_close(&output);
+        printf("bps: %-6s %8.1f MB/s, %d threads\n", "memory", IO_BENCH_SIZE / elapsed / 1e6, threads);
+    }
+    rc = 0;
+
+out:
+    free(target);
+    free(source);
+    free(patch);
+    return rc;
+}
+
+// The target copy before the kernel: one byte at a time, like the spec.
+static void copy_repeat_bytewise(uint8_t* dest, uint64_t distance, uint64_t length) {
+    const uint8_t* src = dest - distance;
+    for (uint64_t i = 0; i < length; i++) {
+        dest[i] = src[i];
+    }
+}
+
+static const size_t COPY_BENCH_SIZE = 64 * 1024 * 1024;
+static const uint64_t COPY_BENCH_DISTANCES[] = { 1, 2, 3, 7, 64, 4096, 1024 * 1024 };
+static const size_t COPY_CHECK_MAX_DISTANCE = 70;
+static const size_t COPY_CHECK_MAX_LENGTH = 300;
+
+// Differential check of the kernel against the byte at a time copy: every
+// distance up to COPY_CHECK_MAX_DISTANCE with every length up to
+// COPY_CHECK_MAX_LENGTH, at a few alignments.
+static int copy_repeat_check(uint8_t* expected, uint8_t* got) {
+    size_t size = COPY_CHECK_MAX_DISTANCE + COPY_CHECK_MAX_LENGTH + 16;
+    for (size_t i = 0; i < size; i++) {
+        expected[i] = rand();
+    }
+
+    for (uint64_t distance = 1; distance <= COPY_CHECK_MAX_DISTANCE; distance++) {
+        for (uint64_t length = 1; length <= COPY_CHECK_MAX_LENGTH; length++) {
+            for (size_t align = 0; align < 16; align += 5) {
+                memcpy(got, expected, size);
+                copy_repeat_bytewise(expected + distance + align, distance, length);
+                bps_copy_repeat(got + distance + align, distance, length);
+                if (memcmp(expected, got, size) != 0) {
+                    rombp_log_err("Target copy kernel is wrong, distance: %ld, length: %ld, alignment: %ld\n",
+                                  (long)distance, (long)length, (long)align);
+                    return -1;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Fill most of a buffer with target copies of every distance, with the byte
+// at a time copy and with the kernel, and check they agree.
+static int bench_copy() {
+    int rc = -1;
+    uint8_t* expected = malloc(COPY_BENCH_SIZE);
+    uint8_t* got = malloc(COPY_BENCH_SIZE);
+    if (expected == NULL || got == NULL) {
+        rombp_log_err("Failed to set up target copy benchmark\n");
+        goto out;
+    }
+    // Fault the pages in up front, so they aren't part of the first timing.
+    memset(expected, 1, COPY_BENCH_SIZE);
+    memset(got, 1, COPY_BENCH_SIZE);
+    srand(6);
+    if (copy_repeat_check(expected, got) != 0) {
+        goto out;
+    }
+
+    for (size_t i = 0; i < sizeof(COPY_BENCH_DISTANCES) / sizeof(COPY_BENCH_DISTANCES[0]); i++) {
+        uint64_t distance = COPY_BENCH_DISTANCES[i];
+        uint64_t length = COPY_BENCH_SIZE - distance;
+        for (uint64_t j = 0; j < distance; j++) {
+            expected[j] = rand();
+        }
+        memcpy(got, expected, distance);
+
+        double start = now_seconds();
+        copy_repeat_bytewise(expected + distance, distance, length);
+        double bytewise = now_seconds() - start;
+        start = now_seconds();
+        bps_copy_repeat(got + distance, distance, length);
+        double kernel = now_seconds() - start;
+        if (memcmp(expected, got, COPY_BENCH_SIZE) != 0) {
+            rombp_log_err("Target copy kernel is wrong, distance: %ld\n", (long)distance);
+            goto out;
+        }
+        printf("copy: distance %7ld: byte at a time %6.2f GB/s, kernel %6.2f GB/s (%.1fx)\n",
+               (long)distance, length / bytewise / 1e9, length / kernel / 1e9, bytewise / kernel);
+    }
+    rc = 0;
+
+out:
+    free(got);
+    free(expected);
+    return rc;
+}
+
+// The CRC32 before the slicing tables: one table lookup per byte.
+static uint32_t crc32_bytewise(uint32_t crc, const uint8_t* data, size_t len) {
+    static uint32_t table[0x100];
+
+    if (!table[1]) {
+        for (uint32_t i = 0; i < 0x100; i++) {
+            uint32_t r = i;
+            for (int j = 0; j < 8; j++) {
+                r = (r & 1 ? 0xEDB88320 : 0) ^ r >> 1;
+            }
+            table[i] = r;
+        }
+    }
+
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ crc >> 8;
+    }
+    return ~crc;
+}
+
+static const size_t CRC32_BENCH_SIZE = 64 * 1024 * 1024;
+static const int CRC32_BENCH_ROUNDS = 4;
+
+static const size_t CRC32_CHECK_MAX_LENGTH = 1024;
+static const size_t CRC32_CHECK_ALIGNMENTS = 64;
+
+// Differential check of one implementation against the byte at a time CRC:
+// every length up to CRC32_CHECK_MAX_LENGTH at every alignment, and updates
+// split into pieces at every split point.
+static int crc32_check(const rombp_crc32_impl* impl, const uint8_t* data) {
+    for (size_t offset = 0; offset < CRC32_CHECK_ALIGNMENTS; offset++) {
+        for (size_t len = 0; len <= CRC32_CHECK_MAX_LENGTH; len++) {
+            if (impl->update(0, data + offset, len) != crc32_bytewise(0, data + offset, len)) {
+                rombp_log_err("%s CRC32 mismatch, offset: %ld, length: %ld\n", impl->name, (long)offset, (long)len);
+                return -1;
+            }
+        }
+    }
+
+    uint32_t expected = crc32_bytewise(0, data, CRC32_CHECK_MAX_LENGTH);
+    for (size_t split = 0; split <= CRC32_CHECK_MAX_LENGTH; split++) {
+        uint32_t crc = impl->update(0, data, split);
+        crc = impl->update(crc, data + split, CRC32_CHECK_MAX_LENGTH - split);
+        if (crc != expected) {
+            rombp_log_err("%s CRC32 mismatch when split at: %ld\n", impl->name, (long)split);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static const int CRC32_PARALLEL_THREADS[] = { 2, 4, 8 };
+
+// Combined CRCs have to match the CRC of the whole buffer at every split
+// point, and the parallel CRC has to match at every thread count.
+static int crc32_combine_check(const uint8_t* data, uint32_t expected) {
+    uint32_t whole = crc32_bytewise(0, data, CRC32_CHECK_MAX_LENGTH);
+    for (size_t split = 0; split <= CRC32_CHECK_MAX_LENGTH; split++) {
+        uint32_t crc = rombp_crc32_combine(crc32_bytewise(0, data, split),
+                                           crc32_bytewise(0, data + split, CRC32_CHECK_MAX_LENGTH - split),
+                                           CRC32_CHECK_MAX_LENGTH - split);
+        if (crc != whole) {
+            rombp_log_err("CRC32 combine mismatch when split at: %ld\n", (long)split);
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(CRC32_PARALLEL_THREADS) / sizeof(CRC32_PARALLEL_THREADS[0]); i++) {
+        uint32_t crc = 0;
+        for (int j = 0; j < CRC32_BENCH_ROUNDS; j++) {
+            crc = rombp_crc32_update_parallel(crc, data, CRC32_BENCH_SIZE - j, CRC32_PARALLEL_THREADS[i]);
+            crc = rombp_crc32_update(crc, data + CRC32_BENCH_SIZE - j, j);
+        }
+        if (crc != expected) {
+            rombp_log_err("Parallel CRC32 mismatch with %d threads\n", CRC32_PARALLEL_THREADS[i]);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int bench_crc32() {
+    const rombp_crc32_impl* impls;
+    size_t impl_count = rombp_crc32_impls(&impls);
+
+    uint8_t* data = malloc(CRC32_BENCH_SIZE);
+    if (data == NULL) {
+        rombp_log_err("Failed to allocate CRC32 benchmark buffer\n");
+        return -1;
+    }
+    srand(3);
+    for (size_t i = 0; i < CRC32_BENCH_SIZE; i++) {
+        data[i] = rand();
+    }
+
+    uint32_t expected = 0;
+    double start = now_seconds();
+    for (int i = 0; i < CRC32_BENCH_ROUNDS; i++) {
+        expected = crc32_bytewise(expected, data, CRC32_BENCH_SIZE);
+    }
+    double bytewise_elapsed = now_seconds() - start;
+    double total = (double)CRC32_BENCH_SIZE * CRC32_BENCH_ROUNDS;
+    printf("crc32: %-20s %6.2f GB/s\n", "byte at a time:", total / bytewise_elapsed / 1e9);
+
+    for (size_t i = 0; i < impl_count; i++) {
+        if (crc32_check(&impls[i], data) != 0) {
+            free(data);
+            return -1;
+        }
+
+        uint32_t crc = 0;
+        start = now_seconds();
+        for (int j = 0; j < CRC32_BENCH_ROUNDS; j++) {
+            crc = impls[i].update(crc, data, CRC32_BENCH_SIZE);
+        }
+        double elapsed = now_seconds() - start;
+        if (crc != expected) {
+            rombp_log_err("%s CRC32 mismatch on the benchmark buffer\n", impls[i].name);
+            free(data);
+            return -1;
+        }
+
+        char label[32];
+        snprintf(label, sizeof(label), "%s:", impls[i].name);
+        printf("crc32: %-20s %6.2f GB/s (%.1fx)\n", label, total / elapsed / 1e9, bytewise_elapsed / elapsed);
+    }
+
+    if (crc32_combine_check(data, expected) != 0) {
+        free(data);
+        return -1;
+    }
+    int threads = patch_worker_count();
+    uint32_t crc = 0;
+    start = now_seconds();
+    for (int j = 0; j < CRC32_BENCH_ROUNDS; j++) {
+        crc = rombp_crc32_update_parallel(crc, data, CRC32_BENCH_SIZE, threads);
+    }
+    double elapsed = now_seconds() - start;
+    if (crc != expected) {
+        rombp_log_err("Parallel CRC32 mismatch on the benchmark buffer\n");
+        free(data);
+        return -1;
+    }
+    char label[32];
+    snprintf(label, sizeof(label), "parallel, %d threads:", threads);
+    printf("crc32: %-20s %6.2f GB/s (%.1fx)\n", label, total / elapsed / 1e9, bytewise_elapsed / elapsed);
+    free(data);
+
+    return 0;
+}
+
+static const size_t IPS_BENCH_SIZE = 16 * 1024 * 1024;
+static const size_t IPS_BENCH_HUNKS = 400000;
+// 0 is the number of CPUs
+static const int IPS_BENCH_THREADS[] = { 1, 2, 4, 0 };
+
+// A heavily fragmented IPS patch, like a translation: lots of short hunks all
+// over the ROM, some of them RLE, some overlapping. The target is built by
+// applying the hunks one by one, in patch order.
+static uint8_t* ips_bench_patch(uint8_t* target, size_t* patch_size) {
+    uint8_t* patch = malloc(5 + IPS_BENCH_HUNKS * 72 + 3);
+    if (patch == NULL) {
+        return NULL;
+    }
+    size_t n = 0;
+    memcpy(patch, "PATCH", 5);
+    n += 5;
+
+    for (size_t i = 0; i < IPS_BENCH_HUNKS; i++) {
+        uint32_t offset = rand() % (IPS_BENCH_SIZE - 64);
+        uint32_t length = 1 + rand() % 64;
+        if (offset == 0x454F46) {
+            offset++;
+        }
+        patch[n++] = offset >> 16;
+        patch[n++] = offset >> 8;
+        patch[n++] = offset;
+        if (i % 8 == 0) {
+            uint8_t value = rand();
+            patch[n++] = 0;
+            patch[n++] = 0;
+            patch[n++] = length >> 8;
+            patch[n++] = length;
+            patch[n++] = value;
+            memset(target + offset, value, length);
+        } else {
+            patch[n++] = length >> 8;
+            patch[n++] = length;
+            for (uint32_t j = 0; j < length; j++) {
+                patch[n++] = target[offset + j] = rand();
+            }
+        }
+    }
+    memcpy(patch + n, "EOF", 3);
+    *patch_size = n + 3;
+
+    return patch;
+}
+
+// Threads of 0 keeps the number of threads ips_start() picked.
+static int ips_bench_apply(rombp_io* input, rombp_io* output, rombp_io* patch, int threads) {
+    ips_context ctx;
+    rombp_hunk_iter_status status;
+
+    if (ips_start(&ctx, input, output, patch) != PATCH_OK) {
+        return -1;
+    }
+    if (threads > 0 && ctx.output_map != NULL) {
+        ctx.threads = threads;
+    }
+    do {
+        status = ips_next(&ctx);
+    } while (status == HUNK_NEXT);
+    ips_release(&ctx);
+
+    return status == HUNK_DONE ? 0 : -1;
+}
+
+// Compile and apply a fragmented IPS patch, in memory on several threads and
+// through file descriptors, and check the output against a hunk by hunk apply.
+static int bench_ips() {
+    int rc = -1;
+    size_t patch_size = 0;
+    uint8_t* patch = NULL;
+    FILE* source_file = NULL;
+    FILE* output_file = NULL;
+    rombp_io input;
+    rombp_io output;
+    rombp_io patch_io;
+    ips_program program;
+
+    uint8_t* source = malloc(IPS_BENCH_SIZE);
+    uint8_t* target = malloc(IPS_BENCH_SIZE);
+    uint8_t* check = malloc(IPS_BENCH_SIZE);
+    if (source == NULL || target == NULL || check == NULL) {
+        rombp_log_err("Failed to set up IPS benchmark\n");
+        goto out;
+    }
+    srand(4);
+    for (size_t i = 0; i < IPS_BENCH_SIZE; i++) {
+        source[i] = rand();
+    }
+    memcpy(target, source, IPS_BENCH_SIZE);
+    patch = ips_bench_patch(target, &patch_size);
+    if (patch == NULL) {
+        rombp_log_err("Failed to build IPS benchmark patch\n");
+        goto out;
+    }
+    rombp_io_open_mem(&patch_io, patch, patch_size);
+
+    double start = now_seconds();
+    if (ips_compile(&program, &patch_io) != PATCH_OK) {
+        goto out;
+    }
+    double elapsed = now_seconds() - start;
+    printf("ips: compile %8.1f ms, %ld hunks into %ld runs\n", elapsed * 1e3,
+           (long)program.patch_hunk_count, (long)program.hunk_count);
+    ips_program_release(&program);
+
+    // The memory backend maps, so runs are applied in parallel. Every
+    // thread count has to give the same output.
+    rombp_io_open_mem(&input, source, IPS_BENCH_SIZE);
+    for (size_t i = 0; i < sizeof(IPS_BENCH_THREADS) / sizeof(IPS_BENCH_THREADS[0]); i++) {
+        int threads = IPS_BENCH_THREADS[i] > 0 ? IPS_BENCH_THREADS[i] : patch_worker_count();
+        rombp_io_open_mem_growable(&output, IPS_BENCH_SIZE);
+        start = now_seconds();
+        int apply_rc = ips_bench_apply(&input, &output, &patch_io, threads);
+        elapsed = now_seconds() - start;
+        if (apply_rc != 0 || output.data_size != IPS_BENCH_SIZE || memcmp(output.data, target, IPS_BENCH_SIZE) != 0) {
+            rombp_log_err("memory backend IPS output is wrong with %d threads\n", threads);
+            rombp_io_close(&output);
+            goto out;
+        }
+        rombp_io_close(&output);
+        printf("ips: %-6s  %8.1f ms, %d threads\n", "memory", elapsed * 1e3, threads);
+    }
+
+    source_file = tmpfile();
+    output_file = tmpfile();
+    if (source_file == NULL || output_file == NULL ||
+        fwrite(source, 1, IPS_BENCH_SIZE, source_file) < IPS_BENCH_SIZE || fflush(source_file) != 0) {
+        rombp_log_err("Failed to write IPS benchmark files\n");
+        goto out;
+    }
+    rombp_io_open_fd(&input, fileno(source_file));
+    rombp_io_open_fd(&output, fileno(output_file));
+    start = now_seconds();
+    int apply_rc = ips_bench_apply(&input, &output, &patch_io, 0);
+    elapsed = now_seconds() - start;
+    if (apply_rc == 0) {
+        apply_rc = rombp_io_read_full(&output, check, IPS_BENCH_SIZE, 0);
+    }
+    if (apply_rc != 0 || memcmp(check, target, IPS_BENCH_SIZE) != 0) {
+        rombp_log_err("fd backend IPS output is wrong\n");
+        goto out;
+    }
+    printf("ips: %-6s  %8.1f ms\n", "fd", elapsed * 1e3);
+    rc = 0;
+
+out:
+    if (source_file != NULL) {
+        fclose(source_file);
+    }
+    if (output_file != NULL) {
+        fclose(output_file);
+    }
+    free(check);
+    free(target);
+    free(source);
+    free(patch);
+    return rc;
+}
+
+static const size_t DIFF_CHECK_MAX_LENGTH = 300;
+static const size_t DIFF_CHECK_ALIGNMENTS = 64;
+static const size_t DIFF_CHECK_SIZE = 4096;
+// Changed spots in the sparse target, like a small bug fix patch
+static const size_t DIFF_BENCH_SPARSE_CHANGES = 2000;
+
+// Differential check of one implementation's kernels against the portable
+// ones, on bytes from a small alphabet so that both masks have bits set:
+// every length up to DIFF_CHECK_MAX_LENGTH at every alignment, and the
+// masks of every block alignment.
+static int diff_check(const ips_diff_impl* impl, const ips_diff_impl* portable) {
+    uint8_t a[DIFF_CHECK_SIZE];
+    uint8_t b[DIFF_CHECK_SIZE];
+
+    srand(7);
+    for (size_t i = 0; i < DIFF_CHECK_SIZE; i++) {
+        a[i] = rand() % 4;
+        b[i] = rand() % 64 == 0 ? rand() % 4 : a[i];
+    }
+    for (size_t offset = 0; offset < DIFF_CHECK_ALIGNMENTS; offset++) {
+        for (size_t len = 0; len <= DIFF_CHECK_MAX_LENGTH; len++) {
+            if (impl->mismatch(a + offset, b + offset, len) != portable->mismatch(a + offset, b + offset, len)) {
+                rombp_log_err("%s mismatch is wrong, offset: %ld, length: %ld\n", impl->name, (long)offset, (long)len);
+                return -1;
+            }
+        }
+    }
+    for (size_t offset = 1; offset + IPS_DIFF_BLOCK <= DIFF_CHECK_SIZE; offset++) {
+        uint64_t differs, repeats, expected_differs, expected_repeats;
+        impl->scan(a + offset, b + offset, &differs, &repeats);
+        portable->scan(a + offset, b + offset, &expected_differs, &expected_repeats);
+        if (differs != expected_differs || repeats != expected_repeats) {
+            rombp_log_err("%s scan is wrong, offset: %ld\n", impl->name, (long)offset);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Create an IPS patch with the kernels, and check that it applies back to
+// the target.
+static int diff_bench_create(const ips_diff_impl* impl, const uint8_t* source, const uint8_t* target,
+                             double* elapsed, ips_create_stats* stats) {
+    rombp_io output;
+    uint8_t* check = NULL;
+    size_t check_size = 0;
+
+    rombp_io_open_mem_growable(&output, 0);
+    double start = now_seconds();
+    rombp_patch_err err = ips_create_with(impl, source, IPS_BENCH_SIZE, target, IPS_BENCH_SIZE, &output, stats);
+    *elapsed = now_seconds() - start;
+    if (err == PATCH_OK &&
+        (rombp_apply(source, IPS_BENCH_SIZE, output.data, stats->patch_size, &check, &check_size) != PATCH_OK ||
+         check_size != IPS_BENCH_SIZE || memcmp(check, target, IPS_BENCH_SIZE) != 0)) {
+        rombp_log_err("%s IPS patch doesn't give the target\n", impl->name);
+        err = PATCH_INVALID_OUTPUT_CHECKSUM;
+    }
+    rombp_free(check);
+    rombp_io_close(&output);
+
+    return err == PATCH_OK ? 0 : -1;
+}
+
+// Create IPS patches with every diff kernel the CPU supports: for the
+// fragmented target of the IPS benchmark, and for a few changes over the
+// whole ROM, where unchanged data is skipped at the speed of memory.
+static int bench_diff() {
+    int rc = -1;
+    size_t patch_size = 0;
+    uint8_t* patch = NULL;
+    const ips_diff_impl* impls;
+    size_t impl_count = ips_diff_impls(&impls);
+
+    uint8_t* source = malloc(IPS_BENCH_SIZE);
+    uint8_t* dense = malloc(IPS_BENCH_SIZE);
+    uint8_t* sparse = malloc(IPS_BENCH_SIZE);
+    if (source == NULL || dense == NULL || sparse == NULL) {
+        rombp_log_err("Failed to set up diff benchmark\n");
+        goto out;
+    }
+    srand(8);
+    for (size_t i = 0; i < IPS_BENCH_SIZE; i++) {
+        source[i] = rand();
+    }
+    memcpy(dense, source, IPS_BENCH_SIZE);
+    patch = ips_bench_patch(dense, &patch_size);
+    if (patch == NULL) {
+        rombp_log_err("Failed to build diff benchmark target\n");
+        goto out;
+    }
+    memcpy(sparse, source, IPS_BENCH_SIZE);
+    for (size_t i = 0; i < DIFF_BENCH_SPARSE_CHANGES; i++) {
+        size_t offset = rand() % (IPS_BENCH_SIZE - 16);
+        memset(sparse + offset, rand(), 1 + rand() % 16);
+    }
+
+    for (size_t i = 0; i < impl_count; i++) {
+        double dense_elapsed, sparse_elapsed;
+        ips_create_stats dense_stats, sparse_stats;
+        if (diff_check(&impls[i], &impls[impl_count - 1]) != 0 ||
+            diff_bench_create(&impls[i], source, dense, &dense_elapsed, &dense_stats) != 0 ||
+            diff_bench_create(&impls[i], source, sparse, &sparse_elapsed, &sparse_stats) != 0) {
+            goto out;
+        }
+        printf("diff: %-8s fragmented %6.2f GB/s, patch %ld bytes (hand written %ld), %ld hunks, %ld RLE\n",
+               impls[i].name, IPS_BENCH_SIZE / dense_elapsed / 1e9, (long)dense_stats.patch_size, (long)patch_size,
+               (long)dense_stats.hunks, (long)dense_stats.rle_hunks);
+        printf("diff: %-8s sparse     %6.2f GB/s, patch %ld bytes, %ld hunks, %ld RLE\n",
+               impls[i].name, IPS_BENCH_SIZE / sparse_elapsed / 1e9, (long)sparse_stats.patch_size,
+               (long)sparse_stats.hunks, (long)sparse_stats.rle_hunks);
+    }
+    rc = 0;
+
+out:
+    free(sparse);
+    free(dense);
+    free(source);
+    free(patch);
+    return rc;
+}
+
+static const bps_create_method CREATE_BENCH_METHODS[] = { BPS_CREATE_SUFFIX, BPS_CREATE_STREAM };
+static const char* CREATE_BENCH_METHOD_NAMES[] = { "suffix", "stream" };
+
+// Create a patch between the I/O benchmark source and target, which share
+// long runs in place and moved, with each method, and check that it applies
+// back to the target.
+static int bench_create() {
+    int rc = -1;
+    size_t patch_size = 0;
+    uint8_t* patch = NULL;
+    uint8_t* check = NULL;
+    size_t check_size = 0;
+    rombp_io source_io;
+    rombp_io target_io;
+    rombp_io output;
+    bps_create_stats stats;
+    bps_create_options options = {
+        .memory_limit = 0,
+        .threads = patch_worker_count(),
+    };
+
+    uint8_t* source = malloc(IO_BENCH_SIZE);
+    uint8_t* target = malloc(IO_BENCH_SIZE);
+    if (source == NULL || target == NULL) {
+        rombp_log_err("Failed to set up create benchmark\n");
+        goto out;
+    }
+    srand(6);
+    for (size_t i = 0; i < IO_BENCH_SIZE; i++) {
+        source[i] = rand();
+    }
+    patch = io_bench_patch(source, target, &patch_size);
+    if (patch == NULL) {
+        rombp_log_err("Failed to build create benchmark target\n");
+        goto out;
+    }
+
+    for (size_t i = 0; i < sizeof(CREATE_BENCH_METHODS) / sizeof(CREATE_BENCH_METHODS[0]); i++) {
+        rombp_io_open_mem_growable(&output, 0);
+        double start = now_seconds();
+        rombp_patch_err err;
+        if (CREATE_BENCH_METHODS[i] == BPS_CREATE_STREAM) {
+            rombp_io_open_mem(&source_io, source, IO_BENCH_SIZE);
+            rombp_io_open_mem(&target_io, target, IO_BENCH_SIZE);
+            err = bps_create_stream(&source_io, &target_io, &output, &options, &stats);
+        } else {
+            err = bps_create(source, IO_BENCH_SIZE, target, IO_BENCH_SIZE, &output, &options, &stats);
+        }
+        double elapsed = now_seconds() - start;
+        if (err != PATCH_OK) {
+            rombp_io_close(&output);
+            goto out;
+        }
+        if (rombp_apply(source, IO_BENCH_SIZE, output.data, stats.patch_size, &check, &check_size) != PATCH_OK ||
+            check_size != IO_BENCH_SIZE || memcmp(check, target, IO_BENCH_SIZE) != 0) {
+            rombp_log_err("%s patch doesn't give the target\n", CREATE_BENCH_METHOD_NAMES[i]);
+            rombp_io_close(&output);
+            goto out;
+        }
+        rombp_io_close(&output);
+        rombp_free(check);
+        check = NULL;
+        printf("create: %-6s %8.1f MB/s, %d threads, patch %ld bytes (hand written %ld), memory %ld MB\n",
+               CREATE_BENCH_METHOD_NAMES[i], IO_BENCH_SIZE / elapsed / 1e6, options.threads,
+               (long)stats.patch_size, (long)patch_size, (long)(stats.memory >> 20));
+    }
+    rc = 0;
+
+out:
+    rombp_free(check);
+    free(target);
+    free(source);
+    free(patch);
+    return rc;
+}
+
+static const rombp_bench BENCHMARKS[] = {
+    { "cursor", bench_cursor },
+    { "crc32", bench_crc32 },
+    { "io", bench_io },
+    { "bps", bench_bps },
+    { "copy", bench_copy },
+    { "ips", bench_ips },
+    { "create", bench_create },
+    { "diff", bench_diff },
+};
+static const size_t BENCHMARK_COUNT = sizeof(BENCHMARKS) / sizeof(rombp_bench);
+
+int main(int argc, char** argv) {
+    int failed = 0;
+
+    for (size_t i = 0; i < BENCHMARK_COUNT; i++) {
+        int selected = argc < 2;
+        for (int j = 1; j < argc; j++) {
+            if (strcmp(argv[j], BENCHMARKS[i].name) == 0) {
+                selected = 1;
+            }
+        }
+        if (selected && BENCHMARKS[i].run() != 0) {
+            rombp_log_err("Benchmark failed: %s\n", BENCHMARKS[i].name);
+            failed = 1;
+        }
+    }
+
+    return failed;
+}
@@ -1,7 +1,11 @@
 #include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/param.h>
 
 #include "bps.h"
+#include "crc32.h"
 #include "log.h"
 
 static const uint8_t BPS_EXPECTED_MARKER[] = {
@@ -10,47 +14,18 @@ static const uint8_t BPS_EXPECTED_MARKER[] = {
 static const size_t BPS_MARKER_SIZE = sizeof(BPS_EXPECTED_MARKER) / sizeof(uint8_t);
 
 static const size_t FOOTER_LENGTH = 12;
-static const size_t FOOTER_ITEMS = 12 / sizeof(uint32_t);
-static const size_t BUF_SIZE = 32768;
+static const size_t OUTPUT_BUF_SIZE = 256 * 1024;
+static const size_t STREAM_WINDOW_SIZE = 16 * 1024 * 1024;
+static const size_t SOURCE_CHECK_CHUNK_SIZE = 1024 * 1024;
 
-typedef enum bps_command_type {
-    BPS_SOURCE_READ = 0,
-    BPS_TARGET_READ = 1,
-    BPS_SOURCE_COPY = 2,
-    BPS_TARGET_COPY = 3,
-} bps_command_type;
-
-static uint32_t crc32_for_byte(uint32_t r) {
-    for(int i = 0; i < 8; ++i) {
-        r = (r & 1? 0: (uint32_t)0xEDB88320L) ^ r >> 1;
-    }
-
-    return r ^ (uint32_t)0xFF000000L;
-}
-
-static void crc32(const void *data, size_t n_bytes, uint32_t* crc) {
-    static uint32_t table[0x100];
-
-    if(!*table) {
-        for(size_t i = 0; i < 0x100; ++i) {
-            table[i] = crc32_for_byte(i);
-        }
-    }
-
-    for(size_t i = 0; i < n_bytes; ++i) {
-        *crc = table[(uint8_t)*crc ^ ((uint8_t*)data)[i]] ^ *crc >> 8;
-    }
-}
-
-static int decode_varint(FILE* bps_file, uint64_t* out) {
+static int decode_varint(rombp_patch_cursor* cursor, uint64_t* out) {
     uint64_t data = 0;
     uint64_t shift = 1;
 
     for (int i = 0; i < sizeof(uint64_t); i++) {
-        uint8_t ch;
-        size_t nread = fread(&ch, 1, sizeof(uint8_t), bps_file);
-        if (nread != 1) {
-            rombp_log_err("Failed to read next byte, read: %ld, error code: %d\n", (long)nread, errno);
+        int ch = patch_cursor_byte(cursor);
+        if (ch == -1) {
+            rombp_log_err("Failed to read next varint byte at patch position: %ld\n", (long)patch_cursor_pos(cursor));
             return -1;
         }
         data += (ch & 0x7F) * shift;
@@ -65,47 +40,39 @@ static int decode_varint(FILE* bps_file, uint64_t* out) {
     return 0;
 }
 
-rombp_patch_err bps_verify_marker(FILE* bps_file) {
-    return patch_verify_marker(bps_file, BPS_EXPECTED_MARKER, BPS_MARKER_SIZE);
+rombp_patch_err bps_verify_marker(rombp_io* patch) {
+    return patch_verify_marker(patch, BPS_EXPECTED_MARKER, BPS_MARKER_SIZE);
 }
 
-rombp_patch_err bps_start(FILE* bps_file, bps_file_header* file_header) {
-    int rc = fseek(bps_file, 0, SEEK_END);
-    if (rc == -1) {
-        rombp_log_err("Failed to seek to the end of patch file, error: %d\n", errno);
-        return PATCH_ERR_IO;
-    }
-    file_header->patch_size = ftell(bps_file);
-    if (file_header->patch_size == -1) {
-        rombp_log_err("Failed to get end of bps patch file length, error: %d\n", errno);
-        return PATCH_ERR_IO;
-    }
-    // Reset back to after the marker
-    rc = fseek(bps_file, BPS_MARKER_SIZE, SEEK_SET);
-    if (rc == -1) {
-        rombp_log_err("Failed to seek bps file back to beginning before reading metadata, error: %d\n", errno);
-        return PATCH_ERR_IO;
-    }
-    rc = decode_varint(bps_file, &file_header->source_size);
+// Decode the header fields following the marker from the patch cursor, and
+// reset the engine state. Releases the cursor on failure.
+static rombp_patch_err bps_read_header(bps_file_header* file_header) {
+    int rc;
+
+    rc = decode_varint(&file_header->cursor, &file_header->source_size);
     if (rc == -1) {
         rombp_log_err("BPS file: Failed to read source size\n");
+        patch_cursor_destroy(&file_header->cursor);
         return PATCH_ERR_IO;
     }
-    rc = decode_varint(bps_file, &file_header->target_size);
+    rc = decode_varint(&file_header->cursor, &file_header->target_size);
     if (rc == -1) {
         rombp_log_err("BPS file: Failed to read target size\n");
+        patch_cursor_destroy(&file_header->cursor);
         return PATCH_ERR_IO;
     }
-    rc = decode_varint(bps_file, &file_header->metadata_size);
+    rc = decode_varint(&file_header->cursor, &file_header->metadata_size);
     if (rc == -1) {
         rombp_log_err("BPS file: Failed to read metadata size\n");
+        patch_cursor_destroy(&file_header->cursor);
         return PATCH_ERR_IO;
     }
     if (file_header->metadata_size > 0) {
         // Skip over metadata. Don't need it!
-        int pos = fseek(bps_file, file_header->metadata_size, SEEK_CUR);
-        if (pos == -1) {
-            rombp_log_err("Failed to skip metadata field. Err: %d\n", errno);
+        rc = patch_cursor_skip(&file_header->cursor, file_header->metadata_size);
+        if (rc == -1) {
+            rombp_log_err("Failed to skip metadata field\n");
+            patch_cursor_destroy(&file_header->cursor);
             return PATCH_ERR_IO;
         }
     }
@@ -119,247 +86,1090 @@ rombp_patch_err bps_start(FILE* bps_file, bps_file_header* file_header) {
     file_header->source_relative_offset = 0;
     file_header->target_relative_offset = 0;
     file_header->output_crc32 = 0;
+    file_header->output_crc32_threads = 0;
+    file_header->threads = 1;
+
+    file_header->source_map = NULL;
+    file_header->target_map = NULL;
+    file_header->source_map_size = 0;
+
+    file_header->streaming = 0;
+    file_header->out_buf = NULL;
+    file_header->out_start = 0;
+    file_header->out_len = 0;
+    file_header->out_written = 0;
+    file_header->out_capacity = OUTPUT_BUF_SIZE;
+    file_header->out_keep = 0;
+
+    memset(&file_header->plan, 0, sizeof(file_header->plan));
+    file_header->plan_next = 0;
 
     return PATCH_OK;
 }
 
-static rombp_hunk_iter_status bps_write_output(bps_file_header* file_header, FILE* output_file, uint8_t* buf, size_t len) {
-    size_t nwritten = fwrite(buf, sizeof(uint8_t), len, output_file);
-    if (nwritten < len && ferror(output_file)) {
-        rombp_log_err("BPS output write error: %d\n", errno);
-        return HUNK_ERR_IO;
+static uint32_t le_32bit_int(const uint8_t* buf) {
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static bps_source_check_state bps_source_check_get(bps_source_check* check) {
+    pthread_mutex_lock(&check->lock);
+    bps_source_check_state state = check->state;
+    pthread_mutex_unlock(&check->lock);
+    return state;
+}
+
+static int bps_source_check_cancelled(bps_source_check* check) {
+    pthread_mutex_lock(&check->lock);
+    int cancel = check->cancel;
+    pthread_mutex_unlock(&check->lock);
+    return cancel;
+}
+
+static void bps_source_check_finish(bps_source_check* check, bps_source_check_state state) {
+    pthread_mutex_lock(&check->lock);
+    check->state = state;
+    pthread_mutex_unlock(&check->lock);
+}
+
+static void* bps_source_check_run(void* arg) {
+    bps_source_check* check = arg;
+    uint8_t* buf = NULL;
+    uint32_t crc = 0;
+
+    int64_t size = rombp_io_size(check->input);
+    if (size == -1) {
+        bps_source_check_finish(check, SOURCE_CHECK_ERR_IO);
+        return NULL;
+    }
+    const uint8_t* map = rombp_io_map(check->input, 0, size);
+    if (map == NULL && size > 0) {
+        buf = malloc(SOURCE_CHECK_CHUNK_SIZE);
+        if (buf == NULL) {
+            rombp_log_err("Failed to allocate source CRC32 buffer\n");
+            bps_source_check_finish(check, SOURCE_CHECK_ERR_IO);
+            return NULL;
+        }
     }
 
-    crc32(buf, len, &file_header->output_crc32);
-    file_header->output_offset += len;
+    // Check for cancellation between chunks, so a failed or finished job
+    // doesn't wait for the whole source to be read.
+    for (uint64_t offset = 0; offset < size; offset += SOURCE_CHECK_CHUNK_SIZE) {
+        if (bps_source_check_cancelled(check)) {
+            free(buf);
+            return NULL;
+        }
+        size_t amount = MIN(SOURCE_CHECK_CHUNK_SIZE, size - offset);
+        if (map != NULL) {
+            crc = rombp_crc32_update(crc, map + offset, amount);
+        } else if (rombp_io_read_full(check->input, buf, amount, offset) == 0) {
+            crc = rombp_crc32_update(crc, buf, amount);
+        } else {
+            rombp_log_err("Failed to read source at: %ld for its CRC32\n", (long)offset);
+            free(buf);
+            bps_source_check_finish(check, SOURCE_CHECK_ERR_IO);
+            return NULL;
+        }
+    }
+    free(buf);
 
-    return HUNK_NEXT;
+    pthread_mutex_lock(&check->lock);
+    check->crc = crc;
+    pthread_mutex_unlock(&check->lock);
+    if (!check->expected_known) {
+        bps_source_check_finish(check, SOURCE_CHECK_HASHED);
+    } else if (crc != check->expected_crc32) {
+        rombp_log_err("Source CRC32 doesn't match the patch, expected: %u, got: %u\n", check->expected_crc32, crc);
+        bps_source_check_finish(check, SOURCE_CHECK_MISMATCH);
+    } else {
+        rombp_log_info("Source file CRC32 is correct\n");
+        bps_source_check_finish(check, SOURCE_CHECK_MATCH);
+    }
+
+    return NULL;
 }
 
-static rombp_hunk_iter_status bps_source_read(bps_file_header* file_header, uint64_t length, FILE* input_file, FILE* output_file) {
-    int pos = fseek(input_file, file_header->output_offset, SEEK_SET);
-    if (pos == -1) {
-        rombp_log_err("Failed to seek source file. err: %d\n", errno);
-        return HUNK_ERR_IO;
+// Start checking the source CRC32. Backends that can't be read from another
+// thread are checked right away instead, before any output is written. When
+// expected_crc32 is NULL, the CRC32 is only computed, for the caller to
+// compare once it's known.
+static int bps_source_check_start(bps_source_check* check, rombp_io* input, const uint32_t* expected_crc32) {
+    int rc = pthread_mutex_init(&check->lock, NULL);
+    if (rc != 0) {
+        rombp_log_err("Failed to initialize source check mutex: %d\n", rc);
+        return -1;
     }
+    check->active = 1;
+    check->started = 0;
+    check->cancel = 0;
+    check->state = SOURCE_CHECK_RUNNING;
+    check->input = input;
+    check->expected_known = expected_crc32 != NULL;
+    check->expected_crc32 = expected_crc32 != NULL ? *expected_crc32 : 0;
+    check->crc = 0;
 
-    pos = fseek(output_file, file_header->output_offset, SEEK_SET);
-    if (pos == -1) {
-        rombp_log_err("Failed to seek target file. err: %d\n", errno);
-        return HUNK_ERR_IO;
+    if (!input->ops->concurrent_reads) {
+        bps_source_check_run(check);
+        return 0;
+    }
+    rc = pthread_create(&check->thread, NULL, bps_source_check_run, check);
+    if (rc != 0) {
+        rombp_log_err("Failed to start source check thread: %d\n", rc);
+        return -1;
     }
+    check->started = 1;
 
-    uint64_t remaining = length;
-    uint8_t buf[BUF_SIZE];
+    return 0;
+}
 
-    while (remaining > 0) {
-        uint64_t target_read = MIN(BUF_SIZE, remaining);
-        size_t nread = fread(buf, sizeof(uint8_t), target_read, input_file);
-        if (nread < target_read && ferror(input_file)) {
-            rombp_log_err("Error during BPS source read, error: %d\n", errno);
-            return HUNK_ERR_IO;
+// Wait for the check to finish, and get its result.
+static bps_source_check_state bps_source_check_wait(bps_source_check* check) {
+    if (check->started) {
+        pthread_join(check->thread, NULL);
+        check->started = 0;
+    }
+    return bps_source_check_get(check);
+}
+
+static void bps_source_check_stop(bps_source_check* check) {
+    if (!check->active) {
+        return;
+    }
+    if (check->started) {
+        pthread_mutex_lock(&check->lock);
+        check->cancel = 1;
+        pthread_mutex_unlock(&check->lock);
+        pthread_join(check->thread, NULL);
+        check->started = 0;
+    }
+    pthread_mutex_destroy(&check->lock);
+    check->active = 0;
+}
+
+// Read the footer and the header of a patch, leaving the cursor at the first
+// command. The cursor keeps a running CRC32 of the patch from the start.
+static rombp_patch_err bps_open_patch(bps_file_header* file_header, rombp_io* patch) {
+    file_header->source_check.active = 0;
+    int64_t patch_size = rombp_io_size(patch);
+    if (patch_size == -1) {
+        rombp_log_err("Failed to get bps patch file length, error: %d\n", errno);
+        return PATCH_ERR_IO;
+    }
+    file_header->patch_size = patch_size;
+
+    if (patch_size < BPS_MARKER_SIZE + FOOTER_LENGTH) {
+        rombp_log_err("BPS file is too short: %ld bytes\n", (long)patch_size);
+        return PATCH_INVALID_HEADER;
+    }
+    if (rombp_io_read_full(patch, file_header->footer, FOOTER_LENGTH, patch_size - FOOTER_LENGTH) != 0) {
+        rombp_log_err("Error reading BPS footer, error: %d\n", errno);
+        return PATCH_ERR_IO;
+    }
+    file_header->expected_source_crc32 = le_32bit_int(file_header->footer);
+    file_header->expected_target_crc32 = le_32bit_int(file_header->footer + 4);
+    file_header->expected_patch_crc32 = le_32bit_int(file_header->footer + 8);
+
+    int rc = patch_cursor_init(&file_header->cursor, patch, BPS_MARKER_SIZE);
+    if (rc == -1) {
+        rombp_log_err("Failed to start reading BPS file\n");
+        return PATCH_ERR_IO;
+    }
+    patch_cursor_crc_start(&file_header->cursor, rombp_crc32_update(0, BPS_EXPECTED_MARKER, BPS_MARKER_SIZE));
+
+    return bps_read_header(file_header);
+}
+
+// Once every command has been consumed, check the patch CRC32 from the
+// footer. It covers the whole patch, except for itself.
+static rombp_patch_err bps_check_patch_crc(bps_file_header* file_header) {
+    uint64_t pos = patch_cursor_pos(&file_header->cursor);
+    if (pos != file_header->patch_size - FOOTER_LENGTH) {
+        rombp_log_err("BPS commands ran into the footer, position: %ld\n", (long)pos);
+        return PATCH_ERR_IO;
+    }
+
+    uint32_t crc = rombp_crc32_update(patch_cursor_crc(&file_header->cursor), file_header->footer, FOOTER_LENGTH - 4);
+    if (crc != file_header->expected_patch_crc32) {
+        rombp_log_err("Patch CRC32 doesn't match, the patch file is corrupt. Expected: %u, got: %u\n",
+                      file_header->expected_patch_crc32, crc);
+        return PATCH_INVALID_PATCH_CHECKSUM;
+    }
+
+    return PATCH_OK;
+}
+
+static int bps_plan_reserve(bps_plan* plan) {
+    if (plan->count < plan->capacity) {
+        return 0;
+    }
+
+    size_t capacity = MAX(plan->capacity * 2, 1024);
+    uint8_t* opcode = realloc(plan->opcode, capacity * sizeof(uint8_t));
+    if (opcode != NULL) {
+        plan->opcode = opcode;
+    }
+    uint64_t* length = realloc(plan->length, capacity * sizeof(uint64_t));
+    if (length != NULL) {
+        plan->length = length;
+    }
+    uint64_t* output_offset = realloc(plan->output_offset, capacity * sizeof(uint64_t));
+    if (output_offset != NULL) {
+        plan->output_offset = output_offset;
+    }
+    uint64_t* read_offset = realloc(plan->read_offset, capacity * sizeof(uint64_t));
+    if (read_offset != NULL) {
+        plan->read_offset = read_offset;
+    }
+    if (opcode == NULL || length == NULL || output_offset == NULL || read_offset == NULL) {
+        rombp_log_err("Failed to grow the BPS plan to %ld commands\n", (long)capacity);
+        return -1;
+    }
+    plan->capacity = capacity;
+
+    return 0;
+}
+
+static void bps_plan_release(bps_plan* plan) {
+    free(plan->opcode);
+    free(plan->length);
+    free(plan->output_offset);
+    free(plan->read_offset);
+    plan->opcode = NULL;
+    plan->length = NULL;
+    plan->output_offset = NULL;
+    plan->read_offset = NULL;
+    plan->count = 0;
+    plan->capacity = 0;
+}
+
+// Decode the next command, which writes at output_offset. Its relative offset
+// is resolved, and it's checked against the source and target sizes from the
+// header. For target reads, *read_offset is the position of the payload,
+// which the caller still has to consume from the cursor.
+static rombp_patch_err bps_decode_command(bps_file_header* file_header, uint64_t output_offset,
+                                          uint8_t* command, uint64_t* length, uint64_t* read_offset) {
+    rombp_patch_cursor* cursor = &file_header->cursor;
+    uint64_t data;
+
+    if (decode_varint(cursor, &data) == -1) {
+        rombp_log_err("Couldn't get data for command and length\n");
+        return PATCH_ERR_IO;
+    }
+    *command = data & 3;
+    *length = (data >> 2) + 1;
+    if (output_offset + *length > file_header->target_size) {
+        rombp_log_err("BPS command writes past the target size, offset: %ld, length: %ld\n",
+                      (long)output_offset, (long)*length);
+        return PATCH_INVALID_OUTPUT_SIZE;
+    }
+
+    switch (*command) {
+        case BPS_SOURCE_READ:
+            *read_offset = output_offset;
+            if (*read_offset + *length > file_header->source_size) {
+                rombp_log_err("BPS source read past the end of the source, offset: %ld\n", (long)*read_offset);
+                return PATCH_INVALID_INPUT_SIZE;
+            }
+            break;
+        case BPS_TARGET_READ:
+            *read_offset = patch_cursor_pos(cursor);
+            break;
+        case BPS_SOURCE_COPY:
+            if (decode_varint(cursor, &data) == -1) {
+                rombp_log_err("Failed to decode source relative offset data\n");
+                return PATCH_ERR_IO;
+            }
+            file_header->source_relative_offset += (data & 1 ? -1 : 1) * (data >> 1);
+            *read_offset = file_header->source_relative_offset;
+            if (*read_offset + *length > file_header->source_size || *read_offset + *length < *read_offset) {
+                rombp_log_err("BPS source copy past the end of the source, offset: %ld\n", (long)*read_offset);
+                return PATCH_INVALID_INPUT_SIZE;
+            }
+            file_header->source_relative_offset += *length;
+            break;
+        case BPS_TARGET_COPY:
+            if (decode_varint(cursor, &data) == -1) {
+                rombp_log_err("Failed to decode target relative offset data\n");
+                return PATCH_ERR_IO;
+            }
+            file_header->target_relative_offset += (data & 1 ? -1 : 1) * (data >> 1);
+            *read_offset = file_header->target_relative_offset;
+            if (*read_offset >= output_offset) {
+                rombp_log_err("BPS target copy reads output that hasn't been written yet, offset: %ld\n",
+                              (long)*read_offset);
+                return PATCH_ERR_IO;
+            }
+            file_header->target_relative_offset += *length;
+            break;
+    }
+
+    return PATCH_OK;
+}
+
+// Decode the rest of the command stream into the plan, so nothing is written
+// for a patch that doesn't fit. The cursor ends up at the footer.
+static rombp_patch_err bps_plan_build(bps_file_header* file_header) {
+    rombp_patch_cursor* cursor = &file_header->cursor;
+    bps_plan* plan = &file_header->plan;
+    uint64_t output_offset = 0;
+    uint64_t end = file_header->patch_size - FOOTER_LENGTH;
+
+    while (patch_cursor_pos(cursor) < end) {
+        uint8_t command;
+        uint64_t length;
+        uint64_t read_offset;
+        rombp_patch_err err = bps_decode_command(file_header, output_offset, &command, &length, &read_offset);
+        if (err != PATCH_OK) {
+            return err;
+        }
+        if (command == BPS_TARGET_READ &&
+            (read_offset + length > end || patch_cursor_skip(cursor, length) != 0)) {
+            rombp_log_err("BPS target read past the end of the patch data, length: %ld\n", (long)length);
+            return PATCH_ERR_IO;
         }
 
-        rombp_hunk_iter_status werror = bps_write_output(file_header, output_file, buf, nread);
-        if (werror != HUNK_NEXT) {
-            rombp_log_err("Error during BPS source read, write error\n");
-            return werror;
+        if (bps_plan_reserve(plan) != 0) {
+            return PATCH_ERR_IO;
+        }
+        plan->opcode[plan->count] = command;
+        plan->length[plan->count] = length;
+        plan->output_offset[plan->count] = output_offset;
+        plan->read_offset[plan->count] = read_offset;
+        plan->count++;
+        if (command == BPS_SOURCE_READ || command == BPS_SOURCE_COPY) {
+            plan->source_end = MAX(plan->source_end, read_offset + length);
         }
+        output_offset += length;
+    }
 
-        remaining -= nread;
+    if (output_offset != file_header->target_size) {
+        rombp_log_err("BPS commands write %ld bytes, but the target size is: %ld\n",
+                      (long)output_offset, (long)file_header->target_size);
+        return PATCH_INVALID_OUTPUT_SIZE;
     }
 
-    return HUNK_NEXT;
+    return PATCH_OK;
 }
 
-static rombp_hunk_iter_status bps_target_read(bps_file_header* file_header, uint64_t length, FILE* output_file, FILE* bps_file) {
-    int pos = fseek(output_file, file_header->output_offset, SEEK_SET);
-    if (pos == -1) {
-        rombp_log_err("Failed to seek target file. err: %d\n", errno);
-        return HUNK_ERR_IO;
+// Start patching input into output. The whole patch is planned and checked
+// first, so nothing is written for a corrupt patch or a short input. Then the
+// output is resized to the target size from the header. When both the input
+// and the output can be mapped, every command runs as a memcpy, otherwise
+// bps_next() uses the positional I/O engine.
+rombp_patch_err bps_start(bps_file_header* file_header, rombp_io* input, rombp_io* output, rombp_io* patch) {
+    if (patch->ops->sequential || output->ops->sequential) {
+        return bps_start_stream(file_header, input, output, patch, 0);
     }
 
-    uint64_t remaining = length;
-    uint8_t buf[BUF_SIZE];
-        
-    while (remaining > 0) {
-        uint64_t target_read = MIN(BUF_SIZE, remaining);
-        size_t nread = fread(buf, sizeof(uint8_t), target_read, bps_file);
-        if (nread < target_read && ferror(bps_file)) {
-            rombp_log_err("Error during BPS target read, read patch error: %d\n", errno);
-            return HUNK_ERR_IO;
-        }
-        
-        rombp_hunk_iter_status werror = bps_write_output(file_header, output_file, buf, nread);
-        if (werror != HUNK_NEXT) {
-            rombp_log_err("Error during BPS target read, write error\n");
-            return werror;
+    rombp_patch_err err = bps_plan_patch(file_header, patch);
+    if (err != PATCH_OK) {
+        return err;
+    }
+    file_header->input = input;
+    file_header->output = output;
+
+    int64_t input_size = rombp_io_size(input);
+    if (input_size == -1) {
+        rombp_log_err("Failed to get input file size, error: %d\n", errno);
+        bps_release(file_header);
+        return PATCH_ERR_IO;
+    }
+    if (file_header->plan.source_end > (uint64_t)input_size) {
+        rombp_log_err("BPS patch reads past the end of the input file, input size: %ld, needed: %ld\n",
+                      (long)input_size, (long)file_header->plan.source_end);
+        bps_release(file_header);
+        return PATCH_INVALID_INPUT_SIZE;
+    }
+    int rc = rombp_io_resize(output, file_header->target_size);
+    if (rc != 0) {
+        rombp_log_err("Failed to resize output file to: %ld, errno: %d\n", (long)file_header->target_size, errno);
+        bps_release(file_header);
+        return PATCH_ERR_IO;
+    }
+
+    file_header->source_map_size = input_size;
+    file_header->source_map = rombp_io_map(input, 0, input_size);
+    file_header->target_map = rombp_io_map(output, 0, file_header->target_size);
+    if (file_header->source_map == NULL || file_header->target_map == NULL) {
+        file_header->source_map = NULL;
+        file_header->target_map = NULL;
+        rombp_log_info("BPS using positional I/O, input: %s, output: %s\n",
+                       rombp_io_name(input), rombp_io_name(output));
+    } else {
+        file_header->output_crc32_threads = patch_worker_count();
+        // Target reads from an unmapped patch need a backend that can be
+        // read from several threads.
+        if (file_header->patch_map != NULL || patch->ops->concurrent_reads) {
+            file_header->threads = file_header->output_crc32_threads;
         }
+        rombp_log_info("BPS files are memory mapped, threads: %d, output CRC32 threads: %d\n",
+                       file_header->threads, file_header->output_crc32_threads);
+    }
 
-        remaining -= nread;
+    rc = bps_source_check_start(&file_header->source_check, input, &file_header->expected_source_crc32);
+    if (rc != 0) {
+        bps_release(file_header);
+        return PATCH_ERR_IO;
     }
 
-    return HUNK_NEXT;
+    return PATCH_OK;
 }
 
-static rombp_hunk_iter_status bps_source_copy(bps_file_header* file_header, uint64_t length, FILE* input_file, FILE* output_file, FILE* bps_file) {
-    uint64_t data;
-    int rc = decode_varint(bps_file, &data);
-    if (rc == -1) {
-        rombp_log_err("Failed to decode source relative offset data\n");
-        return HUNK_ERR_IO;
+// Start patching in a single pass, for pipes: the patch is only read in
+// order, and the output only written in order. The footer, and the CRC32s in
+// it, are only read at the end, once all the output has been written. Target
+// copies can read at least window_size bytes back, 0 picks a default.
+rombp_patch_err bps_start_stream(bps_file_header* file_header, rombp_io* input, rombp_io* output, rombp_io* patch,
+                                 size_t window_size) {
+    file_header->source_check.active = 0;
+    file_header->patch_size = 0;
+    if (patch_cursor_init(&file_header->cursor, patch, BPS_MARKER_SIZE) == -1) {
+        rombp_log_err("Failed to start reading BPS file\n");
+        return PATCH_ERR_IO;
+    }
+    patch_cursor_crc_start(&file_header->cursor, rombp_crc32_update(0, BPS_EXPECTED_MARKER, BPS_MARKER_SIZE));
+    rombp_patch_err err = bps_read_header(file_header);
+    if (err != PATCH_OK) {
+        return err;
     }
-    file_header->source_relative_offset += (data & 1 ? -1 : 1) * (data >> 1);
-    rombp_log_info("Source relative offset is: %ld\n", file_header->source_relative_offset);
 
-    int pos = fseek(output_file, file_header->output_offset, SEEK_SET);
-    if (pos == -1) {
-        rombp_log_err("Failed to seek target file. err: %d\n", errno);
-        return HUNK_ERR_IO;
+    file_header->input = input;
+    file_header->output = output;
+    file_header->patch = patch;
+    file_header->patch_map = NULL;
+    file_header->streaming = 1;
+    file_header->out_keep = window_size > 0 ? window_size : STREAM_WINDOW_SIZE;
+    file_header->out_capacity = 2 * file_header->out_keep;
+    rombp_log_info("BPS streaming, output window: %ld bytes\n", (long)file_header->out_keep);
+
+    if (bps_source_check_start(&file_header->source_check, input, NULL) != 0) {
+        bps_release(file_header);
+        return PATCH_ERR_IO;
     }
 
-    pos = fseek(input_file, file_header->source_relative_offset, SEEK_SET);
-    if (pos == -1) {
-        rombp_log_err("Failed to seek target file. err: %d\n", errno);
-        return HUNK_ERR_IO;
+    return PATCH_OK;
+}
+
+void bps_release(bps_file_header* file_header) {
+    bps_source_check_stop(&file_header->source_check);
+    patch_cursor_destroy(&file_header->cursor);
+    bps_plan_release(&file_header->plan);
+    file_header->patch_map = NULL;
+    file_header->source_map = NULL;
+    file_header->target_map = NULL;
+    if (file_header->out_buf != NULL) {
+        free(file_header->out_buf);
+        file_header->out_buf = NULL;
+    }
+}
+
+// Target copy kernel: copy length bytes to dest from distance bytes before
+// it. The spec copies a byte at a time, so when distance < length the copy
+// reads its own output, and the first distance bytes repeat. Those are
+// replicated with memcpy calls that double in size, each one copying
+// everything written so far, which is always a whole number of periods.
+void bps_copy_repeat(uint8_t* dest, uint64_t distance, uint64_t length) {
+    const uint8_t* src = dest - distance;
+    if (distance >= length) {
+        memcpy(dest, src, length);
+        return;
+    }
+
+    if (distance == 1) {
+        memset(dest, src[0], length);
+        return;
+    }
+
+    memcpy(dest, src, distance);
+    uint64_t copied = distance;
+    while (copied < length) {
+        uint64_t amount = MIN(copied, length - copied);
+        memcpy(dest + copied, dest, amount);
+        copied += amount;
+    }
+}
+
+// Positional I/O engine. Files are only accessed at explicit offsets through
+// their I/O backends, so no shared file position moves around and several jobs
+// can run in one process. The output is always produced sequentially, so it's collected in
+// a write-behind buffer: out_buf holds the output bytes [out_start, output_offset),
+// and the ones from out_written on haven't been written to the output file yet.
+// The streaming engine uses the same buffer as its window of recent output.
+
+// Write out everything that hasn't been written yet.
+static int bps_output_flush(bps_file_header* file_header) {
+    int rc = rombp_io_write_full(file_header->output, file_header->out_buf + file_header->out_written,
+                                 file_header->out_len - file_header->out_written,
+                                 file_header->out_start + file_header->out_written);
+    if (rc != 0) {
+        rombp_log_err("BPS output write error: %d\n", errno);
+        return -1;
+    }
+    file_header->out_written = file_header->out_len;
+
+    return 0;
+}
+
+// Get space for up to want bytes at output_offset, flushing the buffer if it's
+// full. The bytes must be accounted for with bps_output_commit().
+static uint8_t* bps_output_reserve(bps_file_header* file_header, uint64_t want, size_t* nreserved) {
+    if (file_header->out_buf == NULL) {
+        file_header->out_buf = malloc(file_header->out_capacity);
+        if (file_header->out_buf == NULL) {
+            rombp_log_err("Failed to allocate %ld byte BPS output buffer\n", (long)file_header->out_capacity);
+            return NULL;
+        }
+        file_header->out_start = file_header->output_offset;
+        file_header->out_len = 0;
+        file_header->out_written = 0;
+    }
+    if (file_header->out_len == file_header->out_capacity) {
+        if (bps_output_flush(file_header) != 0) {
+            return NULL;
+        }
+        // Slide the last out_keep bytes to the front.
+        size_t keep = MIN(file_header->out_keep, file_header->out_len);
+        memmove(file_header->out_buf, file_header->out_buf + file_header->out_len - keep, keep);
+        file_header->out_start += file_header->out_len - keep;
+        file_header->out_len = keep;
+        file_header->out_written = keep;
     }
 
+    *nreserved = MIN(want, file_header->out_capacity - file_header->out_len);
+    return file_header->out_buf + file_header->out_len;
+}
+
+static void bps_output_commit(bps_file_header* file_header, size_t len) {
+    file_header->output_crc32 = rombp_crc32_update(file_header->output_crc32,
+                                                   file_header->out_buf + file_header->out_len, len);
+    file_header->out_len += len;
+    file_header->output_offset += len;
+}
+
+// Read back len bytes of earlier output, starting at offset. Bytes that are
+// still in the write-behind buffer are served from memory.
+static int bps_output_read(bps_file_header* file_header, uint64_t offset, uint8_t* dest, size_t len) {
+    if (len > 0 && offset < file_header->out_start && file_header->streaming) {
+        rombp_log_err("BPS target copy reads %ld bytes back, beyond the %ld byte output window\n",
+                      (long)(file_header->output_offset - offset), (long)file_header->out_keep);
+        return -1;
+    }
+    while (len > 0 && offset < file_header->out_start) {
+        size_t amount = MIN(len, file_header->out_start - offset);
+        ssize_t nread = rombp_io_read_at(file_header->output, dest, amount, offset);
+        if (nread <= 0) {
+            rombp_log_err("Error reading back BPS output at: %ld, error: %d\n", (long)offset, errno);
+            return -1;
+        }
+        dest += nread;
+        offset += nread;
+        len -= nread;
+    }
+    if (len > 0) {
+        memcpy(dest, file_header->out_buf + (offset - file_header->out_start), len);
+    }
+
+    return 0;
+}
+
+// Copy length bytes of the source file starting at offset to the output.
+static rombp_hunk_iter_status bps_copy_source(bps_file_header* file_header, uint64_t offset, uint64_t length) {
     uint64_t remaining = length;
-    uint8_t buf[BUF_SIZE];
 
     while (remaining > 0) {
-        uint64_t target_read = MIN(BUF_SIZE, remaining);
-        size_t nread = fread(buf, sizeof(uint8_t), target_read, input_file);
-        if (nread < target_read && ferror(input_file)) {
-            rombp_log_err("Error during BPS source read, error: %d\n", errno);
+        size_t amount;
+        uint8_t* buf = bps_output_reserve(file_header, remaining, &amount);
+        if (buf == NULL) {
             return HUNK_ERR_IO;
         }
-        rombp_hunk_iter_status werror = bps_write_output(file_header, output_file, buf, nread);
-        if (werror != HUNK_NEXT) {
-            rombp_log_err("Error during BPS source copy, write error\n");
-            return werror;
+        ssize_t nread = rombp_io_read_at(file_header->input, buf, amount, offset);
+        if (nread <= 0) {
+            rombp_log_err("Error during BPS source read at: %ld, error: %d\n", (long)offset, errno);
+            return HUNK_ERR_IO;
         }
-        file_header->source_relative_offset += nread;
+        bps_output_commit(file_header, nread);
+        offset += nread;
         remaining -= nread;
     }
 
     return HUNK_NEXT;
 }
 
-static rombp_hunk_iter_status bps_target_copy(bps_file_header* file_header, uint64_t length, FILE* output_file, FILE* bps_file) {
-    uint64_t data;
-    int rc = decode_varint(bps_file, &data);
-    if (rc == -1) {
-        rombp_log_err("Failed to decode target relative offset data\n");
-        return HUNK_ERR_IO;
+// Copy len bytes of the patch starting at offset, for target reads.
+static int bps_patch_read(bps_file_header* file_header, uint8_t* dest, size_t len, uint64_t offset) {
+    if (file_header->patch_map != NULL) {
+        memcpy(dest, file_header->patch_map + offset, len);
+        return 0;
+    }
+    if (rombp_io_read_full(file_header->patch, dest, len, offset) != 0) {
+        rombp_log_err("Error during BPS target read at: %ld, error: %d\n", (long)offset, errno);
+        return -1;
     }
-    file_header->target_relative_offset += (data & 1 ? -1 : 1) * (data >> 1);
-    rombp_log_info("Target relative offset is: %ld\n", file_header->target_relative_offset);
 
+    return 0;
+}
+
+static rombp_hunk_iter_status bps_target_read(bps_file_header* file_header, uint64_t offset, uint64_t length) {
     uint64_t remaining = length;
-    uint8_t buf[BUF_SIZE];
 
     while (remaining > 0) {
-        int pos = fseek(output_file, file_header->target_relative_offset, SEEK_SET);
-        if (pos == -1) {
-            rombp_log_err("Failed to seek target file. err: %d\n", errno);
+        size_t amount;
+        uint8_t* buf = bps_output_reserve(file_header, remaining, &amount);
+        if (buf == NULL) {
             return HUNK_ERR_IO;
         }
-
-        uint64_t target_read = MIN(BUF_SIZE, remaining);
-        size_t nread = fread(buf, sizeof(uint8_t), target_read, output_file);
-        if (nread < target_read && ferror(output_file)) {
-            rombp_log_err("Error during BPS target read, error: %d\n", errno);
+        if (bps_patch_read(file_header, buf, amount, offset) != 0) {
             return HUNK_ERR_IO;
         }
+        bps_output_commit(file_header, amount);
+        offset += amount;
+        remaining -= amount;
+    }
+
+    return HUNK_NEXT;
+}
 
-        pos = fseek(output_file, file_header->output_offset, SEEK_SET);
-        if (pos == -1) {
-            rombp_log_err("Failed to seek target file. err: %d\n", errno);
+static rombp_hunk_iter_status bps_target_copy(bps_file_header* file_header, uint64_t offset, uint64_t length) {
+    uint64_t distance = file_header->output_offset - offset;
+    uint64_t remaining = length;
+
+    while (remaining > 0) {
+        size_t amount;
+        uint8_t* buf = bps_output_reserve(file_header, remaining, &amount);
+        if (buf == NULL) {
             return HUNK_ERR_IO;
         }
-
-        rombp_hunk_iter_status werror = bps_write_output(file_header, output_file, buf, nread);
-        if (werror != HUNK_NEXT) {
-            rombp_log_err("Error during BPS target copy, write error\n");
-            return werror;
+        if (offset >= file_header->out_start) {
+            // What's read sits in the write-behind buffer, right before buf.
+            bps_copy_repeat(buf, distance, amount);
+        } else {
+            // Never read back more than the distance at once, so overlapping
+            // copies repeat the earlier output.
+            amount = MIN(amount, distance);
+            if (bps_output_read(file_header, offset, buf, amount) == -1) {
+                return HUNK_ERR_IO;
+            }
         }
+        bps_output_commit(file_header, amount);
+        offset += amount;
+        remaining -= amount;
+    }
 
-        file_header->target_relative_offset += nread;
-        remaining -= nread;
+    return HUNK_NEXT;
+}
+
+static rombp_hunk_iter_status bps_positional_run(bps_file_header* file_header, size_t i) {
+    const bps_plan* plan = &file_header->plan;
+
+    switch (plan->opcode[i]) {
+        case BPS_SOURCE_READ:
+        case BPS_SOURCE_COPY:
+            return bps_copy_source(file_header, plan->read_offset[i], plan->length[i]);
+        case BPS_TARGET_READ:
+            return bps_target_read(file_header, plan->read_offset[i], plan->length[i]);
+        case BPS_TARGET_COPY:
+            return bps_target_copy(file_header, plan->read_offset[i], plan->length[i]);
+        default:
+            rombp_log_err("Unknown BPS command: %d, aborting!\n", plan->opcode[i]);
+            return HUNK_ERR_IO;
+    }
+}
+
+// Streaming engine. Commands are decoded and run as they arrive, through the
+// positional engine's output buffer.
+
+static rombp_hunk_iter_status bps_stream_target_read(bps_file_header* file_header, uint64_t length) {
+    uint64_t remaining = length;
+
+    while (remaining > 0) {
+        size_t amount;
+        uint8_t* buf = bps_output_reserve(file_header, remaining, &amount);
+        if (buf == NULL) {
+            return HUNK_ERR_IO;
+        }
+        if (patch_cursor_read(&file_header->cursor, buf, amount) < amount) {
+            rombp_log_err("Error during BPS target read, patch ended early\n");
+            return HUNK_ERR_IO;
+        }
+        bps_output_commit(file_header, amount);
+        remaining -= amount;
     }
 
     return HUNK_NEXT;
 }
 
-rombp_hunk_iter_status bps_next(bps_file_header* file_header, FILE* input_file, FILE* output_file, FILE* bps_file) {
-    long pos = ftell(bps_file);
-    if (pos == -1) {
-        rombp_log_err("Failed to get current file position, error: %d\n", errno);
+static rombp_hunk_iter_status bps_stream_next(bps_file_header* file_header) {
+    // Without the patch size, the commands end where only a footer is left.
+    int done = patch_cursor_ends_within(&file_header->cursor, FOOTER_LENGTH);
+    if (done == -1) {
         return HUNK_ERR_IO;
     }
-    rombp_log_info("Position is: %ld\n", pos);
-    if (pos >= file_header->patch_size - FOOTER_LENGTH) {
+    if (done) {
         return HUNK_DONE;
     }
-    uint64_t data;
-    int rc = decode_varint(bps_file, &data);
-    if (rc == -1) {
-        rombp_log_err("Couldn't get data for command and length\n");
+
+    uint8_t command;
+    uint64_t length;
+    uint64_t read_offset;
+    if (bps_decode_command(file_header, file_header->output_offset, &command, &length, &read_offset) != PATCH_OK) {
         return HUNK_ERR_IO;
     }
-    uint64_t command = data & 3;
-    uint64_t length = (data >> 2) + 1;
-
-    rombp_log_info("Command is: %ld, length is: %ld\n", command, length);
 
     switch (command) {
         case BPS_SOURCE_READ:
-            return bps_source_read(file_header,
-                                   length,
-                                   input_file,
-                                   output_file);
-        case BPS_TARGET_READ:
-            return bps_target_read(file_header,
-                                   length,
-                                   output_file,
-                                   bps_file);
         case BPS_SOURCE_COPY:
-            return bps_source_copy(file_header,
-                                   length,
-                                   input_file,
-                                   output_file,
-                                   bps_file);
-        case BPS_TARGET_COPY: {
-            return bps_target_copy(file_header,
-                                   length,
-                                   output_file,
-                                   bps_file);
-        }
+            return bps_copy_source(file_header, read_offset, length);
+        case BPS_TARGET_READ:
+            return bps_stream_target_read(file_header, length);
+        case BPS_TARGET_COPY:
+            return bps_target_copy(file_header, read_offset, length);
         default:
-            rombp_log_err("Unknown BPS command: %ld, aborting!\n", (long)command);
+            rombp_log_err("Unknown BPS command: %d, aborting!\n", command);
             return HUNK_ERR_IO;
     }
+}
+
+// Read the footer at the end of a streamed patch, and check the patch CRC32
+// and the output size.
+static rombp_patch_err bps_stream_read_footer(bps_file_header* file_header) {
+    uint32_t crc = patch_cursor_crc(&file_header->cursor);
+    if (patch_cursor_read(&file_header->cursor, file_header->footer, FOOTER_LENGTH) < FOOTER_LENGTH) {
+        rombp_log_err("BPS patch ended before its footer\n");
+        return PATCH_ERR_IO;
+    }
+    file_header->expected_source_crc32 = le_32bit_int(file_header->footer);
+    file_header->expected_target_crc32 = le_32bit_int(file_header->footer + 4);
+    file_header->expected_patch_crc32 = le_32bit_int(file_header->footer + 8);
+
+    crc = rombp_crc32_update(crc, file_header->footer, FOOTER_LENGTH - 4);
+    if (crc != file_header->expected_patch_crc32) {
+        rombp_log_err("Patch CRC32 doesn't match, the patch file is corrupt. Expected: %u, got: %u\n",
+                      file_header->expected_patch_crc32, crc);
+        return PATCH_INVALID_PATCH_CHECKSUM;
+    }
+    if (file_header->output_offset != file_header->target_size) {
+        rombp_log_err("BPS commands write %ld bytes, but the target size is: %ld\n",
+                      (long)file_header->output_offset, (long)file_header->target_size);
+        return PATCH_INVALID_OUTPUT_SIZE;
+    }
+
+    return PATCH_OK;
+}
+
+// Mapped engine. Every command is a memcpy between the maps.
+
+// The output bytes [output_offset, output_offset + length) have been written to the
+// target map, account for them.
+static rombp_hunk_iter_status bps_mapped_advance(bps_file_header* file_header, uint64_t length) {
+    if (file_header->output_crc32_threads <= 1) {
+        file_header->output_crc32 = rombp_crc32_update(file_header->output_crc32,
+                                                       file_header->target_map + file_header->output_offset, length);
+    }
+    file_header->output_offset += length;
 
     return HUNK_NEXT;
 }
 
-rombp_patch_err bps_end(bps_file_header* file_header, FILE* bps_file) {
-    uint32_t footer[FOOTER_ITEMS];
+// Run command i of the plan. Only writes its own output range, so commands
+// can run on any thread once the output they read is there.
+static int bps_mapped_apply(bps_file_header* file_header, size_t i) {
+    const bps_plan* plan = &file_header->plan;
+    uint64_t length = plan->length[i];
+    uint64_t offset = plan->read_offset[i];
+    uint8_t* dest = file_header->target_map + plan->output_offset[i];
+
+    switch (plan->opcode[i]) {
+        case BPS_SOURCE_READ:
+        case BPS_SOURCE_COPY:
+            memcpy(dest, file_header->source_map + offset, length);
+            break;
+        case BPS_TARGET_READ:
+            if (bps_patch_read(file_header, dest, length, offset) != 0) {
+                return -1;
+            }
+            break;
+        case BPS_TARGET_COPY:
+            bps_copy_repeat(dest, plan->output_offset[i] - offset, length);
+            break;
+        default:
+            rombp_log_err("Unknown BPS command: %d, aborting!\n", plan->opcode[i]);
+            return -1;
+    }
+
+    return 0;
+}
+
+static rombp_hunk_iter_status bps_mapped_run(bps_file_header* file_header, size_t i) {
+    if (bps_mapped_apply(file_header, i) != 0) {
+        return HUNK_ERR_IO;
+    }
+    return bps_mapped_advance(file_header, file_header->plan.length[i]);
+}
+
+// Parallel executor. A batch of commands is split into consecutive regions of
+// about the same cost, one per worker. Only target copies read output, and
+// always output from before their own, so every worker first runs the other
+// commands of its region, then its target copies in order. Before a target
+// copy, the worker waits until the regions it reads from are ready up to
+// there. Every wait is for output at lower offsets, so this can't deadlock.
+
+typedef struct bps_batch {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t count;
+    // Output range of each region
+    const uint64_t* start;
+    const uint64_t* end;
+    // Output of each region is final up to here, under lock
+    uint64_t* ready;
+} bps_batch;
+
+typedef struct bps_worker {
+    bps_file_header* file_header;
+    bps_batch* batch;
+    size_t region;
+    size_t first;
+    size_t last;
+    int rc;
+    pthread_t thread;
+    int started;
+} bps_worker;
+
+static void bps_batch_publish(bps_batch* batch, size_t region, uint64_t ready) {
+    pthread_mutex_lock(&batch->lock);
+    batch->ready[region] = ready;
+    pthread_cond_broadcast(&batch->cond);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+// Wait until the output [from, to) is final. Output before the batch already is.
+static void bps_batch_wait(bps_batch* batch, uint64_t from, uint64_t to) {
+    pthread_mutex_lock(&batch->lock);
+    for (size_t r = 0; r < batch->count && batch->start[r] < to; r++) {
+        if (batch->end[r] <= from) {
+            continue;
+        }
+        uint64_t needed = MIN(to, batch->end[r]);
+        while (batch->ready[r] < needed) {
+            pthread_cond_wait(&batch->cond, &batch->lock);
+        }
+    }
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static void* bps_worker_run(void* arg) {
+    bps_worker* worker = arg;
+    bps_file_header* file_header = worker->file_header;
+    const bps_plan* plan = &file_header->plan;
+
+    worker->rc = 0;
+    for (size_t i = worker->first; i < worker->last && worker->rc == 0; i++) {
+        if (plan->opcode[i] != BPS_TARGET_COPY && bps_mapped_apply(file_header, i) != 0) {
+            worker->rc = -1;
+        }
+    }
+    for (size_t i = worker->first; i < worker->last && worker->rc == 0; i++) {
+        if (plan->opcode[i] != BPS_TARGET_COPY) {
+            continue;
+        }
+        // Everything before this copy in the region is done. A copy that
+        // overlaps itself only waits for the part before its own output.
+        uint64_t output_offset = plan->output_offset[i];
+        bps_batch_publish(worker->batch, worker->region, output_offset);
+        bps_batch_wait(worker->batch, plan->read_offset[i],
+                       MIN(plan->read_offset[i] + plan->length[i], output_offset));
+        if (bps_mapped_apply(file_header, i) != 0) {
+            worker->rc = -1;
+        }
+    }
+    // Also on failure, nobody may be left waiting for this region.
+    bps_batch_publish(worker->batch, worker->region, worker->batch->end[worker->region]);
+
+    return NULL;
+}
 
-    size_t nread = fread(&footer, sizeof(uint32_t), FOOTER_ITEMS, bps_file);
-    if (nread < FOOTER_LENGTH && ferror(bps_file)) {
-        rombp_log_err("Error reading BPS footer: %d\n", errno);
+// Every command costs about this many bytes of copying on top of its length.
+static const uint64_t BPS_COMMAND_COST = 64;
+static const uint64_t BPS_BATCH_COST = 16 * 1024 * 1024;
+static const uint64_t BPS_MIN_WORKER_COST = 256 * 1024;
+
+// Run the next batch of commands on up to file_header->threads threads. The
+// calling thread takes the first region.
+static rombp_hunk_iter_status bps_next_parallel(bps_file_header* file_header) {
+    const bps_plan* plan = &file_header->plan;
+
+    uint64_t cost = 0;
+    size_t end = file_header->plan_next;
+    while (end < plan->count && cost < BPS_BATCH_COST) {
+        cost += plan->length[end++] + BPS_COMMAND_COST;
+    }
+
+    size_t count = MIN((uint64_t)file_header->threads, MAX(cost / BPS_MIN_WORKER_COST, 1));
+    bps_worker workers[count];
+    uint64_t start[count];
+    uint64_t region_end[count];
+    uint64_t ready[count];
+    bps_batch batch = { .count = count, .start = start, .end = region_end, .ready = ready };
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.cond, NULL);
+
+    uint64_t done = 0;
+    size_t first = file_header->plan_next;
+    for (size_t w = 0; w < count; w++) {
+        size_t last = first;
+        uint64_t target = cost * (w + 1) / count;
+        while (last < end && (done < target || w == count - 1)) {
+            done += plan->length[last++] + BPS_COMMAND_COST;
+        }
+        start[w] = first < end ? plan->output_offset[first] : file_header->target_size;
+        region_end[w] = last > first ? plan->output_offset[last - 1] + plan->length[last - 1] : start[w];
+        ready[w] = start[w];
+        workers[w] = (bps_worker){
+            .file_header = file_header,
+            .batch = &batch,
+            .region = w,
+            .first = first,
+            .last = last,
+            .rc = 0,
+            .started = 0,
+        };
+        first = last;
+    }
+    // Start the threads once every region is known, workers wait on each other's.
+    for (size_t w = 1; w < count; w++) {
+        workers[w].started = pthread_create(&workers[w].thread, NULL, bps_worker_run, &workers[w]) == 0;
+    }
+
+    // A region that failed to start runs here, after every region before it.
+    int rc = 0;
+    for (size_t w = 0; w < count; w++) {
+        if (workers[w].started) {
+            pthread_join(workers[w].thread, NULL);
+        } else {
+            bps_worker_run(&workers[w]);
+        }
+        if (workers[w].rc != 0) {
+            rombp_log_err("Failed to patch BPS commands %ld to %ld\n", (long)workers[w].first, (long)workers[w].last);
+            rc = -1;
+        }
+    }
+    pthread_cond_destroy(&batch.cond);
+    pthread_mutex_destroy(&batch.lock);
+
+    // The output CRC32 is computed in bps_end(), on the same threads.
+    file_header->output_offset = region_end[count - 1];
+    file_header->plan_next = end;
+
+    return rc == 0 ? HUNK_NEXT : HUNK_ERR_IO;
+}
+
+rombp_hunk_iter_status bps_next(bps_file_header* file_header) {
+    // Stop early when patching the wrong source, bps_end() reports it.
+    switch (bps_source_check_get(&file_header->source_check)) {
+        case SOURCE_CHECK_MISMATCH:
+            return HUNK_DONE;
+        case SOURCE_CHECK_ERR_IO:
+            return HUNK_ERR_IO;
+        default:
+            break;
+    }
+
+    if (file_header->streaming) {
+        return bps_stream_next(file_header);
+    }
+    if (file_header->plan_next == file_header->plan.count) {
+        return HUNK_DONE;
+    }
+    if (file_header->target_map != NULL && file_header->threads > 1) {
+        return bps_next_parallel(file_header);
+    }
+    size_t i = file_header->plan_next++;
+
+    if (file_header->target_map != NULL) {
+        return bps_mapped_run(file_header, i);
+    }
+    return bps_positional_run(file_header, i);
+}
+
+rombp_patch_err bps_end(bps_file_header* file_header) {
+    bps_source_check_state source_state = bps_source_check_wait(&file_header->source_check);
+    if (source_state == SOURCE_CHECK_HASHED) {
+        rombp_patch_err err = bps_stream_read_footer(file_header);
+        if (err != PATCH_OK) {
+            bps_release(file_header);
+            return err;
+        }
+        if (file_header->source_check.crc != file_header->expected_source_crc32) {
+            rombp_log_err("Source CRC32 doesn't match the patch, expected: %u, got: %u\n",
+                          file_header->expected_source_crc32, file_header->source_check.crc);
+            source_state = SOURCE_CHECK_MISMATCH;
+        } else {
+            rombp_log_info("Source file CRC32 is correct\n");
+            source_state = SOURCE_CHECK_MATCH;
+        }
+    }
+    if (source_state != SOURCE_CHECK_MATCH) {
+        bps_release(file_header);
+        return source_state == SOURCE_CHECK_MISMATCH ? PATCH_INVALID_INPUT_CHECKSUM : PATCH_ERR_IO;
+    }
+
+    if (file_header->out_len > file_header->out_written && bps_output_flush(file_header) != 0) {
+        bps_release(file_header);
         return PATCH_ERR_IO;
     }
 
-    uint32_t expected_output_crc32 = footer[1];
-    if (file_header->output_crc32 != expected_output_crc32) {
-        rombp_log_err("Footer output CRC32 and expected CRC32 do not match! Expected: %d, got: %d\n",
-                      expected_output_crc32, file_header->output_crc32);
+    if (file_header->output_crc32_threads > 1) {
+        file_header->output_crc32 = rombp_crc32_update_parallel(0, file_header->target_map, file_header->output_offset,
+                                                                file_header->output_crc32_threads);
+    }
+
+    bps_release(file_header);
+
+    if (file_header->output_crc32 != file_header->expected_target_crc32) {
+        rombp_log_err("Footer output CRC32 and expected CRC32 do not match! Expected: %u, got: %u\n",
+                      file_header->expected_target_crc32, file_header->output_crc32);
         return PATCH_INVALID_OUTPUT_CHECKSUM;
     }
 
     rombp_log_info("Output file CRC32 is correct\n");
     return PATCH_OK;
 }
+
+// Read a whole patch into file_header->plan, without applying it. Checks the
+// commands against the header sizes, and the patch CRC32. On success, the
+// caller releases the header with bps_release().
+rombp_patch_err bps_plan_patch(bps_file_header* file_header, rombp_io* patch) {
+    rombp_patch_err err = bps_open_patch(file_header, patch);
+    if (err != PATCH_OK) {
+        return err;
+    }
+    file_header->patch = patch;
+    file_header->patch_map = rombp_io_map(patch, 0, file_header->patch_size);
+
+    err = bps_plan_build(file_header);
+    if (err == PATCH_OK) {
+        err = bps_check_patch_crc(file_header);
+    }
+    if (err != PATCH_OK) {
+        bps_release(file_header);
+        return err;
+    }
+    // Everything else is read through the plan.
+    patch_cursor_destroy(&file_header->cursor);
+    rombp_log_info("BPS plan has %ld commands\n", (long)file_header->plan.count);
+
+    return PATCH_OK;
+}
+
+// Check a patch without applying it. Only the patch is read.
+rombp_patch_err bps_validate(rombp_io* patch) {
+    bps_file_header file_header;
+
+    rombp_patch_err err = bps_plan_patch(&file_header, patch);
+    if (err != PATCH_OK) {
+        return err;
+    }
+    rombp_log_info("BPS patch is valid, commands: %ld\n", (long)file_header.plan.count);
+    bps_release(&file_header);
+
+    return PATCH_OK;
+}
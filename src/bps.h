@@ -1,11 +1,60 @@
 #ifndef ROMPB_BPS_H_
 #define ROMPB_BPS_H_
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 
+#include "cursor.h"
+#include "io.h"
 #include "patch.h"
 
+typedef enum bps_source_check_state {
+    SOURCE_CHECK_RUNNING = 0,
+    SOURCE_CHECK_MATCH = 1,
+    SOURCE_CHECK_MISMATCH = 2,
+    SOURCE_CHECK_ERR_IO = 3,
+    // The CRC32 is in crc, the footer with the expected one wasn't read yet
+    SOURCE_CHECK_HASHED = 4,
+} bps_source_check_state;
+
+// Verifies the source CRC32 from the footer on a helper thread, while the
+// patch is being applied.
+typedef struct bps_source_check {
+    pthread_mutex_t lock;
+    pthread_t thread;
+    int active;       // lock is initialized
+    int started;      // thread is running, and needs joining
+    int cancel;
+    bps_source_check_state state;
+    rombp_io* input;
+    int expected_known;
+    uint32_t expected_crc32;
+    uint32_t crc;
+} bps_source_check;
+
+typedef enum bps_command_type {
+    BPS_SOURCE_READ = 0,
+    BPS_TARGET_READ = 1,
+    BPS_SOURCE_COPY = 2,
+    BPS_TARGET_COPY = 3,
+} bps_command_type;
+
+// The command stream of a patch, decoded up front into parallel arrays, one
+// entry per command, with the relative offsets already resolved. read_offset
+// is the absolute offset in the source for source reads and copies, in the
+// target for target copies, and in the patch for target read payloads.
+typedef struct bps_plan {
+    size_t count;
+    size_t capacity;
+    uint8_t* opcode;
+    uint64_t* length;
+    uint64_t* output_offset;
+    uint64_t* read_offset;
+    // Source bytes the patch reads, [0, source_end)
+    uint64_t source_end;
+} bps_plan;
+
 typedef struct bps_file_header {
     uint64_t source_size;
     uint64_t target_size;
@@ -18,11 +67,65 @@ typedef struct bps_file_header {
     uint64_t target_relative_offset;
 
     uint32_t output_crc32;
+    // When above 1, the mapped engine leaves output_crc32 alone, and bps_end()
+    // hashes the whole target map on this many threads instead.
+    int output_crc32_threads;
+
+    // From the footer
+    uint8_t footer[12];
+    uint32_t expected_source_crc32;
+    uint32_t expected_target_crc32;
+    uint32_t expected_patch_crc32;
+    bps_source_check source_check;
+
+    rombp_io* input;
+    rombp_io* output;
+    rombp_io* patch;
+    // Target read payloads come straight from here when the patch is mapped.
+    const uint8_t* patch_map;
+
+    bps_plan plan;
+    size_t plan_next;
+
+    // Mapped engine state, only set when both the input and output backends
+    // can map their data. When target_map is NULL, bps_next() runs the plan
+    // with positional I/O.
+    const uint8_t* source_map;
+    uint8_t* target_map;
+    uint64_t source_map_size;
+    // Commands run in batches on this many threads, see bps_next(). Picked
+    // by bps_start(), like output_crc32_threads, and both can be lowered
+    // before the first bps_next().
+    int threads;
+
+    // Streaming engine: commands are decoded and run one at a time, and the
+    // patch size isn't known until the footer is reached.
+    int streaming;
+
+    // Positional I/O and streaming engine output buffer, holding the output
+    // bytes [out_start, output_offset). The first out_written bytes have
+    // been written to the output already. When the buffer is full, the last
+    // out_keep bytes stay in it, for target copies that can't read the
+    // output back.
+    uint8_t* out_buf;
+    uint64_t out_start;
+    size_t out_len;
+    size_t out_written;
+    size_t out_capacity;
+    size_t out_keep;
+
+    rombp_patch_cursor cursor;
 } bps_file_header;
 
-rombp_patch_err bps_verify_marker(FILE* bps_file);
-rombp_patch_err bps_start(FILE* bps_file, bps_file_header* file_header);
-rombp_hunk_iter_status bps_next(bps_file_header* file_header, FILE* input_file, FILE* output_file, FILE* bps_file);
-rombp_patch_err bps_end(bps_file_header* file_header, FILE* bps_file);
+rombp_patch_err bps_verify_marker(rombp_io* patch);
+rombp_patch_err bps_start(bps_file_header* file_header, rombp_io* input, rombp_io* output, rombp_io* patch);
+rombp_patch_err bps_start_stream(bps_file_header* file_header, rombp_io* input, rombp_io* output, rombp_io* patch,
+                                 size_t window_size);
+rombp_hunk_iter_status bps_next(bps_file_header* file_header);
+rombp_patch_err bps_end(bps_file_header* file_header);
+void bps_release(bps_file_header* file_header);
+rombp_patch_err bps_plan_patch(bps_file_header* file_header, rombp_io* patch);
+rombp_patch_err bps_validate(rombp_io* patch);
+void bps_copy_repeat(uint8_t* dest, uint64_t distance, uint64_t length);
 
 #endif
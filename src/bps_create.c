@@ -0,0 +1,577 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "bps_create.h"
+#include "bps_writer.h"
+#include "crc32.h"
+#include "log.h"
+
+// Suffix array encoder. The suffix arrays of the source and of the target
+// are built at the same time, each on its own thread, with SA-IS. Target
+// bytes are then matched in order: against the source with a binary search
+// of its array, and against the target before them through the suffixes
+// next to theirs in the target array.
+
+#define CREATE_MAX_THREADS 64
+
+static const uint32_t SAIS_EMPTY = UINT32_MAX;
+// Shortest match worth a command, instead of more target read bytes
+static const uint64_t CREATE_MIN_MATCH = 6;
+// Suffixes looked at on each side of a target position's rank
+static const uint32_t CREATE_MAX_CANDIDATES = 256;
+// Threads aren't worth it for fewer suffixes than this each
+static const uint64_t CREATE_MIN_THREAD_SUFFIXES = 1 << 16;
+// Source suffixes are bucketed by their first two bytes
+#define CREATE_PAIRS (1 << 16)
+
+// A text to sort the suffixes of: bytes, or the names of a reduced problem.
+// Past its end is a virtual sentinel, smaller than every symbol.
+typedef struct sais_text {
+    const uint8_t* bytes;
+    const uint32_t* names;
+    uint32_t size;
+    uint32_t alphabet;
+} sais_text;
+
+static inline uint32_t sais_symbol(const sais_text* text, uint32_t i) {
+    return text->bytes != NULL ? text->bytes[i] : text->names[i];
+}
+
+// S-type suffixes are smaller than the one after them, L-type ones bigger.
+static inline int sais_is_s(const uint8_t* types, uint32_t i) {
+    return (types[i >> 3] >> (i & 7)) & 1;
+}
+
+static inline int sais_is_lms(const uint8_t* types, uint32_t i) {
+    return i > 0 && sais_is_s(types, i) && !sais_is_s(types, i - 1);
+}
+
+// The start, or the end, of every symbol's bucket.
+static void sais_buckets(const sais_text* text, uint32_t* buckets, int ends) {
+    memset(buckets, 0, text->alphabet * sizeof(uint32_t));
+    for (uint32_t i = 0; i < text->size; i++) {
+        buckets[sais_symbol(text, i)]++;
+    }
+    uint32_t sum = 0;
+    for (uint32_t c = 0; c < text->alphabet; c++) {
+        sum += buckets[c];
+        buckets[c] = ends ? sum : sum - buckets[c];
+    }
+}
+
+// Sort the L-type suffixes from the sorted LMS ones in sa, then the S-type
+// ones from those.
+static void sais_induce(const sais_text* text, const uint8_t* types, uint32_t* sa, uint32_t* buckets) {
+    uint32_t n = text->size;
+
+    // The last suffix comes right after the sentinel.
+    sais_buckets(text, buckets, 0);
+    sa[buckets[sais_symbol(text, n - 1)]++] = n - 1;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t j = sa[i];
+        if (j != SAIS_EMPTY && j > 0 && !sais_is_s(types, j - 1)) {
+            sa[buckets[sais_symbol(text, j - 1)]++] = j - 1;
+        }
+    }
+
+    sais_buckets(text, buckets, 1);
+    for (uint32_t i = n; i-- > 0;) {
+        uint32_t j = sa[i];
+        if (j != SAIS_EMPTY && j > 0 && sais_is_s(types, j - 1)) {
+            sa[--buckets[sais_symbol(text, j - 1)]] = j - 1;
+        }
+    }
+}
+
+// Whether the LMS substrings at a and b, up to and including the next LMS
+// position, are the same. The one that runs into the sentinel is unique.
+static int sais_lms_equal(const sais_text* text, const uint8_t* types, uint32_t a, uint32_t b) {
+    for (uint32_t d = 0;; d++) {
+        if (a + d == text->size || b + d == text->size) {
+            return 0;
+        }
+        if (sais_symbol(text, a + d) != sais_symbol(text, b + d) ||
+            sais_is_s(types, a + d) != sais_is_s(types, b + d)) {
+            return 0;
+        }
+        if (d > 0 && sais_is_lms(types, a + d)) {
+            return 1;
+        }
+    }
+}
+
+// Sort the suffixes of text into sa, which has text->size entries. The
+// reduced problem is solved in sa as well, so besides sa this takes a bit
+// per symbol and a bucket per distinct symbol at each level.
+static int sais(const sais_text* text, uint32_t* sa) {
+    uint32_t n = text->size;
+    if (n <= 1) {
+        if (n == 1) {
+            sa[0] = 0;
+        }
+        return 0;
+    }
+
+    uint8_t* types = calloc((n + 7) / 8, 1);
+    uint32_t* buckets = malloc(text->alphabet * sizeof(uint32_t));
+    if (types == NULL || buckets == NULL) {
+        free(types);
+        free(buckets);
+        return -1;
+    }
+    // The last suffix is bigger than the sentinel after it.
+    for (uint32_t i = n - 1; i-- > 0;) {
+        uint32_t c = sais_symbol(text, i);
+        uint32_t next = sais_symbol(text, i + 1);
+        if (c < next || (c == next && sais_is_s(types, i + 1))) {
+            types[i >> 3] |= 1 << (i & 7);
+        }
+    }
+
+    // Sort the LMS substrings, by inducing from them in any order.
+    for (uint32_t i = 0; i < n; i++) {
+        sa[i] = SAIS_EMPTY;
+    }
+    sais_buckets(text, buckets, 1);
+    for (uint32_t i = n - 1; i > 0; i--) {
+        if (sais_is_lms(types, i)) {
+            sa[--buckets[sais_symbol(text, i)]] = i;
+        }
+    }
+    sais_induce(text, types, sa, buckets);
+
+    // Name them in order. LMS positions are at least 2 apart, so the names
+    // fit in the second half of sa by position, and are then packed at its
+    // end as the reduced text.
+    uint32_t lms_count = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (sais_is_lms(types, sa[i])) {
+            sa[lms_count++] = sa[i];
+        }
+    }
+    for (uint32_t i = lms_count; i < n; i++) {
+        sa[i] = SAIS_EMPTY;
+    }
+    uint32_t names = 0;
+    for (uint32_t i = 0; i < lms_count; i++) {
+        if (i == 0 || !sais_lms_equal(text, types, sa[i], sa[i - 1])) {
+            names++;
+        }
+        sa[lms_count + sa[i] / 2] = names - 1;
+    }
+    uint32_t* reduced = sa + n - lms_count;
+    for (uint32_t i = n, j = n; i-- > lms_count;) {
+        if (sa[i] != SAIS_EMPTY) {
+            sa[--j] = sa[i];
+        }
+    }
+
+    // Sort the LMS suffixes, recursing while their names aren't unique.
+    // This level's buckets aren't needed meanwhile.
+    free(buckets);
+    if (names < lms_count) {
+        sais_text reduced_text = { .names = reduced, .size = lms_count, .alphabet = names };
+        if (sais(&reduced_text, sa) != 0) {
+            free(types);
+            return -1;
+        }
+    } else {
+        for (uint32_t i = 0; i < lms_count; i++) {
+            sa[reduced[i]] = i;
+        }
+    }
+    buckets = malloc(text->alphabet * sizeof(uint32_t));
+    if (buckets == NULL) {
+        free(types);
+        return -1;
+    }
+
+    // Put the sorted LMS suffixes at the ends of their buckets, and induce
+    // the rest from them.
+    for (uint32_t i = 1, j = 0; i < n; i++) {
+        if (sais_is_lms(types, i)) {
+            reduced[j++] = i;
+        }
+    }
+    for (uint32_t i = 0; i < lms_count; i++) {
+        sa[i] = reduced[sa[i]];
+    }
+    for (uint32_t i = lms_count; i < n; i++) {
+        sa[i] = SAIS_EMPTY;
+    }
+    sais_buckets(text, buckets, 1);
+    for (uint32_t i = lms_count; i-- > 0;) {
+        uint32_t j = sa[i];
+        sa[i] = SAIS_EMPTY;
+        sa[--buckets[sais_symbol(text, j)]] = j;
+    }
+    sais_induce(text, types, sa, buckets);
+
+    free(buckets);
+    free(types);
+    return 0;
+}
+
+// Memory sais() takes besides sa, for n bytes: the type bits of every
+// level, and the buckets of the biggest reduced problem.
+static uint64_t sais_scratch_size(uint64_t n) {
+    return n / 4 + 16 + MAX(n / 2, 256) * sizeof(uint32_t);
+}
+
+typedef struct create_index {
+    const uint8_t* source;
+    uint64_t source_size;
+    const uint8_t* target;
+    uint64_t target_size;
+    uint32_t* source_sa;
+    // [p] is the rank of the first source suffix starting with the pair p,
+    // a suffix of one byte c counting as the pair c, 0
+    uint32_t* source_pairs;
+    uint32_t* target_sa;
+    uint32_t* target_rank;  // Inverse of target_sa
+    uint32_t* target_lcp;   // [r] is the match between the suffixes ranked r - 1 and r
+    int threads;
+} create_index;
+
+typedef struct create_sort {
+    sais_text text;
+    uint32_t* sa;
+    int rc;
+    pthread_t thread;
+    int started;
+} create_sort;
+
+static void* create_sort_run(void* arg) {
+    create_sort* sort = arg;
+    sort->rc = sais(&sort->text, sort->sa);
+    return NULL;
+}
+
+// A step of building the index, run on every thread over its share of the
+// target.
+typedef struct create_worker {
+    create_index* index;
+    void (*run)(create_index* index, uint32_t start, uint32_t end);
+    uint32_t start;
+    uint32_t end;
+    pthread_t thread;
+    int started;
+} create_worker;
+
+static void* create_worker_run(void* arg) {
+    create_worker* worker = arg;
+    worker->run(worker->index, worker->start, worker->end);
+    return NULL;
+}
+
+// The first share, and any whose thread can't be started, run on this
+// thread.
+static void create_parallel(create_index* index, void (*run)(create_index* index, uint32_t start, uint32_t end)) {
+    create_worker workers[CREATE_MAX_THREADS];
+    int threads = index->threads;
+    uint64_t size = index->target_size;
+
+    for (int t = 0; t < threads; t++) {
+        workers[t].index = index;
+        workers[t].run = run;
+        workers[t].start = size * t / threads;
+        workers[t].end = size * (t + 1) / threads;
+        workers[t].started = t > 0 && pthread_create(&workers[t].thread, NULL, create_worker_run, &workers[t]) == 0;
+    }
+    for (int t = 0; t < threads; t++) {
+        if (workers[t].started) {
+            pthread_join(workers[t].thread, NULL);
+        } else {
+            create_worker_run(&workers[t]);
+        }
+    }
+}
+
+static void create_rank(create_index* index, uint32_t start, uint32_t end) {
+    for (uint32_t r = start; r < end; r++) {
+        index->target_rank[index->target_sa[r]] = r;
+    }
+}
+
+// Kasai's algorithm, over a share of the target positions. Every share
+// starts over from a match of 0.
+static void create_lcp(create_index* index, uint32_t start, uint32_t end) {
+    const uint8_t* target = index->target;
+    uint64_t length = 0;
+    for (uint32_t i = start; i < end; i++) {
+        uint32_t r = index->target_rank[i];
+        if (r == 0) {
+            index->target_lcp[0] = 0;
+            length = 0;
+            continue;
+        }
+        uint32_t j = index->target_sa[r - 1];
+        while (i + length < index->target_size && j + length < index->target_size &&
+               target[i + length] == target[j + length]) {
+            length++;
+        }
+        index->target_lcp[r] = length;
+        if (length > 0) {
+            length--;
+        }
+    }
+}
+
+// Count the source suffixes by their first two bytes, in the order they're
+// sorted in.
+static void create_pairs(create_index* index) {
+    uint32_t* pairs = index->source_pairs;
+    memset(pairs, 0, (CREATE_PAIRS + 1) * sizeof(uint32_t));
+    for (uint64_t i = 0; i + 1 < index->source_size; i++) {
+        pairs[index->source[i] << 8 | index->source[i + 1]]++;
+    }
+    if (index->source_size > 0) {
+        pairs[index->source[index->source_size - 1] << 8]++;
+    }
+    uint32_t sum = 0;
+    for (uint32_t p = 0; p <= CREATE_PAIRS; p++) {
+        uint32_t count = pairs[p];
+        pairs[p] = sum;
+        sum += count;
+    }
+}
+
+static int create_index_build(create_index* index, int threads) {
+    create_sort sorts[2] = {
+        { .text = { .bytes = index->source, .size = index->source_size, .alphabet = 256 }, .sa = index->source_sa },
+        { .text = { .bytes = index->target, .size = index->target_size, .alphabet = 256 }, .sa = index->target_sa },
+    };
+    sorts[0].started = threads > 1 && pthread_create(&sorts[0].thread, NULL, create_sort_run, &sorts[0]) == 0;
+    create_sort_run(&sorts[1]);
+    if (sorts[0].started) {
+        pthread_join(sorts[0].thread, NULL);
+    } else {
+        create_sort_run(&sorts[0]);
+    }
+    if (sorts[0].rc != 0 || sorts[1].rc != 0) {
+        rombp_log_err("Failed to allocate suffix sorting buckets\n");
+        return -1;
+    }
+
+    create_pairs(index);
+    create_parallel(index, create_rank);
+    create_parallel(index, create_lcp);
+    return 0;
+}
+
+typedef struct create_match {
+    uint64_t offset;    // In the source, or in the target for target copies
+    uint64_t length;
+    int target_copy;
+} create_match;
+
+// Binary search the source suffixes for the longest match of the target
+// bytes at position, within those starting with the same two bytes. Bytes
+// that both ends of the range already match are skipped.
+static void create_source_match(const create_index* index, uint64_t position, create_match* best) {
+    const uint8_t* needle = index->target + position;
+    uint64_t needle_size = index->target_size - position;
+    if (needle_size < 2) {
+        return;
+    }
+    uint32_t pair = needle[0] << 8 | needle[1];
+    int64_t lo = (int64_t)index->source_pairs[pair] - 1;
+    int64_t hi = index->source_pairs[pair + 1];
+    if (hi - lo == 1) {
+        return;
+    }
+    uint64_t lo_match = 0;
+    uint64_t hi_match = 0;
+
+    while (hi - lo > 1) {
+        int64_t mid = lo + (hi - lo) / 2;
+        uint32_t suffix = index->source_sa[mid];
+        uint64_t suffix_size = index->source_size - suffix;
+        uint64_t length = MIN(lo_match, hi_match);
+        uint64_t limit = MIN(needle_size, suffix_size);
+        while (length < limit && index->source[suffix + length] == needle[length]) {
+            length++;
+        }
+        if (length == needle_size || (length < suffix_size && index->source[suffix + length] > needle[length])) {
+            hi = mid;
+            hi_match = length;
+        } else {
+            lo = mid;
+            lo_match = length;
+        }
+    }
+
+    if (lo >= 0 && lo_match > best->length) {
+        *best = (create_match) { .offset = index->source_sa[lo], .length = lo_match, .target_copy = 0 };
+    }
+    if (hi < (int64_t)index->source_size && hi_match > best->length) {
+        *best = (create_match) { .offset = index->source_sa[hi], .length = hi_match, .target_copy = 0 };
+    }
+}
+
+// A longer match than best earlier in the target. The match with a suffix
+// is the smallest LCP between its rank and position's, so walking away from
+// position's rank only finds shorter ones.
+static void create_target_match(const create_index* index, uint64_t position, create_match* best) {
+    uint32_t rank = index->target_rank[position];
+
+    uint64_t length = UINT64_MAX;
+    for (uint32_t r = rank, steps = 0; r > 0 && steps < CREATE_MAX_CANDIDATES; r--, steps++) {
+        length = MIN(length, index->target_lcp[r]);
+        if (length < CREATE_MIN_MATCH || length <= best->length) {
+            break;
+        }
+        if (index->target_sa[r - 1] < position) {
+            *best = (create_match) { .offset = index->target_sa[r - 1], .length = length, .target_copy = 1 };
+        }
+    }
+    length = UINT64_MAX;
+    for (uint32_t r = rank + 1, steps = 0; r < index->target_size && steps < CREATE_MAX_CANDIDATES; r++, steps++) {
+        length = MIN(length, index->target_lcp[r]);
+        if (length < CREATE_MIN_MATCH || length <= best->length) {
+            break;
+        }
+        if (index->target_sa[r] < position) {
+            *best = (create_match) { .offset = index->target_sa[r], .length = length, .target_copy = 1 };
+        }
+    }
+}
+
+// Greedily take the longest of a source read and the best match at each
+// target position, and send the bytes without either as target reads.
+static int create_encode(const create_index* index, bps_writer* writer) {
+    const uint8_t* target = index->target;
+    uint64_t literal = 0;
+    uint64_t position = 0;
+
+    while (position < index->target_size) {
+        uint64_t read = 0;
+        while (position + read < MIN(index->source_size, index->target_size) &&
+               index->source[position + read] == target[position + read]) {
+            read++;
+        }
+        create_match best = { 0 };
+        create_source_match(index, position, &best);
+        create_target_match(index, position, &best);
+        if (read < CREATE_MIN_MATCH && best.length < CREATE_MIN_MATCH) {
+            position++;
+            continue;
+        }
+
+        if (bps_writer_target_read(writer, target + literal, position - literal) != 0) {
+            return -1;
+        }
+        int rc;
+        if (read >= best.length) {
+            rc = bps_writer_source_read(writer, read);
+            position += read;
+        } else if (best.target_copy) {
+            rc = bps_writer_target_copy(writer, best.offset, best.length);
+            position += best.length;
+        } else {
+            rc = bps_writer_source_copy(writer, best.offset, best.length);
+            position += best.length;
+        }
+        if (rc != 0) {
+            return -1;
+        }
+        literal = position;
+    }
+
+    return bps_writer_target_read(writer, target + literal, position - literal);
+}
+
+static const char* METHOD_NAMES[] = {
+    "auto",
+    "suffix",
+    "stream",
+};
+
+bps_create_method bps_create_method_from_name(const char* name) {
+    for (int i = 0; i < sizeof(METHOD_NAMES) / sizeof(METHOD_NAMES[0]); i++) {
+        if (strcmp(name, METHOD_NAMES[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Both arrays are sorted at the same time.
+uint64_t bps_create_memory(uint64_t source_size, uint64_t target_size) {
+    if (source_size >= UINT32_MAX || target_size >= UINT32_MAX) {
+        return UINT64_MAX;
+    }
+    return (source_size + 3 * target_size + CREATE_PAIRS + 1) * sizeof(uint32_t) +
+           sais_scratch_size(source_size) + sais_scratch_size(target_size);
+}
+
+rombp_patch_err bps_create(const uint8_t* source, uint64_t source_size,
+                           const uint8_t* target, uint64_t target_size,
+                           rombp_io* output, const bps_create_options* options, bps_create_stats* stats) {
+    if (source_size >= UINT32_MAX || target_size >= UINT32_MAX) {
+        rombp_log_err("The suffix array encoder takes sources and targets under 4GB\n");
+        return PATCH_FAILED_TO_START;
+    }
+
+    create_index index = {
+        .source = source,
+        .source_size = source_size,
+        .target = target,
+        .target_size = target_size,
+        .threads = MAX(MIN(MIN(options->threads, CREATE_MAX_THREADS), target_size / CREATE_MIN_THREAD_SUFFIXES), 1),
+    };
+    stats->memory = bps_create_memory(source_size, target_size);
+    stats->patch_size = 0;
+    rombp_log_info("Suffix arrays for %ld source and %ld target bytes need %ld MB of memory, threads: %d\n",
+                   (long)source_size, (long)target_size, (long)(stats->memory >> 20), index.threads);
+    if (options->memory_limit > 0 && stats->memory > options->memory_limit) {
+        rombp_log_err("Suffix arrays need %ld MB of memory, more than the limit of %ld MB\n",
+                      (long)(stats->memory >> 20), (long)(options->memory_limit >> 20));
+        return PATCH_FAILED_TO_START;
+    }
+
+    index.source_sa = malloc(MAX(source_size, 1) * sizeof(uint32_t));
+    index.source_pairs = malloc((CREATE_PAIRS + 1) * sizeof(uint32_t));
+    index.target_sa = malloc(MAX(target_size, 1) * sizeof(uint32_t));
+    index.target_rank = malloc(MAX(target_size, 1) * sizeof(uint32_t));
+    index.target_lcp = malloc(MAX(target_size, 1) * sizeof(uint32_t));
+    rombp_patch_err err = PATCH_ERR_IO;
+    bps_writer writer;
+    int writer_started = 0;
+    if (index.source_sa == NULL || index.source_pairs == NULL ||
+        index.target_sa == NULL || index.target_rank == NULL || index.target_lcp == NULL) {
+        rombp_log_err("Failed to allocate %ld MB for the suffix arrays\n", (long)(stats->memory >> 20));
+        goto out;
+    }
+    if (create_index_build(&index, options->threads) != 0) {
+        goto out;
+    }
+
+    if (bps_writer_start(&writer, output, source_size, target_size) != 0) {
+        goto out;
+    }
+    writer_started = 1;
+    if (create_encode(&index, &writer) != 0 ||
+        bps_writer_finish(&writer, rombp_crc32_update_parallel(0, source, source_size, options->threads),
+                          rombp_crc32_update_parallel(0, target, target_size, options->threads)) != 0) {
+        goto out;
+    }
+    stats->patch_size = writer.patch_size;
+    rombp_log_info("BPS patch commands, SourceRead: %ld, TargetRead: %ld, SourceCopy: %ld, TargetCopy: %ld\n",
+                   (long)writer.counts[BPS_SOURCE_READ], (long)writer.counts[BPS_TARGET_READ],
+                   (long)writer.counts[BPS_SOURCE_COPY], (long)writer.counts[BPS_TARGET_COPY]);
+    err = PATCH_OK;
+
+out:
+    if (writer_started) {
+        bps_writer_release(&writer);
+    }
+    free(index.target_lcp);
+    free(index.target_rank);
+    free(index.target_sa);
+    free(index.source_pairs);
+    free(index.source_sa);
+    return err;
+}
@@ -0,0 +1,55 @@
+#ifndef ROMBP_BPS_CREATE_H_
+#define ROMBP_BPS_CREATE_H_
+
+#include <stdint.h>
+
+#include "io.h"
+#include "patch.h"
+
+typedef enum bps_create_method {
+    // Suffix arrays when they fit in the memory limit, streaming otherwise
+    BPS_CREATE_AUTO = 0,
+    BPS_CREATE_SUFFIX = 1,
+    BPS_CREATE_STREAM = 2,
+} bps_create_method;
+
+typedef struct bps_create_options {
+    // Most bytes of working memory the encoder may use. 0 is no limit for
+    // the suffix array encoder, and BPS_STREAM_DEFAULT_MEMORY for the
+    // streaming one.
+    uint64_t memory_limit;
+    // Threads the suffix arrays are built on
+    int threads;
+} bps_create_options;
+
+typedef struct bps_create_stats {
+    // Working memory the encoder used, besides the source and target
+    uint64_t memory;
+    uint64_t patch_size;
+} bps_create_stats;
+
+#define BPS_STREAM_DEFAULT_MEMORY (64 * 1024 * 1024)
+
+bps_create_method bps_create_method_from_name(const char* name);
+
+// Working memory bps_create() takes, or UINT64_MAX if the files are too big
+// for it.
+uint64_t bps_create_memory(uint64_t source_size, uint64_t target_size);
+
+// Write a BPS patch from source to target to output. Matches are found with
+// suffix arrays of both, which take 4 bytes of working memory per source
+// byte and 12 per target byte, and about 2 more per byte while they're
+// sorted.
+rombp_patch_err bps_create(const uint8_t* source, uint64_t source_size,
+                           const uint8_t* target, uint64_t target_size,
+                           rombp_io* output, const bps_create_options* options, bps_create_stats* stats);
+
+// Write a BPS patch from source to target to output, reading both files
+// once in step, besides a first pass over the source. Moved data is only
+// found where it covers a whole block of the source, the blocks being as
+// small as the memory limit allows. Takes linear time, and a fixed amount
+// of memory whatever the size of the files.
+rombp_patch_err bps_create_stream(rombp_io* source, rombp_io* target, rombp_io* output,
+                                  const bps_create_options* options, bps_create_stats* stats);
+
+#endif
@@ -0,0 +1,427 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "bps_create.h"
+#include "bps_writer.h"
+#include "crc32.h"
+#include "log.h"
+
+// Streaming encoder. A first pass over the source hashes each of its blocks
+// into a table. The target is then read in step with the source: bytes that
+// match the source at the same offset are source reads. A hash of the block
+// size, rolled along the target, finds bytes that match a block anywhere in
+// the source. Those matches are grown in both directions into source
+// copies, and the target is also compared with the source after the last of
+// them, so that data that moved with a few changes is copied around the
+// changes. Every target byte is hashed and compared a bounded number of
+// times, so the time is linear in the size of the files.
+
+// Bytes read from each file at once. Around the matches from elsewhere in
+// the source, a little is read at first, as most of them are short.
+static const size_t STREAM_BUFFER_SIZE = 1024 * 1024;
+static const size_t STREAM_MATCH_READ = 4096;
+// Blocks are never smaller than this, however much memory there is, nor
+// bigger than an eighth of a buffer
+static const uint64_t STREAM_MIN_BLOCK = 16;
+static const uint64_t STREAM_MAX_BLOCK = 128 * 1024;
+static const int STREAM_MIN_SLOT_BITS = 10;
+// Filter bits per slot, as a power of 2
+#define STREAM_FILTER_BITS 2
+// Shortest source read worth a command of its own
+static const uint64_t STREAM_MIN_READ = 8;
+static const uint32_t STREAM_HASH_MULTIPLIER = 0x01000193;
+
+typedef struct stream_slot {
+    uint32_t hash;
+    uint32_t block;  // Plus one, 0 if the slot is empty
+} stream_slot;
+
+// A buffered window of a file, refilled from the offset that's asked for
+// when that's outside it. The target is only ever refilled from later
+// offsets, so its checksum is taken as it's read.
+typedef struct stream_reader {
+    rombp_io* io;
+    uint64_t size;
+    uint8_t* buf;
+    uint64_t start;
+    size_t len;
+    size_t readahead;  // Bytes read at a refill, if there are that many
+    int checksum;
+    uint64_t crc32_end;
+    uint32_t crc32;
+} stream_reader;
+
+typedef struct stream_encoder {
+    stream_reader source;  // In step with the target
+    stream_reader moved;   // Around the last match from elsewhere
+    stream_reader target;
+    uint64_t block_size;
+    uint32_t hash_power;    // STREAM_HASH_MULTIPLIER to the block size
+    stream_slot* table;
+    int slot_bits;
+    // A few bits per slot, set by the hashes of the blocks. Most target bytes
+    // match no block, and this tells so from the cache, where the table
+    // doesn't fit.
+    uint64_t* filter;
+    bps_writer* writer;
+} stream_encoder;
+
+// The bytes [offset, offset + len), which must be in the file and fit in
+// the buffer.
+static const uint8_t* stream_get(stream_reader* reader, uint64_t offset, size_t len) {
+    if (offset >= reader->start && offset + len <= reader->start + reader->len) {
+        return reader->buf + (offset - reader->start);
+    }
+    if (reader->checksum && offset > reader->crc32_end) {
+        rombp_log_err("Target skipped from %ld to %ld, its checksum would be wrong\n",
+                      (long)reader->crc32_end, (long)offset);
+        return NULL;
+    }
+
+    size_t amount = MIN(MAX(len, reader->readahead), reader->size - offset);
+    if (rombp_io_read_full(reader->io, reader->buf, amount, offset) != 0) {
+        rombp_log_err("Failed to read %ld bytes at: %ld\n", (long)amount, (long)offset);
+        return NULL;
+    }
+    reader->start = offset;
+    reader->len = amount;
+    if (reader->checksum && offset + amount > reader->crc32_end) {
+        size_t seen = reader->crc32_end - offset;
+        reader->crc32 = rombp_crc32_update(reader->crc32, reader->buf + seen, amount - seen);
+        reader->crc32_end = offset + amount;
+    }
+
+    return reader->buf + (offset - reader->start);
+}
+
+static size_t stream_common(const uint8_t* a, const uint8_t* b, size_t len) {
+    size_t i = 0;
+    while (i + sizeof(uint64_t) <= len) {
+        uint64_t x, y;
+        memcpy(&x, a + i, sizeof(uint64_t));
+        memcpy(&y, b + i, sizeof(uint64_t));
+        if (x != y) {
+            break;
+        }
+        i += sizeof(uint64_t);
+    }
+    while (i < len && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+// How far the target at target_offset keeps matching the source at
+// source_offset. Bytes are compared in growing chunks, so that the reads
+// stay in proportion to the match.
+static int stream_extend(stream_encoder* encoder, stream_reader* source, uint64_t source_offset,
+                         uint64_t target_offset, uint64_t* length) {
+    uint64_t limit = MIN(source->size - source_offset, encoder->target.size - target_offset);
+    uint64_t n = 0;
+    size_t step = STREAM_MATCH_READ;
+
+    while (n < limit) {
+        size_t chunk = MIN(limit - n, step);
+        step = MIN(step * 2, STREAM_BUFFER_SIZE / 2);
+        const uint8_t* t = stream_get(&encoder->target, target_offset + n, chunk);
+        const uint8_t* s = stream_get(source, source_offset + n, chunk);
+        if (t == NULL || s == NULL) {
+            return -1;
+        }
+        size_t same = stream_common(t, s, chunk);
+        n += same;
+        if (same < chunk) {
+            break;
+        }
+    }
+
+    *length = n;
+    return 0;
+}
+
+// Four bytes a step, so only one multiply of each step waits on the last.
+static uint32_t stream_hash(const uint8_t* data, uint64_t len) {
+    const uint32_t M = STREAM_HASH_MULTIPLIER;
+    uint32_t hash = 0;
+    uint64_t i = 0;
+    for (; i + 4 <= len; i += 4) {
+        hash = hash * (M * M * M * M) + data[i] * (M * M * M) + data[i + 1] * (M * M) + data[i + 2] * M + data[i + 3];
+    }
+    for (; i < len; i++) {
+        hash = hash * M + data[i];
+    }
+    return hash;
+}
+
+static inline stream_slot* stream_slot_of(stream_encoder* encoder, uint32_t hash) {
+    return &encoder->table[(uint32_t)(hash * 0x9e3779b1u) >> (32 - encoder->slot_bits)];
+}
+
+static inline uint32_t stream_filter_bit(stream_encoder* encoder, uint32_t hash) {
+    return (uint32_t)(hash * 0x85ebca6bu) >> (32 - encoder->slot_bits - STREAM_FILTER_BITS);
+}
+
+static uint64_t stream_table_size(int slot_bits) {
+    return (sizeof(stream_slot) << slot_bits) + (1ull << (slot_bits + STREAM_FILTER_BITS)) / 8;
+}
+
+// Hash every whole block of the source, keeping the first block with each
+// slot, and take the source checksum along the way.
+static int stream_index(stream_encoder* encoder, uint32_t* source_crc32) {
+    stream_reader* reader = &encoder->moved;
+    uint64_t block_size = encoder->block_size;
+    uint32_t crc32 = 0;
+
+    for (uint64_t offset = 0; offset < reader->size; offset += STREAM_BUFFER_SIZE) {
+        size_t amount = MIN(STREAM_BUFFER_SIZE, reader->size - offset);
+        const uint8_t* data = stream_get(reader, offset, amount);
+        if (data == NULL) {
+            return -1;
+        }
+        crc32 = rombp_crc32_update(crc32, data, amount);
+        // Buffers hold a whole number of blocks.
+        for (size_t i = 0; i + block_size <= amount; i += block_size) {
+            uint32_t hash = stream_hash(data + i, block_size);
+            stream_slot* slot = stream_slot_of(encoder, hash);
+            if (slot->block == 0) {
+                slot->hash = hash;
+                slot->block = (offset + i) / block_size + 1;
+            }
+            uint32_t bit = stream_filter_bit(encoder, hash);
+            encoder->filter[bit >> 6] |= 1ull << (bit & 63);
+        }
+    }
+
+    *source_crc32 = crc32;
+    return 0;
+}
+
+static int stream_encode(stream_encoder* encoder) {
+    stream_reader* target = &encoder->target;
+    uint64_t target_size = target->size;
+    uint64_t source_size = encoder->source.size;
+    uint64_t block_size = encoder->block_size;
+    uint64_t position = 0;
+    uint64_t literal = 0;
+    // The source offset in step with position, less position
+    int64_t step = 0;
+    uint32_t hash = 0;
+    int hashed = 0;  // Whether hash is that of the block at position
+
+    while (position < target_size) {
+        // Pending target read bytes are kept in the target buffer, as a
+        // match may take some of them back, up to half of it.
+        if (position - literal >= STREAM_BUFFER_SIZE / 2) {
+            const uint8_t* pending = stream_get(target, literal, position - literal);
+            if (pending == NULL || bps_writer_target_read(encoder->writer, pending, position - literal) != 0) {
+                return -1;
+            }
+            literal = position;
+        }
+        uint64_t ahead = MIN(2 * block_size + 1, target_size - position);
+        const uint8_t* data = stream_get(target, literal, position - literal + ahead);
+        if (data == NULL) {
+            return -1;
+        }
+        const uint8_t* here = data + (position - literal);
+
+        // The longer match in step, in place or after the last match from
+        // elsewhere, is taken as it is for a whole block, and grown.
+        stream_reader* readers[2] = { &encoder->source, &encoder->moved };
+        uint64_t offsets[2] = { position, position + step };
+        int best = 0;
+        uint64_t read = 0;
+        for (int i = 0; i < (step != 0 ? 2 : 1); i++) {
+            uint64_t in_step = MIN(MIN(ahead, block_size), source_size > offsets[i] ? source_size - offsets[i] : 0);
+            if (in_step == 0) {
+                continue;
+            }
+            const uint8_t* source = stream_get(readers[i], offsets[i], in_step);
+            if (source == NULL) {
+                return -1;
+            }
+            uint64_t same = stream_common(here, source, in_step);
+            if (same > read) {
+                best = i;
+                read = same;
+            }
+        }
+        if (read == block_size) {
+            // Growing the match reads on, so the pending bytes go first.
+            uint64_t more;
+            if (bps_writer_target_read(encoder->writer, data, position - literal) != 0 ||
+                stream_extend(encoder, readers[best], offsets[best] + read, position + read, &more) != 0 ||
+                bps_writer_source_copy(encoder->writer, offsets[best], read + more) != 0) {
+                return -1;
+            }
+            position += read + more;
+            literal = position;
+            hashed = 0;
+            continue;
+        }
+
+        // Otherwise a block from elsewhere in the source, grown both ways.
+        if (position + block_size <= target_size) {
+            if (!hashed) {
+                hash = stream_hash(here, block_size);
+                hashed = 1;
+            }
+            uint32_t bit = stream_filter_bit(encoder, hash);
+            stream_slot* slot = stream_slot_of(encoder, hash);
+            if (((encoder->filter[bit >> 6] >> (bit & 63)) & 1) && slot->block != 0 && slot->hash == hash) {
+                uint64_t block_offset = (uint64_t)(slot->block - 1) * block_size;
+                // A match starting more than a block back would have been
+                // found at an earlier block, unless its slot was taken.
+                uint64_t back_limit = MIN(MIN(position - literal, block_offset), block_size);
+                const uint8_t* source = stream_get(&encoder->moved, block_offset - back_limit, back_limit + block_size);
+                if (source == NULL) {
+                    return -1;
+                }
+                source += back_limit;
+                if (memcmp(source, here, block_size) == 0) {
+                    uint64_t back = 0;
+                    while (back < back_limit && source[-1 - (int64_t)back] == here[-1 - (int64_t)back]) {
+                        back++;
+                    }
+                    if (bps_writer_target_read(encoder->writer, data, position - back - literal) != 0) {
+                        return -1;
+                    }
+                    uint64_t more;
+                    if (stream_extend(encoder, &encoder->moved, block_offset + block_size, position + block_size, &more) != 0 ||
+                        bps_writer_source_copy(encoder->writer, block_offset - back, back + block_size + more) != 0) {
+                        return -1;
+                    }
+                    step = (int64_t)block_offset - (int64_t)position;
+                    position += block_size + more;
+                    literal = position;
+                    hashed = 0;
+                    continue;
+                }
+            }
+        }
+
+        // Otherwise a shorter match in step, which the hash is rolled
+        // through.
+        if (read >= MIN(STREAM_MIN_READ, target_size - position)) {
+            if (bps_writer_target_read(encoder->writer, data, position - literal) != 0 ||
+                bps_writer_source_copy(encoder->writer, offsets[best], read) != 0) {
+                return -1;
+            }
+            for (uint64_t i = 0; hashed && i < read; i++) {
+                hashed = position + i + block_size < target_size;
+                if (hashed) {
+                    hash = hash * STREAM_HASH_MULTIPLIER + here[i + block_size] - here[i] * encoder->hash_power;
+                }
+            }
+            position += read;
+            literal = position;
+            continue;
+        }
+
+        if (hashed && position + block_size < target_size) {
+            hash = hash * STREAM_HASH_MULTIPLIER + here[block_size] - here[0] * encoder->hash_power;
+        } else {
+            hashed = 0;
+        }
+        position++;
+    }
+
+    const uint8_t* pending = stream_get(target, literal, position - literal);
+    return pending == NULL ? -1 : bps_writer_target_read(encoder->writer, pending, position - literal);
+}
+
+rombp_patch_err bps_create_stream(rombp_io* source, rombp_io* target, rombp_io* output,
+                                  const bps_create_options* options, bps_create_stats* stats) {
+    int64_t source_size = rombp_io_size(source);
+    int64_t target_size = rombp_io_size(target);
+    if (source_size < 0 || target_size < 0) {
+        rombp_log_err("Failed to get the source and target sizes\n");
+        return PATCH_ERR_IO;
+    }
+
+    // The table gets what the buffers leave of the memory limit, and blocks
+    // are as small as it allows, with at least twice the slots of blocks.
+    uint64_t memory_limit = options->memory_limit > 0 ? options->memory_limit : BPS_STREAM_DEFAULT_MEMORY;
+    uint64_t buffers = 3 * STREAM_BUFFER_SIZE + BPS_WRITER_BUF_SIZE + BPS_WRITER_MAX_LITERALS;
+    int slot_bits = STREAM_MIN_SLOT_BITS;
+    while (slot_bits + STREAM_FILTER_BITS < 32 && buffers + stream_table_size(slot_bits + 1) <= memory_limit &&
+           (1ull << slot_bits) < 2 * (uint64_t)source_size / STREAM_MIN_BLOCK) {
+        slot_bits++;
+    }
+    uint64_t slots = 1ull << slot_bits;
+    uint64_t block_size = STREAM_MIN_BLOCK;
+    while (block_size <= STREAM_MAX_BLOCK && (uint64_t)source_size / block_size > slots / 2) {
+        block_size *= 2;
+    }
+    stats->memory = buffers + stream_table_size(slot_bits);
+    stats->patch_size = 0;
+    rombp_log_info("Streaming %ld source and %ld target bytes, blocks: %ld bytes, memory: %ld MB\n",
+                   (long)source_size, (long)target_size, (long)block_size, (long)(stats->memory >> 20));
+    if (block_size > STREAM_MAX_BLOCK || stats->memory > memory_limit) {
+        rombp_log_err("A memory limit of %ld MB is too small to stream a %ld byte source\n",
+                      (long)(memory_limit >> 20), (long)source_size);
+        return PATCH_FAILED_TO_START;
+    }
+
+    stream_encoder encoder = {
+        .source = { .io = source, .size = source_size, .readahead = STREAM_BUFFER_SIZE },
+        .moved = { .io = source, .size = source_size, .readahead = STREAM_MATCH_READ },
+        .target = { .io = target, .size = target_size, .readahead = STREAM_BUFFER_SIZE, .checksum = 1 },
+        .block_size = block_size,
+        .hash_power = 1,
+        .slot_bits = slot_bits,
+    };
+    for (uint64_t i = 0; i < block_size; i++) {
+        encoder.hash_power *= STREAM_HASH_MULTIPLIER;
+    }
+    encoder.source.buf = malloc(STREAM_BUFFER_SIZE);
+    encoder.moved.buf = malloc(STREAM_BUFFER_SIZE);
+    encoder.target.buf = malloc(STREAM_BUFFER_SIZE);
+    encoder.table = calloc(slots, sizeof(stream_slot));
+    encoder.filter = calloc((slots << STREAM_FILTER_BITS) / 64, sizeof(uint64_t));
+    rombp_patch_err err = PATCH_ERR_IO;
+    bps_writer writer;
+    int writer_started = 0;
+    uint32_t source_crc32;
+    if (encoder.source.buf == NULL || encoder.moved.buf == NULL || encoder.target.buf == NULL ||
+        encoder.table == NULL || encoder.filter == NULL) {
+        rombp_log_err("Failed to allocate %ld MB for streaming\n", (long)(stats->memory >> 20));
+        goto out;
+    }
+    if (stream_index(&encoder, &source_crc32) != 0) {
+        goto out;
+    }
+
+    if (bps_writer_start(&writer, output, source_size, target_size) != 0) {
+        goto out;
+    }
+    writer_started = 1;
+    encoder.writer = &writer;
+    if (stream_encode(&encoder) != 0) {
+        goto out;
+    }
+    if (encoder.target.crc32_end != (uint64_t)target_size) {
+        rombp_log_err("Only %ld target bytes were read\n", (long)encoder.target.crc32_end);
+        goto out;
+    }
+    if (bps_writer_finish(&writer, source_crc32, encoder.target.crc32) != 0) {
+        goto out;
+    }
+    stats->patch_size = writer.patch_size;
+    rombp_log_info("BPS patch commands, SourceRead: %ld, TargetRead: %ld, SourceCopy: %ld, TargetCopy: %ld\n",
+                   (long)writer.counts[BPS_SOURCE_READ], (long)writer.counts[BPS_TARGET_READ],
+                   (long)writer.counts[BPS_SOURCE_COPY], (long)writer.counts[BPS_TARGET_COPY]);
+    err = PATCH_OK;
+
+out:
+    if (writer_started) {
+        bps_writer_release(&writer);
+    }
+    free(encoder.filter);
+    free(encoder.table);
+    free(encoder.target.buf);
+    free(encoder.moved.buf);
+    free(encoder.source.buf);
+    return err;
+}
@@ -0,0 +1,240 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "bps_writer.h"
+#include "crc32.h"
+#include "log.h"
+
+static const uint8_t BPS_MARKER[] = { 'B', 'P', 'S', '1' };
+// Longest varint, for a 64-bit number
+static const size_t VARINT_MAX_SIZE = 10;
+
+static int bps_writer_flush(bps_writer* writer) {
+    if (writer->buf_len == 0) {
+        return 0;
+    }
+    if (rombp_io_write_full(writer->output, writer->buf, writer->buf_len, writer->patch_size) != 0) {
+        rombp_log_err("Failed to write BPS patch at: %ld, error: %d\n", (long)writer->patch_size, errno);
+        return -1;
+    }
+    writer->patch_crc32 = rombp_crc32_update(writer->patch_crc32, writer->buf, writer->buf_len);
+    writer->patch_size += writer->buf_len;
+    writer->buf_len = 0;
+
+    return 0;
+}
+
+static int bps_writer_bytes(bps_writer* writer, const uint8_t* data, size_t len) {
+    while (len > 0) {
+        if (writer->buf_len == BPS_WRITER_BUF_SIZE && bps_writer_flush(writer) != 0) {
+            return -1;
+        }
+        size_t amount = MIN(len, BPS_WRITER_BUF_SIZE - writer->buf_len);
+        memcpy(writer->buf + writer->buf_len, data, amount);
+        writer->buf_len += amount;
+        data += amount;
+        len -= amount;
+    }
+
+    return 0;
+}
+
+// The inverse of bps_decode_varint(): 7 bits per byte, the last byte flagged
+// with the high bit, and every byte but the last also counting one.
+static int bps_writer_varint(bps_writer* writer, uint64_t value) {
+    uint8_t bytes[VARINT_MAX_SIZE];
+    size_t len = 0;
+
+    while (1) {
+        uint8_t x = value & 0x7f;
+        value >>= 7;
+        if (value == 0) {
+            bytes[len++] = 0x80 | x;
+            break;
+        }
+        bytes[len++] = x;
+        value--;
+    }
+
+    return bps_writer_bytes(writer, bytes, len);
+}
+
+// Relative offsets are stored as a magnitude, with the sign in the low bit.
+static int bps_writer_relative(bps_writer* writer, uint64_t* relative_offset, uint64_t offset, uint64_t length) {
+    uint64_t value = offset >= *relative_offset ? (offset - *relative_offset) << 1
+                                                 : ((*relative_offset - offset) << 1) | 1;
+    *relative_offset = offset + length;
+    return bps_writer_varint(writer, value);
+}
+
+static int bps_writer_emit(bps_writer* writer) {
+    uint64_t length = writer->pending_length;
+    if (length == 0) {
+        return 0;
+    }
+    writer->pending_length = 0;
+    writer->counts[writer->pending]++;
+
+    if (bps_writer_varint(writer, ((length - 1) << 2) | writer->pending) != 0) {
+        return -1;
+    }
+    switch (writer->pending) {
+        case BPS_TARGET_READ:
+            return bps_writer_bytes(writer, writer->literals, length);
+        case BPS_SOURCE_COPY:
+            return bps_writer_relative(writer, &writer->source_relative_offset, writer->pending_offset, length);
+        case BPS_TARGET_COPY:
+            return bps_writer_relative(writer, &writer->target_relative_offset, writer->pending_offset, length);
+        case BPS_SOURCE_READ:
+        default:
+            return 0;
+    }
+}
+
+// Hold back a command of type, extending the pending one if it continues
+// it, or writing the pending one out first.
+static int bps_writer_command(bps_writer* writer, bps_command_type type, uint64_t offset, uint64_t length) {
+    if (length == 0) {
+        return 0;
+    }
+    if (writer->output_offset + length > writer->target_size) {
+        rombp_log_err("BPS command writes past the target size, offset: %ld, length: %ld\n",
+                      (long)writer->output_offset, (long)length);
+        return -1;
+    }
+
+    int continues = writer->pending_length > 0 && writer->pending == type &&
+                    (type == BPS_SOURCE_READ || type == BPS_TARGET_READ ||
+                     writer->pending_offset + writer->pending_length == offset);
+    if (!continues) {
+        if (bps_writer_emit(writer) != 0) {
+            return -1;
+        }
+        writer->pending = type;
+        writer->pending_offset = offset;
+    }
+    writer->pending_length += length;
+    writer->output_offset += length;
+
+    return 0;
+}
+
+int bps_writer_start(bps_writer* writer, rombp_io* output, uint64_t source_size, uint64_t target_size) {
+    memset(writer, 0, sizeof(bps_writer));
+    writer->output = output;
+    writer->source_size = source_size;
+    writer->target_size = target_size;
+    writer->buf = malloc(BPS_WRITER_BUF_SIZE);
+    if (writer->buf == NULL) {
+        rombp_log_err("Failed to allocate BPS writer buffer\n");
+        return -1;
+    }
+
+    if (bps_writer_bytes(writer, BPS_MARKER, sizeof(BPS_MARKER)) != 0 ||
+        bps_writer_varint(writer, source_size) != 0 ||
+        bps_writer_varint(writer, target_size) != 0 ||
+        bps_writer_varint(writer, 0) != 0) {
+        bps_writer_release(writer);
+        return -1;
+    }
+
+    return 0;
+}
+
+int bps_writer_source_read(bps_writer* writer, uint64_t length) {
+    if (writer->output_offset + length > writer->source_size) {
+        rombp_log_err("BPS source read past the end of the source, offset: %ld\n", (long)writer->output_offset);
+        return -1;
+    }
+    return bps_writer_command(writer, BPS_SOURCE_READ, writer->output_offset, length);
+}
+
+int bps_writer_target_read(bps_writer* writer, const uint8_t* data, size_t length) {
+    while (length > 0) {
+        size_t held = writer->pending == BPS_TARGET_READ ? writer->pending_length : 0;
+        // A different pending command, or a full target read, is written out
+        // first. The literals of a pending target read are kept.
+        if (held == BPS_WRITER_MAX_LITERALS) {
+            held = 0;
+        }
+        if (held == 0 && bps_writer_emit(writer) != 0) {
+            return -1;
+        }
+        size_t amount = MIN(length, BPS_WRITER_MAX_LITERALS - held);
+        if (writer->literals == NULL) {
+            writer->literals = malloc(BPS_WRITER_MAX_LITERALS);
+            if (writer->literals == NULL) {
+                rombp_log_err("Failed to allocate BPS target read buffer\n");
+                return -1;
+            }
+        }
+        memcpy(writer->literals + held, data, amount);
+        if (bps_writer_command(writer, BPS_TARGET_READ, 0, amount) != 0) {
+            return -1;
+        }
+        data += amount;
+        length -= amount;
+    }
+
+    return 0;
+}
+
+int bps_writer_source_copy(bps_writer* writer, uint64_t offset, uint64_t length) {
+    if (offset == writer->output_offset) {
+        return bps_writer_source_read(writer, length);
+    }
+    if (offset + length > writer->source_size) {
+        rombp_log_err("BPS source copy past the end of the source, offset: %ld\n", (long)offset);
+        return -1;
+    }
+    return bps_writer_command(writer, BPS_SOURCE_COPY, offset, length);
+}
+
+int bps_writer_target_copy(bps_writer* writer, uint64_t offset, uint64_t length) {
+    if (offset >= writer->output_offset) {
+        rombp_log_err("BPS target copy reads output that hasn't been written yet, offset: %ld\n", (long)offset);
+        return -1;
+    }
+    return bps_writer_command(writer, BPS_TARGET_COPY, offset, length);
+}
+
+// Write the last command and the footer. The checksums are those of the
+// whole source and target.
+int bps_writer_finish(bps_writer* writer, uint32_t source_crc32, uint32_t target_crc32) {
+    uint8_t footer[12];
+
+    if (bps_writer_emit(writer) != 0) {
+        return -1;
+    }
+    if (writer->output_offset != writer->target_size) {
+        rombp_log_err("BPS commands write %ld bytes, but the target size is: %ld\n",
+                      (long)writer->output_offset, (long)writer->target_size);
+        return -1;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        footer[i] = (source_crc32 >> (8 * i)) & 0xff;
+        footer[4 + i] = (target_crc32 >> (8 * i)) & 0xff;
+    }
+    if (bps_writer_bytes(writer, footer, 8) != 0 || bps_writer_flush(writer) != 0) {
+        return -1;
+    }
+    uint32_t patch_crc32 = writer->patch_crc32;
+    for (int i = 0; i < 4; i++) {
+        footer[8 + i] = (patch_crc32 >> (8 * i)) & 0xff;
+    }
+    if (bps_writer_bytes(writer, footer + 8, 4) != 0 || bps_writer_flush(writer) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void bps_writer_release(bps_writer* writer) {
+    free(writer->buf);
+    free(writer->literals);
+    writer->buf = NULL;
+    writer->literals = NULL;
+}
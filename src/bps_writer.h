@@ -0,0 +1,51 @@
+#ifndef ROMBP_BPS_WRITER_H_
+#define ROMBP_BPS_WRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bps.h"
+#include "io.h"
+
+// Most memory a writer holds: its output buffer, and the bytes of a target
+// read, which is split into commands of at most BPS_WRITER_MAX_LITERALS.
+#define BPS_WRITER_BUF_SIZE (64 * 1024)
+#define BPS_WRITER_MAX_LITERALS (1024 * 1024)
+
+// Writes a BPS patch, one command at a time, in target order. Commands are
+// held back while the next one can extend them: adjacent source reads and
+// target reads, and copies that carry on where the last one stopped, are
+// written as one command. A source copy from the offset it writes to is a
+// source read.
+typedef struct bps_writer {
+    rombp_io* output;
+    uint64_t patch_size;     // Patch bytes written to output so far
+    uint32_t patch_crc32;    // CRC32 of those bytes
+    uint8_t* buf;
+    size_t buf_len;
+
+    uint64_t source_size;
+    uint64_t target_size;
+    uint64_t output_offset;  // Target bytes described so far
+    uint64_t source_relative_offset;
+    uint64_t target_relative_offset;
+
+    // The command being held back, pending_length is 0 if there's none
+    bps_command_type pending;
+    uint64_t pending_length;
+    uint64_t pending_offset;
+    uint8_t* literals;       // Target read payload
+
+    // Commands written, by type
+    uint64_t counts[4];
+} bps_writer;
+
+int bps_writer_start(bps_writer* writer, rombp_io* output, uint64_t source_size, uint64_t target_size);
+int bps_writer_source_read(bps_writer* writer, uint64_t length);
+int bps_writer_target_read(bps_writer* writer, const uint8_t* data, size_t length);
+int bps_writer_source_copy(bps_writer* writer, uint64_t offset, uint64_t length);
+int bps_writer_target_copy(bps_writer* writer, uint64_t offset, uint64_t length);
+int bps_writer_finish(bps_writer* writer, uint32_t source_crc32, uint32_t target_crc32);
+void bps_writer_release(bps_writer* writer);
+
+#endif
@@ -0,0 +1,656 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "bps.h"
+#include "bps_writer.h"
+#include "crc32.h"
+#include "ips.h"
+#include "librombp.h"
+#include "log.h"
+
+// Patch composition. Every image in the chain is tracked as a list of
+// segments, each either a range of the source or a range of bytes that came
+// from a patch. A patch maps the segments of its input to those of its
+// output, so the final image ends up described in terms of the source, and
+// becomes one BPS patch: source ranges are source reads and copies, and
+// patch bytes are target reads, or target copies when they repeat.
+
+typedef enum compose_kind {
+    COMPOSE_SOURCE = 0,
+    COMPOSE_DATA = 1,
+} compose_kind;
+
+typedef struct compose_segment {
+    uint64_t offset; // In the image
+    uint64_t length;
+    uint64_t from;   // In the source, or in the data arena
+    compose_kind kind;
+} compose_segment;
+
+typedef struct compose_image {
+    compose_segment* segments;
+    size_t count;
+    size_t capacity;
+    uint64_t size;
+} compose_image;
+
+// Where a range of patch bytes first shows up in the final image. Copies
+// put the same patch bytes in the image more than once, and every time but
+// the first they can be target copies.
+typedef struct compose_first {
+    uint64_t from;   // In the data arena
+    uint64_t length;
+    uint64_t offset; // In the image
+} compose_first;
+
+typedef struct compose_state {
+    const uint8_t* source;
+    uint64_t source_size;
+    // Bytes that came from the patches
+    rombp_io data;
+} compose_state;
+
+// Patch bytes that match the source at the same offset, or repeat what came
+// before them, for at least this long become source reads and target copies.
+static const uint64_t COMPOSE_MIN_RUN = 32;
+// Longest repeating pattern looked for in patch bytes
+static const uint64_t COMPOSE_MAX_PERIOD = 16;
+
+static int compose_append(compose_image* image, compose_kind kind, uint64_t from, uint64_t length) {
+    if (length == 0) {
+        return 0;
+    }
+    if (image->count > 0) {
+        compose_segment* last = &image->segments[image->count - 1];
+        if (last->kind == kind && last->from + last->length == from) {
+            last->length += length;
+            image->size += length;
+            return 0;
+        }
+    }
+
+    if (image->count == image->capacity) {
+        size_t capacity = MAX(image->capacity * 2, 1024);
+        compose_segment* segments = realloc(image->segments, capacity * sizeof(compose_segment));
+        if (segments == NULL) {
+            rombp_log_err("Failed to grow composed image to %ld segments\n", (long)capacity);
+            return -1;
+        }
+        image->segments = segments;
+        image->capacity = capacity;
+    }
+    image->segments[image->count++] = (compose_segment) {
+        .offset = image->size,
+        .length = length,
+        .from = from,
+        .kind = kind,
+    };
+    image->size += length;
+
+    return 0;
+}
+
+static void compose_image_release(compose_image* image) {
+    free(image->segments);
+    image->segments = NULL;
+    image->count = 0;
+    image->capacity = 0;
+    image->size = 0;
+}
+
+// The segment holding offset, which has to be inside the image.
+static size_t compose_find(const compose_image* image, uint64_t offset) {
+    size_t lo = 0;
+    size_t hi = image->count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (image->segments[mid].offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Append the segments for [offset, offset + length) of src to dest. dest
+// and src may be the same image, as long as the range was already written.
+static int compose_slice(compose_image* dest, const compose_image* src, uint64_t offset, uint64_t length) {
+    if (offset + length > src->size) {
+        rombp_log_err("Composed patch reads past the end of its input, offset: %ld\n", (long)offset);
+        return -1;
+    }
+
+    for (size_t i = length > 0 ? compose_find(src, offset) : 0; length > 0; i++) {
+        // Appending may move the segments, copy this one out first.
+        compose_segment segment = src->segments[i];
+        uint64_t skip = offset - segment.offset;
+        uint64_t amount = MIN(segment.length - skip, length);
+        if (compose_append(dest, segment.kind, segment.from + skip, amount) != 0) {
+            return -1;
+        }
+        offset += amount;
+        length -= amount;
+    }
+
+    return 0;
+}
+
+static const uint8_t* compose_bytes(const compose_state* state, const compose_segment* segment) {
+    return segment->kind == COMPOSE_SOURCE ? state->source + segment->from : state->data.data + segment->from;
+}
+
+static void compose_read(const compose_state* state, const compose_image* image, uint64_t offset,
+                         uint8_t* dest, uint64_t length) {
+    for (size_t i = length > 0 ? compose_find(image, offset) : 0; length > 0; i++) {
+        const compose_segment* segment = &image->segments[i];
+        uint64_t skip = offset - segment->offset;
+        uint64_t amount = MIN(segment->length - skip, length);
+        memcpy(dest, compose_bytes(state, segment) + skip, amount);
+        dest += amount;
+        offset += amount;
+        length -= amount;
+    }
+}
+
+static uint32_t compose_crc32(const compose_state* state, const compose_image* image) {
+    uint32_t crc = 0;
+    for (size_t i = 0; i < image->count; i++) {
+        crc = rombp_crc32_update(crc, compose_bytes(state, &image->segments[i]), image->segments[i].length);
+    }
+    return crc;
+}
+
+// Grow the data arena by length zeroes, and return where they start.
+static uint8_t* compose_data_reserve(compose_state* state, uint64_t length, uint64_t* from) {
+    *from = state->data.data_size;
+    if (rombp_io_resize(&state->data, *from + length) != 0) {
+        return NULL;
+    }
+    return state->data.data + *from;
+}
+
+static int compose_data(compose_state* state, compose_image* image, const uint8_t* bytes, uint64_t length) {
+    uint64_t from;
+    uint8_t* dest = compose_data_reserve(state, length, &from);
+    if (dest == NULL) {
+        return -1;
+    }
+    memcpy(dest, bytes, length);
+    return compose_append(image, COMPOSE_DATA, from, length);
+}
+
+static int compose_fill(compose_state* state, compose_image* image, uint8_t value, uint64_t length) {
+    uint64_t from;
+    uint8_t* dest = compose_data_reserve(state, length, &from);
+    if (dest == NULL) {
+        return -1;
+    }
+    memset(dest, value, length);
+    return compose_append(image, COMPOSE_DATA, from, length);
+}
+
+// A target copy is sliced from the image. One that overlaps its own output
+// repeats the bytes between its read offset and the output, and is sliced
+// in passes that each copy everything from the read offset on. Short
+// periods would take a segment every few bytes, so those are written out
+// into the data arena.
+static int compose_repeat(compose_state* state, compose_image* image, uint64_t offset, uint64_t length) {
+    uint64_t distance = image->size - offset;
+    if (distance >= COMPOSE_MIN_RUN || distance >= length) {
+        while (length > 0) {
+            uint64_t amount = MIN(length, image->size - offset);
+            if (compose_slice(image, image, offset, amount) != 0) {
+                return -1;
+            }
+            length -= amount;
+        }
+        return 0;
+    }
+
+    uint64_t from;
+    uint8_t* dest = compose_data_reserve(state, length, &from);
+    if (dest == NULL) {
+        return -1;
+    }
+    compose_read(state, image, offset, dest, distance);
+    bps_copy_repeat(dest + distance, distance, length - distance);
+    return compose_append(image, COMPOSE_DATA, from, length);
+}
+
+static rombp_patch_err compose_bps(compose_state* state, const compose_image* input, compose_image* output,
+                                   rombp_io* patch) {
+    bps_file_header file_header;
+    rombp_patch_err err = bps_plan_patch(&file_header, patch);
+    if (err != PATCH_OK) {
+        return err;
+    }
+
+    if (file_header.source_size != input->size) {
+        rombp_log_err("BPS patch is for a %ld byte source, the image is %ld bytes\n",
+                      (long)file_header.source_size, (long)input->size);
+        err = PATCH_INVALID_INPUT_SIZE;
+        goto out;
+    }
+    if (compose_crc32(state, input) != file_header.expected_source_crc32) {
+        rombp_log_err("BPS patch source CRC32 doesn't match the image\n");
+        err = PATCH_INVALID_INPUT_CHECKSUM;
+        goto out;
+    }
+
+    const bps_plan* plan = &file_header.plan;
+    for (size_t i = 0; i < plan->count && err == PATCH_OK; i++) {
+        uint64_t offset = plan->read_offset[i];
+        uint64_t length = plan->length[i];
+        int rc;
+
+        switch (plan->opcode[i]) {
+            case BPS_SOURCE_READ:
+            case BPS_SOURCE_COPY:
+                rc = compose_slice(output, input, offset, length);
+                break;
+            case BPS_TARGET_READ: {
+                uint64_t from;
+                uint8_t* dest = compose_data_reserve(state, length, &from);
+                rc = dest == NULL || rombp_io_read_full(patch, dest, length, offset) != 0 ? -1 :
+                     compose_append(output, COMPOSE_DATA, from, length);
+                break;
+            }
+            case BPS_TARGET_COPY:
+                rc = compose_repeat(state, output, offset, length);
+                break;
+            default:
+                rc = -1;
+                break;
+        }
+        if (rc != 0) {
+            err = PATCH_ERR_IO;
+        }
+    }
+    if (err == PATCH_OK && compose_crc32(state, output) != file_header.expected_target_crc32) {
+        rombp_log_err("BPS patch target CRC32 doesn't match the composed image\n");
+        err = PATCH_INVALID_OUTPUT_CHECKSUM;
+    }
+
+out:
+    bps_release(&file_header);
+    return err;
+}
+
+// The input up to end, with zeroes past its end, like ips_start() grows the
+// output for hunks past the end of the input.
+static int compose_ips_gap(compose_state* state, const compose_image* input, compose_image* output,
+                           uint64_t pos, uint64_t end) {
+    if (pos < input->size && compose_slice(output, input, pos, MIN(end, input->size) - pos) != 0) {
+        return -1;
+    }
+    pos = MAX(pos, input->size);
+    return end > pos ? compose_fill(state, output, 0, end - pos) : 0;
+}
+
+static rombp_patch_err compose_ips(compose_state* state, const compose_image* input, compose_image* output,
+                                   rombp_io* patch) {
+    ips_program program;
+    rombp_patch_err err = ips_compile(&program, patch);
+    if (err != PATCH_OK) {
+        return err;
+    }
+
+    // Runs are sorted, and don't overlap.
+    uint64_t pos = 0;
+    int rc = 0;
+    for (size_t i = 0; i < program.hunk_count && rc == 0; i++) {
+        const ips_hunk* hunk = &program.hunks[i];
+        rc = compose_ips_gap(state, input, output, pos, hunk->offset);
+        if (rc == 0 && hunk->payload & IPS_HUNK_RLE) {
+            rc = compose_fill(state, output, hunk->payload & 0xFF, hunk->length);
+        } else if (rc == 0) {
+            rc = compose_data(state, output, program.patch_data + hunk->payload, hunk->length);
+        }
+        pos = hunk->offset + hunk->length;
+    }
+    if (rc == 0 && pos < input->size) {
+        rc = compose_slice(output, input, pos, input->size - pos);
+    }
+    ips_program_release(&program);
+
+    return rc == 0 ? PATCH_OK : PATCH_ERR_IO;
+}
+
+// Patch bytes at target offset: runs that match the source at the same
+// offset are source reads, runs that repeat the few bytes before them are
+// target copies of those, and anything else is target read.
+static int compose_emit_data(const compose_state* state, bps_writer* writer, uint64_t offset,
+                             const uint8_t* data, uint64_t length) {
+    uint64_t literal = 0;
+    uint64_t i = 0;
+
+    while (i < length) {
+        uint64_t run = 0;
+        while (i + run < length && offset + i + run < state->source_size &&
+               data[i + run] == state->source[offset + i + run]) {
+            run++;
+        }
+        if (run >= COMPOSE_MIN_RUN) {
+            if (bps_writer_target_read(writer, data + literal, i - literal) != 0 ||
+                bps_writer_source_read(writer, run) != 0) {
+                return -1;
+            }
+            i += run;
+            literal = i;
+            continue;
+        }
+
+        uint64_t period = 1;
+        for (; period <= COMPOSE_MAX_PERIOD; period++) {
+            run = 0;
+            while (i + period + run < length && data[i + period + run] == data[i + run]) {
+                run++;
+            }
+            if (run >= COMPOSE_MIN_RUN) {
+                break;
+            }
+        }
+        if (period <= COMPOSE_MAX_PERIOD) {
+            if (bps_writer_target_read(writer, data + literal, i + period - literal) != 0 ||
+                bps_writer_target_copy(writer, offset + i, run) != 0) {
+                return -1;
+            }
+            i += period + run;
+            literal = i;
+            continue;
+        }
+        i++;
+    }
+
+    return bps_writer_target_read(writer, data + literal, length - literal);
+}
+
+static int compare_offsets(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// By how far into the image the segment's patch bytes land, earliest first.
+static int compare_shifts(const void* a, const void* b) {
+    const compose_segment* x = *(const compose_segment* const*)a;
+    const compose_segment* y = *(const compose_segment* const*)b;
+    int64_t x_shift = (int64_t)x->offset - (int64_t)x->from;
+    int64_t y_shift = (int64_t)y->offset - (int64_t)y->from;
+    return x_shift < y_shift ? -1 : x_shift > y_shift;
+}
+
+static size_t compose_next_free(size_t* next, size_t i) {
+    size_t root = i;
+    while (next[root] != root) {
+        root = next[root];
+    }
+    while (next[i] != root) {
+        size_t up = next[i];
+        next[i] = root;
+        i = up;
+    }
+    return root;
+}
+
+// Split the data arena at every segment boundary, and give each piece to
+// the segment that puts it earliest in the image. The result is sorted by
+// arena offset, and covers every patch byte in the image.
+static int compose_first_build(const compose_image* image, compose_first** firsts, size_t* first_count) {
+    size_t count = 0;
+    for (size_t i = 0; i < image->count; i++) {
+        count += image->segments[i].kind == COMPOSE_DATA;
+    }
+
+    const compose_segment** segments = malloc(MAX(count, 1) * sizeof(compose_segment*));
+    uint64_t* bounds = malloc(MAX(count * 2, 1) * sizeof(uint64_t));
+    const compose_segment** owners = calloc(MAX(count * 2, 1), sizeof(compose_segment*));
+    size_t* next = malloc(MAX(count * 2, 1) * sizeof(size_t));
+    *firsts = malloc(MAX(count * 2, 1) * sizeof(compose_first));
+    *first_count = 0;
+    if (segments == NULL || bounds == NULL || owners == NULL || next == NULL || *firsts == NULL) {
+        rombp_log_err("Failed to allocate patch byte index for %ld segments\n", (long)count);
+        free(segments);
+        free(bounds);
+        free(owners);
+        free(next);
+        free(*firsts);
+        *firsts = NULL;
+        return -1;
+    }
+
+    size_t bound_count = 0;
+    for (size_t i = 0, j = 0; i < image->count; i++) {
+        const compose_segment* segment = &image->segments[i];
+        if (segment->kind == COMPOSE_DATA) {
+            segments[j++] = segment;
+            bounds[bound_count++] = segment->from;
+            bounds[bound_count++] = segment->from + segment->length;
+        }
+    }
+    qsort(bounds, bound_count, sizeof(uint64_t), compare_offsets);
+    size_t unique = 0;
+    for (size_t i = 0; i < bound_count; i++) {
+        if (unique == 0 || bounds[unique - 1] != bounds[i]) {
+            bounds[unique++] = bounds[i];
+        }
+    }
+    // Piece i is [bounds[i], bounds[i + 1]), next skips pieces that already
+    // have an owner. The last bound is the end of every segment, so it's
+    // never given out.
+    for (size_t i = 0; i < unique; i++) {
+        next[i] = i;
+    }
+
+    qsort(segments, count, sizeof(compose_segment*), compare_shifts);
+    for (size_t i = 0; i < count; i++) {
+        const compose_segment* segment = segments[i];
+        size_t lo = 0;
+        size_t hi = unique;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (bounds[mid] < segment->from) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for (size_t j = compose_next_free(next, lo); bounds[j] < segment->from + segment->length;
+             j = compose_next_free(next, j)) {
+            owners[j] = segment;
+            next[j] = j + 1;
+        }
+    }
+
+    for (size_t i = 0; i + 1 < unique; i++) {
+        const compose_segment* owner = owners[i];
+        if (owner == NULL) {
+            continue;
+        }
+        uint64_t offset = owner->offset + (bounds[i] - owner->from);
+        compose_first* last = *first_count > 0 ? &(*firsts)[*first_count - 1] : NULL;
+        if (last != NULL && last->from + last->length == bounds[i] && last->offset + last->length == offset) {
+            last->length += bounds[i + 1] - bounds[i];
+            continue;
+        }
+        (*firsts)[(*first_count)++] = (compose_first) {
+            .from = bounds[i],
+            .length = bounds[i + 1] - bounds[i],
+            .offset = offset,
+        };
+    }
+
+    free(segments);
+    free(bounds);
+    free(owners);
+    free(next);
+    return 0;
+}
+
+// Patch bytes that are already in the image are target copies of it, the
+// rest go through compose_emit_data().
+static int compose_emit_segment(const compose_state* state, bps_writer* writer,
+                                const compose_first* firsts, size_t first_count, const compose_segment* segment) {
+    size_t lo = 0;
+    size_t hi = first_count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (firsts[mid].from <= segment->from) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    const uint8_t* data = compose_bytes(state, segment);
+    for (uint64_t done = 0; done < segment->length; lo++) {
+        const compose_first* first = &firsts[lo];
+        uint64_t skip = segment->from + done - first->from;
+        uint64_t amount = MIN(first->length - skip, segment->length - done);
+        int rc;
+        if (first->offset + skip < segment->offset + done && amount >= COMPOSE_MIN_RUN) {
+            rc = bps_writer_target_copy(writer, first->offset + skip, amount);
+        } else {
+            rc = compose_emit_data(state, writer, segment->offset + done, data + done, amount);
+        }
+        if (rc != 0) {
+            return -1;
+        }
+        done += amount;
+    }
+
+    return 0;
+}
+
+static rombp_patch_err compose_write(const compose_state* state, const compose_image* image, rombp_io* output) {
+    compose_first* firsts;
+    size_t first_count;
+    if (compose_first_build(image, &firsts, &first_count) != 0) {
+        return PATCH_ERR_IO;
+    }
+
+    bps_writer writer;
+    if (bps_writer_start(&writer, output, state->source_size, image->size) != 0) {
+        free(firsts);
+        return PATCH_ERR_IO;
+    }
+
+    int rc = 0;
+    for (size_t i = 0; i < image->count && rc == 0; i++) {
+        const compose_segment* segment = &image->segments[i];
+        if (segment->kind == COMPOSE_SOURCE) {
+            rc = bps_writer_source_copy(&writer, segment->from, segment->length);
+        } else {
+            rc = compose_emit_segment(state, &writer, firsts, first_count, segment);
+        }
+    }
+    free(firsts);
+    if (rc == 0) {
+        uint32_t source_crc32 = rombp_crc32_update(0, state->source, state->source_size);
+        rc = bps_writer_finish(&writer, source_crc32, compose_crc32(state, image));
+    }
+    rombp_log_info("Composed BPS patch, %ld bytes, SourceRead: %ld, TargetRead: %ld, SourceCopy: %ld, TargetCopy: %ld\n",
+                   (long)writer.patch_size, (long)writer.counts[BPS_SOURCE_READ], (long)writer.counts[BPS_TARGET_READ],
+                   (long)writer.counts[BPS_SOURCE_COPY], (long)writer.counts[BPS_TARGET_COPY]);
+    bps_writer_release(&writer);
+
+    return rc == 0 ? PATCH_OK : PATCH_ERR_IO;
+}
+
+// Apply the chain, and the composed patch, with the patch engines, and make
+// sure both give the same image.
+static rombp_patch_err compose_verify(const uint8_t* source, size_t source_size,
+                                      const uint8_t* const* patches, const size_t* patch_sizes, int patch_count,
+                                      const uint8_t* composed, size_t composed_size) {
+    uint8_t* chained = NULL;
+    size_t chained_size = source_size;
+    uint8_t* direct = NULL;
+    size_t direct_size = 0;
+    rombp_patch_err err = PATCH_OK;
+
+    for (int i = 0; i < patch_count && err == PATCH_OK; i++) {
+        uint8_t* next;
+        err = rombp_apply(chained != NULL ? chained : source, chained_size, patches[i], patch_sizes[i],
+                          &next, &chained_size);
+        if (err == PATCH_OK) {
+            rombp_free(chained);
+            chained = next;
+        }
+    }
+    if (err == PATCH_OK) {
+        err = rombp_apply(source, source_size, composed, composed_size, &direct, &direct_size);
+    }
+    if (err == PATCH_OK && (chained_size != direct_size || memcmp(chained, direct, chained_size) != 0)) {
+        rombp_log_err("Composed patch doesn't give the same image as the chain of patches\n");
+        err = PATCH_INVALID_OUTPUT_CHECKSUM;
+    }
+
+    rombp_free(chained);
+    rombp_free(direct);
+    return err;
+}
+
+rombp_patch_err rombp_compose(const uint8_t* source, size_t source_size,
+                              const uint8_t* const* patches, const size_t* patch_sizes, int patch_count,
+                              uint8_t** output, size_t* output_size) {
+    compose_state state = { .source = source, .source_size = source_size };
+    compose_image images[2] = { { 0 }, { 0 } };
+    rombp_io composed;
+    rombp_patch_err err = PATCH_OK;
+
+    if (rombp_io_open_mem_growable(&state.data, 0) != 0) {
+        return PATCH_ERR_IO;
+    }
+    if (rombp_io_open_mem_growable(&composed, 0) != 0) {
+        rombp_io_close(&state.data);
+        return PATCH_ERR_IO;
+    }
+
+    int current = 0;
+    if (compose_append(&images[current], COMPOSE_SOURCE, 0, source_size) != 0) {
+        err = PATCH_ERR_IO;
+    }
+    for (int i = 0; i < patch_count && err == PATCH_OK; i++) {
+        rombp_io patch;
+        rombp_io_open_mem(&patch, patches[i], patch_sizes[i]);
+        compose_image* next = &images[!current];
+
+        if (ips_verify_marker(&patch) == PATCH_OK) {
+            err = compose_ips(&state, &images[current], next, &patch);
+        } else if (bps_verify_marker(&patch) == PATCH_OK) {
+            err = compose_bps(&state, &images[current], next, &patch);
+        } else {
+            rombp_log_err("Unknown type of patch %d\n", i + 1);
+            err = PATCH_UNKNOWN_TYPE;
+        }
+        rombp_io_close(&patch);
+        if (err != PATCH_OK) {
+            rombp_log_err("Failed to compose patch %d: %d\n", i + 1, err);
+            break;
+        }
+        rombp_log_info("Composed patch %d, image: %ld bytes in %ld segments\n",
+                       i + 1, (long)next->size, (long)next->count);
+        compose_image_release(&images[current]);
+        current = !current;
+    }
+
+    if (err == PATCH_OK) {
+        err = compose_write(&state, &images[current], &composed);
+    }
+    if (err == PATCH_OK) {
+        err = compose_verify(source, source_size, patches, patch_sizes, patch_count,
+                             composed.data, composed.data_size);
+    }
+    if (err == PATCH_OK) {
+        *output = rombp_io_mem_take(&composed, output_size);
+    }
+
+    compose_image_release(&images[0]);
+    compose_image_release(&images[1]);
+    rombp_io_close(&composed);
+    rombp_io_close(&state.data);
+    return err;
+}
@@ -0,0 +1,300 @@
+#include <pthread.h>
+#include <sys/param.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+#include "crc32.h"
+#include "crc32_table.h"
+
+static const size_t CRC32_MAX_THREADS = 16;
+// Smaller ranges aren't worth a thread.
+static const size_t CRC32_MIN_RANGE_SIZE = 4 * 1024 * 1024;
+
+static inline uint32_t le_32bit_load(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Slicing-by-8: fold 8 bytes per iteration with one lookup per byte into
+// independent tables, instead of a serial chain of 8 lookups. The 8KB of
+// tables still fit the L1 cache of the handhelds. Works on the inverted
+// CRC register, like the accelerated kernels.
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t* p, size_t len) {
+    while (len >= 8) {
+        uint32_t one = le_32bit_load(p) ^ crc;
+        uint32_t two = le_32bit_load(p + 4);
+        crc = CRC32_TABLE[7][one & 0xFF] ^
+            CRC32_TABLE[6][(one >> 8) & 0xFF] ^
+            CRC32_TABLE[5][(one >> 16) & 0xFF] ^
+            CRC32_TABLE[4][one >> 24] ^
+            CRC32_TABLE[3][two & 0xFF] ^
+            CRC32_TABLE[2][(two >> 8) & 0xFF] ^
+            CRC32_TABLE[1][(two >> 16) & 0xFF] ^
+            CRC32_TABLE[0][two >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = CRC32_TABLE[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+
+    return crc;
+}
+
+static uint32_t crc32_update_portable(uint32_t crc, const void* data, size_t len) {
+    return ~crc32_slice8(~crc, data, len);
+}
+
+#if defined(__x86_64__)
+
+// Folding with carry-less multiplication, from Intel's "Fast CRC Computation
+// for Generic Polynomials Using PCLMULQDQ Instruction". Four 128 bit lanes are
+// folded 64 bytes at a time, then down to one lane, and Barrett reduced to
+// the 32 bit CRC. The constants are the bit reflected ones from the paper.
+// Takes the inverted CRC register, len must be a multiple of 16 and >= 64.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_fold_pclmul(uint32_t crc, const uint8_t* p, size_t len) {
+    const __m128i k1k2 = _mm_set_epi64x(0x01C6E41596, 0x0154442BD4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00CCAA009E, 0x01751997D0);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163CD6124);
+    const __m128i poly = _mm_set_epi64x(0x01F7011641, 0x01DB710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x1, x2, x3, x4, y1, y2, y3, y4;
+
+    x1 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    p += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        y1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        y2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        y3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        y4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, y1), _mm_loadu_si128((const __m128i*)(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, y2), _mm_loadu_si128((const __m128i*)(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, y3), _mm_loadu_si128((const __m128i*)(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, y4), _mm_loadu_si128((const __m128i*)(p + 0x30)));
+        p += 64;
+        len -= 64;
+    }
+
+    // Fold the four lanes into one.
+    y1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), y1);
+    y1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), y1);
+    y1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), y1);
+
+    while (len >= 16) {
+        y1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)p)), y1);
+        p += 16;
+        len -= 16;
+    }
+
+    // 128 bits down to 64.
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits.
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_update_pclmul(uint32_t crc, const void* data, size_t len) {
+    const uint8_t* p = data;
+
+    crc = ~crc;
+    if (len >= 64) {
+        size_t folded = len & ~(size_t)15;
+        crc = crc32_fold_pclmul(crc, p, folded);
+        p += folded;
+        len -= folded;
+    }
+
+    return ~crc32_slice8(crc, p, len);
+}
+
+static int crc32_pclmul_supported() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+
+#elif defined(__aarch64__) && defined(__linux__)
+
+// The ARMv8 CRC32 instructions implement this exact polynomial, 8 bytes
+// at a time.
+__attribute__((target("+crc")))
+static uint32_t crc32_update_armv8(uint32_t crc, const void* data, size_t len) {
+    const uint8_t* p = data;
+
+    crc = ~crc;
+    while (len >= 8) {
+        uint64_t word = le_32bit_load(p) | ((uint64_t)le_32bit_load(p + 4) << 32);
+        crc = __crc32d(crc, word);
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = __crc32b(crc, *p++);
+        len--;
+    }
+
+    return ~crc;
+}
+
+static int crc32_armv8_supported() {
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+#endif
+
+static rombp_crc32_impl crc32_supported[3];
+static size_t crc32_supported_count;
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+// x^(2^n) modulo the CRC polynomial, for combining CRCs.
+static uint32_t crc32_x2n_table[32];
+
+// Multiply a and b modulo the CRC polynomial, in the bit reflected
+// representation where x^0 is the top bit.
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t)1 << 31;
+    uint32_t p = 0;
+
+    while (m != 0) {
+        if (a & m) {
+            p ^= b;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ 0xEDB88320 : b >> 1;
+    }
+
+    return p;
+}
+
+// x^(n * 2^k) modulo the CRC polynomial.
+static uint32_t crc32_x2nmodp(uint64_t n, unsigned k) {
+    uint32_t p = (uint32_t)1 << 31;
+
+    while (n != 0) {
+        if (n & 1) {
+            p = crc32_multmodp(crc32_x2n_table[k & 31], p);
+        }
+        n >>= 1;
+        k++;
+    }
+
+    return p;
+}
+
+// Runs once, the first time a CRC is needed.
+static void crc32_select() {
+    uint32_t p = (uint32_t)1 << 30;
+    for (int i = 0; i < 32; i++) {
+        crc32_x2n_table[i] = p;
+        p = crc32_multmodp(p, p);
+    }
+
+    size_t n = 0;
+#if defined(__x86_64__)
+    if (crc32_pclmul_supported()) {
+        crc32_supported[n++] = (rombp_crc32_impl){ "pclmul", crc32_update_pclmul };
+    }
+#elif defined(__aarch64__) && defined(__linux__)
+    if (crc32_armv8_supported()) {
+        crc32_supported[n++] = (rombp_crc32_impl){ "armv8", crc32_update_armv8 };
+    }
+#endif
+    crc32_supported[n++] = (rombp_crc32_impl){ "slicing-by-8", crc32_update_portable };
+    crc32_supported_count = n;
+}
+
+size_t rombp_crc32_impls(const rombp_crc32_impl** impls) {
+    pthread_once(&crc32_once, crc32_select);
+    *impls = crc32_supported;
+    return crc32_supported_count;
+}
+
+uint32_t rombp_crc32_update(uint32_t crc, const void* data, size_t len) {
+    pthread_once(&crc32_once, crc32_select);
+    return crc32_supported[0].update(crc, data, len);
+}
+
+// Appending len2 bytes to a message multiplies its CRC register by
+// x^(8 * len2), the CRC of the second part is then added on top. This is
+// zlib's crc32_combine(), in O(log len2) instead of O(len2).
+uint32_t rombp_crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    pthread_once(&crc32_once, crc32_select);
+    return crc32_multmodp(crc32_x2nmodp(len2, 3), crc1) ^ crc2;
+}
+
+typedef struct crc32_range {
+    const uint8_t* data;
+    size_t len;
+    uint32_t crc;
+    pthread_t thread;
+    int started;
+} crc32_range;
+
+static void* crc32_range_run(void* arg) {
+    crc32_range* range = arg;
+    range->crc = rombp_crc32_update(0, range->data, range->len);
+    return NULL;
+}
+
+uint32_t rombp_crc32_update_parallel(uint32_t crc, const void* data, size_t len, int threads) {
+    crc32_range ranges[CRC32_MAX_THREADS];
+
+    size_t count = MIN(MIN(MAX(threads, 1), CRC32_MAX_THREADS), len / CRC32_MIN_RANGE_SIZE);
+    if (count <= 1) {
+        return rombp_crc32_update(crc, data, len);
+    }
+
+    // Hash the first range on this thread while the others run. A range
+    // whose thread can't be started is hashed here as well.
+    size_t range_size = len / count;
+    for (size_t i = 0; i < count; i++) {
+        ranges[i].data = (const uint8_t*)data + i * range_size;
+        ranges[i].len = i == count - 1 ? len - i * range_size : range_size;
+        ranges[i].started = i > 0 && pthread_create(&ranges[i].thread, NULL, crc32_range_run, &ranges[i]) == 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (ranges[i].started) {
+            pthread_join(ranges[i].thread, NULL);
+        } else {
+            crc32_range_run(&ranges[i]);
+        }
+        crc = rombp_crc32_combine(crc, ranges[i].crc, ranges[i].len);
+    }
+
+    return crc;
+}
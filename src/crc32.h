@@ -0,0 +1,33 @@
+#ifndef ROMBP_CRC32_H_
+#define ROMBP_CRC32_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Standard (zlib compatible) CRC32. Start with a crc of 0, and feed the data
+// in as many pieces as needed: rombp_crc32_update(rombp_crc32_update(0, a), b)
+// is the CRC of a followed by b. Uses the fastest implementation the CPU
+// supports, picked at runtime.
+uint32_t rombp_crc32_update(uint32_t crc, const void* data, size_t len);
+
+// The CRC of a message a followed by a message b, given only the CRCs of a
+// and b, and the length of b.
+uint32_t rombp_crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+// Same result as rombp_crc32_update(), with the data split into ranges that
+// are hashed on up to threads threads, and combined. Small buffers are
+// hashed on the calling thread.
+uint32_t rombp_crc32_update_parallel(uint32_t crc, const void* data, size_t len, int threads);
+
+typedef uint32_t (*rombp_crc32_fn)(uint32_t crc, const void* data, size_t len);
+
+typedef struct rombp_crc32_impl {
+    const char* name;
+    rombp_crc32_fn update;
+} rombp_crc32_impl;
+
+// The implementations the CPU supports, fastest first. The portable one is
+// always last. For testing and benchmarking them against each other.
+size_t rombp_crc32_impls(const rombp_crc32_impl** impls);
+
+#endif
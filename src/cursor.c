@@ -0,0 +1,179 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "cursor.h"
+#include "log.h"
+
+static const size_t CURSOR_WINDOW_SIZE = 256 * 1024;
+// Consumed bytes are folded into the CRC while they're still in cache.
+static const size_t CURSOR_CRC_FOLD_SIZE = 64 * 1024;
+
+static void patch_cursor_fold(rombp_patch_cursor* cursor) {
+    if (cursor->crc_enabled && cursor->idx > cursor->crc_idx) {
+        cursor->crc = rombp_crc32_update(cursor->crc, cursor->window + cursor->crc_idx, cursor->idx - cursor->crc_idx);
+        cursor->crc_idx = cursor->idx;
+    }
+}
+
+// Start reading the patch at pos.
+int patch_cursor_init(rombp_patch_cursor* cursor, rombp_io* io, uint64_t pos) {
+    int64_t size = rombp_io_size(io);
+    if (size == -1 && !io->ops->sequential) {
+        rombp_log_err("Failed to get patch size, error: %d\n", errno);
+        return -1;
+    }
+
+    cursor->io = io;
+    cursor->buf = NULL;
+    cursor->crc_enabled = 0;
+    cursor->crc = 0;
+    cursor->crc_idx = 0;
+
+    const uint8_t* map = size > 0 ? rombp_io_map(io, 0, size) : NULL;
+    if (map != NULL) {
+        cursor->window = map;
+        cursor->capacity = size;
+        cursor->len = size;
+        cursor->idx = MIN(pos, (uint64_t)size);
+        cursor->base = 0;
+        cursor->eof = 1;
+        return 0;
+    }
+
+    cursor->buf = malloc(CURSOR_WINDOW_SIZE);
+    if (cursor->buf == NULL) {
+        rombp_log_err("Failed to allocate patch cursor window\n");
+        return -1;
+    }
+    cursor->window = cursor->buf;
+    cursor->capacity = CURSOR_WINDOW_SIZE;
+    cursor->len = 0;
+    cursor->idx = 0;
+    cursor->base = pos;
+    cursor->eof = 0;
+
+    return 0;
+}
+
+void patch_cursor_destroy(rombp_patch_cursor* cursor) {
+    if (cursor->buf != NULL) {
+        free(cursor->buf);
+        cursor->buf = NULL;
+    }
+    cursor->window = NULL;
+    cursor->len = 0;
+    cursor->idx = 0;
+}
+
+// Make sure at least want bytes (bounded by the window capacity) are
+// buffered. Fewer bytes are only available at the end of the patch.
+// Returns -1 on a read error.
+int patch_cursor_fill(rombp_patch_cursor* cursor, size_t want) {
+    size_t available = cursor->len - cursor->idx;
+    want = MIN(want, cursor->capacity);
+    if (available >= want || cursor->eof) {
+        return 0;
+    }
+
+    // Slide the unread bytes to the front of the window, and refill behind them.
+    patch_cursor_fold(cursor);
+    memmove(cursor->buf, cursor->buf + cursor->idx, available);
+    cursor->base += cursor->idx;
+    cursor->idx = 0;
+    cursor->crc_idx = 0;
+    cursor->len = available;
+
+    while (cursor->len < want) {
+        ssize_t nread = rombp_io_read_at(cursor->io, cursor->buf + cursor->len,
+                                         cursor->capacity - cursor->len, cursor->base + cursor->len);
+        if (nread == -1) {
+            rombp_log_err("Error reading patch file, error: %d\n", errno);
+            return -1;
+        }
+        if (nread == 0) {
+            cursor->eof = 1;
+            break;
+        }
+        cursor->len += nread;
+    }
+
+    return 0;
+}
+
+// Copy up to n bytes out of the patch. Returns the number of bytes copied,
+// which is less than n at the end of the patch, or on a read error.
+size_t patch_cursor_read(rombp_patch_cursor* cursor, void* dest, size_t n) {
+    size_t total = 0;
+
+    while (total < n) {
+        size_t nspan;
+        const uint8_t* span = patch_cursor_span(cursor, n - total, &nspan);
+        if (span == NULL) {
+            break;
+        }
+        memcpy((uint8_t*)dest + total, span, nspan);
+        total += nspan;
+    }
+
+    return total;
+}
+
+// Borrow up to max contiguous bytes directly from the window, and advance
+// past them. The returned pointer is valid until the next cursor call.
+// Returns NULL at the end of the patch or on a read error.
+const uint8_t* patch_cursor_span(rombp_patch_cursor* cursor, size_t max, size_t* nspan) {
+    if (cursor->idx == cursor->len) {
+        if (patch_cursor_fill(cursor, max) < 0 || cursor->idx == cursor->len) {
+            *nspan = 0;
+            return NULL;
+        }
+    }
+
+    const uint8_t* span = cursor->window + cursor->idx;
+    *nspan = MIN(max, cursor->len - cursor->idx);
+    cursor->idx += *nspan;
+    if (cursor->idx - cursor->crc_idx >= CURSOR_CRC_FOLD_SIZE) {
+        patch_cursor_fold(cursor);
+    }
+
+    return span;
+}
+
+// Whether the patch ends within the next n bytes, for patches of unknown size.
+// Reads ahead up to n + 1 bytes. Returns -1 on a read error.
+int patch_cursor_ends_within(rombp_patch_cursor* cursor, size_t n) {
+    if (patch_cursor_fill(cursor, n + 1) < 0) {
+        return -1;
+    }
+    return cursor->eof && cursor->len - cursor->idx <= n;
+}
+
+int patch_cursor_skip(rombp_patch_cursor* cursor, uint64_t n) {
+    while (n > 0) {
+        size_t nspan;
+        if (patch_cursor_span(cursor, MIN(n, cursor->capacity), &nspan) == NULL) {
+            rombp_log_err("Unexpected end of patch file while skipping %ld bytes\n", (long)n);
+            return -1;
+        }
+        n -= nspan;
+    }
+
+    return 0;
+}
+
+// Start a running CRC32 over the bytes consumed from here on, seeded with
+// the CRC of whatever came before. This is how patch checksums get verified
+// without a second pass over the patch.
+void patch_cursor_crc_start(rombp_patch_cursor* cursor, uint32_t crc) {
+    cursor->crc_enabled = 1;
+    cursor->crc = crc;
+    cursor->crc_idx = cursor->idx;
+}
+
+// CRC32 of the seed and every byte consumed since patch_cursor_crc_start().
+uint32_t patch_cursor_crc(rombp_patch_cursor* cursor) {
+    patch_cursor_fold(cursor);
+    return cursor->crc;
+}
@@ -0,0 +1,58 @@
+#ifndef ROMBP_CURSOR_H_
+#define ROMBP_CURSOR_H_
+
+#include <stdint.h>
+
+#include "crc32.h"
+#include "io.h"
+
+// Buffered reader over a patch. Keeps a large window of the patch in memory
+// and tracks its own position, so decoders can work on in-memory bytes
+// instead of calling into the I/O backend for every byte. Patches that the
+// backend can map are read in place, without copying.
+typedef struct rombp_patch_cursor {
+    rombp_io* io;
+    const uint8_t* window;
+    uint8_t* buf;      // Owned window storage, NULL for mapped patches
+    size_t capacity;
+    size_t len;        // Valid bytes in the window
+    size_t idx;        // Read index into the window
+    uint64_t base;     // Patch position of window[0]
+    int eof;
+
+    // Running CRC32 of the consumed bytes, see patch_cursor_crc_start()
+    int crc_enabled;
+    uint32_t crc;
+    size_t crc_idx;    // Window bytes before this index are folded into crc
+} rombp_patch_cursor;
+
+int patch_cursor_init(rombp_patch_cursor* cursor, rombp_io* io, uint64_t pos);
+void patch_cursor_destroy(rombp_patch_cursor* cursor);
+
+int patch_cursor_fill(rombp_patch_cursor* cursor, size_t want);
+size_t patch_cursor_read(rombp_patch_cursor* cursor, void* dest, size_t n);
+const uint8_t* patch_cursor_span(rombp_patch_cursor* cursor, size_t max, size_t* nspan);
+int patch_cursor_ends_within(rombp_patch_cursor* cursor, size_t n);
+int patch_cursor_skip(rombp_patch_cursor* cursor, uint64_t n);
+void patch_cursor_crc_start(rombp_patch_cursor* cursor, uint32_t crc);
+uint32_t patch_cursor_crc(rombp_patch_cursor* cursor);
+
+static inline uint64_t patch_cursor_pos(rombp_patch_cursor* cursor) {
+    return cursor->base + cursor->idx;
+}
+
+static inline size_t patch_cursor_available(rombp_patch_cursor* cursor) {
+    return cursor->len - cursor->idx;
+}
+
+// Returns the next byte, or -1 at the end of the patch or on read error.
+static inline int patch_cursor_byte(rombp_patch_cursor* cursor) {
+    if (cursor->idx == cursor->len) {
+        if (patch_cursor_fill(cursor, 1) < 0 || cursor->idx == cursor->len) {
+            return -1;
+        }
+    }
+    return cursor->window[cursor->idx++];
+}
+
+#endif
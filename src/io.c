@@ -0,0 +1,632 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "io.h"
+#include "log.h"
+
+// Offsets past 2GB need a 64-bit off_t, which 32-bit targets only get with
+// -D_FILE_OFFSET_BITS=64.
+_Static_assert(sizeof(off_t) == 8, "rombp needs a 64-bit off_t");
+
+// Map limit for files that can't be mapped whole, like files bigger than
+// the address space.
+static const uint64_t MAP_WINDOW_LIMIT = 64 * 1024 * 1024;
+
+static void io_reset(rombp_io* io, const rombp_io_ops* ops) {
+    io->ops = ops;
+    io->file = NULL;
+    io->fd = -1;
+    io->map_fd = -1;
+    io->data = NULL;
+    io->data_size = 0;
+    io->capacity = 0;
+    io->pos = 0;
+    io->writable = 0;
+    io->map_limit = 0;
+    io->window_size = 0;
+    io->window_clock = 0;
+    memset(io->windows, 0, sizeof(io->windows));
+}
+
+static int64_t fd_size(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        rombp_log_err("Failed to stat file, error: %d\n", errno);
+        return -1;
+    }
+    return st.st_size;
+}
+
+static int fd_resize(int fd, uint64_t size) {
+    if (ftruncate(fd, size) == -1) {
+        rombp_log_err("Failed to resize file to %ld bytes, error: %d\n", (long)size, errno);
+        return -1;
+    }
+    return 0;
+}
+
+// stdio backend: seeks the stream before every transfer.
+
+static ssize_t stdio_read_at(rombp_io* io, void* buf, size_t len, uint64_t offset) {
+    if (fseeko(io->file, offset, SEEK_SET) == -1) {
+        return -1;
+    }
+    size_t nread = fread(buf, 1, len, io->file);
+    if (nread == 0 && ferror(io->file)) {
+        return -1;
+    }
+    return nread;
+}
+
+static ssize_t stdio_write_at(rombp_io* io, const void* buf, size_t len, uint64_t offset) {
+    if (fseeko(io->file, offset, SEEK_SET) == -1) {
+        return -1;
+    }
+    size_t nwritten = fwrite(buf, 1, len, io->file);
+    if (nwritten == 0 && len > 0) {
+        return -1;
+    }
+    return nwritten;
+}
+
+static int64_t stdio_size(rombp_io* io) {
+    if (fflush(io->file) != 0) {
+        return -1;
+    }
+    return fd_size(fileno(io->file));
+}
+
+static int stdio_resize(rombp_io* io, uint64_t size) {
+    if (fflush(io->file) != 0) {
+        return -1;
+    }
+    return fd_resize(fileno(io->file), size);
+}
+
+static void stdio_close(rombp_io* io) {
+    fflush(io->file);
+}
+
+static const rombp_io_ops STDIO_OPS = {
+    .name = "stdio",
+    .concurrent_reads = 0,
+    .sequential = 0,
+    .read_at = stdio_read_at,
+    .write_at = stdio_write_at,
+    .size = stdio_size,
+    .resize = stdio_resize,
+    .map = NULL,
+    .close = stdio_close,
+};
+
+// fd backend: positional reads and writes, no buffering.
+
+static ssize_t fd_read_at(rombp_io* io, void* buf, size_t len, uint64_t offset) {
+    return pread(io->fd, buf, len, offset);
+}
+
+static ssize_t fd_write_at(rombp_io* io, const void* buf, size_t len, uint64_t offset) {
+    return pwrite(io->fd, buf, len, offset);
+}
+
+static int64_t fd_io_size(rombp_io* io) {
+    return fd_size(io->fd);
+}
+
+static int fd_io_resize(rombp_io* io, uint64_t size) {
+    return fd_resize(io->fd, size);
+}
+
+static void fd_close(rombp_io* io) {
+}
+
+static const rombp_io_ops FD_OPS = {
+    .name = "fd",
+    .concurrent_reads = 1,
+    .sequential = 0,
+    .read_at = fd_read_at,
+    .write_at = fd_write_at,
+    .size = fd_io_size,
+    .resize = fd_io_resize,
+    .map = NULL,
+    .close = fd_close,
+};
+
+// mmap backend: maps the whole file. Transfers that fall outside the mapping
+// go through pread/pwrite, which share the page cache with the mapping.
+// Files bigger than the map limit, or than the address space, are mapped a
+// few windows at a time instead, which keeps the resident set under the
+// limit. Only whole file mappings can be borrowed with map().
+
+static const rombp_io_ops MMAP_OPS;
+static const rombp_io_ops MMAP_WINDOW_OPS;
+
+static void mmap_unmap(rombp_io* io) {
+    if (io->data != NULL) {
+        munmap(io->data, io->capacity);
+    }
+    io->data = NULL;
+    io->capacity = 0;
+
+    for (int i = 0; i < ROMBP_IO_MAP_WINDOWS; i++) {
+        if (io->windows[i].data != NULL) {
+            munmap(io->windows[i].data, io->window_size);
+        }
+        io->windows[i].data = NULL;
+        io->windows[i].last_use = 0;
+    }
+}
+
+static void mmap_start_windows(rombp_io* io, uint64_t size) {
+    uint64_t limit = io->map_limit > 0 ? io->map_limit : MAP_WINDOW_LIMIT;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+
+    io->ops = &MMAP_WINDOW_OPS;
+    io->window_size = MAX(limit / ROMBP_IO_MAP_WINDOWS / page_size, 1) * page_size;
+    rombp_log_info("Mapping %ld byte file in %ld byte windows\n", (long)size, (long)io->window_size);
+}
+
+static void mmap_remap(rombp_io* io, uint64_t size) {
+    mmap_unmap(io);
+    io->ops = &MMAP_OPS;
+    io->data_size = size;
+    if (size == 0) {
+        return;
+    }
+
+    if ((io->map_limit == 0 || size <= io->map_limit) && size <= SIZE_MAX) {
+        int prot = io->writable ? PROT_READ | PROT_WRITE : PROT_READ;
+        void* data = mmap(NULL, size, prot, MAP_SHARED, io->map_fd, 0);
+        if (data != MAP_FAILED) {
+            io->data = data;
+            io->capacity = size;
+            return;
+        }
+        rombp_log_info("Failed to map %ld byte file, error: %d\n", (long)size, errno);
+    }
+    mmap_start_windows(io, size);
+}
+
+static ssize_t mmap_read_at(rombp_io* io, void* buf, size_t len, uint64_t offset) {
+    if (offset + len > io->capacity) {
+        return pread(io->map_fd, buf, len, offset);
+    }
+    memcpy(buf, io->data + offset, len);
+    return len;
+}
+
+static ssize_t mmap_write_at(rombp_io* io, const void* buf, size_t len, uint64_t offset) {
+    if (offset + len > io->capacity) {
+        return pwrite(io->map_fd, buf, len, offset);
+    }
+    memcpy(io->data + offset, buf, len);
+    return len;
+}
+
+static int64_t mmap_size(rombp_io* io) {
+    return fd_size(io->map_fd);
+}
+
+static int mmap_resize(rombp_io* io, uint64_t size) {
+    mmap_unmap(io);
+    if (fd_resize(io->map_fd, size) != 0) {
+        return -1;
+    }
+    mmap_remap(io, size);
+    return 0;
+}
+
+static uint8_t* mmap_map(rombp_io* io, uint64_t offset, size_t len) {
+    if (offset + len > io->capacity) {
+        return NULL;
+    }
+    return io->data + offset;
+}
+
+static const rombp_io_ops MMAP_OPS = {
+    .name = "mmap",
+    .concurrent_reads = 1,
+    .sequential = 0,
+    .read_at = mmap_read_at,
+    .write_at = mmap_write_at,
+    .size = mmap_size,
+    .resize = mmap_resize,
+    .map = mmap_map,
+    .close = mmap_unmap,
+};
+
+// The window holding offset, mapped over the least recently used window if
+// needed. Sets avail to the bytes from offset to the end of the window.
+// Returns NULL if the window can't be mapped.
+static uint8_t* mmap_window(rombp_io* io, uint64_t offset, size_t* avail) {
+    uint64_t start = offset - offset % io->window_size;
+    rombp_io_map_window* victim = &io->windows[0];
+
+    for (int i = 0; i < ROMBP_IO_MAP_WINDOWS; i++) {
+        rombp_io_map_window* window = &io->windows[i];
+        if (window->data != NULL && window->offset == start) {
+            victim = window;
+            break;
+        }
+        // Unmapped windows were never used, so they go first.
+        if (window->last_use < victim->last_use) {
+            victim = window;
+        }
+    }
+
+    if (victim->data == NULL || victim->offset != start) {
+        if (victim->data != NULL) {
+            munmap(victim->data, io->window_size);
+            victim->data = NULL;
+            victim->last_use = 0;
+        }
+        int prot = io->writable ? PROT_READ | PROT_WRITE : PROT_READ;
+        void* data = mmap(NULL, io->window_size, prot, MAP_SHARED, io->map_fd, start);
+        if (data == MAP_FAILED) {
+            return NULL;
+        }
+        victim->data = data;
+        victim->offset = start;
+    }
+    victim->last_use = ++io->window_clock;
+
+    *avail = io->window_size - (offset - start);
+    return victim->data + (offset - start);
+}
+
+// Windows may reach past the end of the file, where touching them faults,
+// so transfers are cut at the file size. Writes that grow the file go
+// through pwrite.
+static ssize_t mmap_window_read_at(rombp_io* io, void* buf, size_t len, uint64_t offset) {
+    if (offset >= io->data_size) {
+        return 0;
+    }
+    size_t avail;
+    uint8_t* data = mmap_window(io, offset, &avail);
+    if (data == NULL) {
+        return pread(io->map_fd, buf, len, offset);
+    }
+    len = MIN(len, MIN(avail, io->data_size - offset));
+    memcpy(buf, data, len);
+    return len;
+}
+
+static ssize_t mmap_window_write_at(rombp_io* io, const void* buf, size_t len, uint64_t offset) {
+    size_t avail;
+    uint8_t* data = NULL;
+    if (offset + len <= io->data_size) {
+        data = mmap_window(io, offset, &avail);
+    }
+    if (data == NULL) {
+        ssize_t nwritten = pwrite(io->map_fd, buf, len, offset);
+        if (nwritten > 0) {
+            io->data_size = MAX(io->data_size, offset + nwritten);
+        }
+        return nwritten;
+    }
+    len = MIN(len, avail);
+    memcpy(data, buf, len);
+    return len;
+}
+
+// Windows get remapped by other transfers, so pointers into them can't be
+// handed out, and reads can't come from several threads.
+static const rombp_io_ops MMAP_WINDOW_OPS = {
+    .name = "mmap-window",
+    .concurrent_reads = 0,
+    .sequential = 0,
+    .read_at = mmap_window_read_at,
+    .write_at = mmap_window_write_at,
+    .size = mmap_size,
+    .resize = mmap_resize,
+    .map = NULL,
+    .close = mmap_unmap,
+};
+
+// Stream backend: pipes, like stdin and stdout. Data is only read and written
+// in order. The first bytes read are kept in memory, so the patch type can
+// still be detected by reading the marker again.
+
+static const size_t STREAM_HEAD_SIZE = 64;
+
+static ssize_t stream_read_at(rombp_io* io, void* buf, size_t len, uint64_t offset) {
+    if (offset < io->data_size) {
+        len = MIN(len, io->data_size - offset);
+        memcpy(buf, io->data + offset, len);
+        return len;
+    }
+    if (offset != io->pos) {
+        errno = ESPIPE;
+        return -1;
+    }
+
+    ssize_t nread;
+    do {
+        nread = read(io->fd, buf, len);
+    } while (nread == -1 && errno == EINTR);
+    if (nread > 0) {
+        if (io->pos < STREAM_HEAD_SIZE) {
+            size_t amount = MIN((size_t)nread, STREAM_HEAD_SIZE - io->pos);
+            memcpy(io->data + io->pos, buf, amount);
+            io->data_size += amount;
+        }
+        io->pos += nread;
+    }
+    return nread;
+}
+
+static ssize_t stream_write_at(rombp_io* io, const void* buf, size_t len, uint64_t offset) {
+    if (offset != io->pos) {
+        errno = ESPIPE;
+        return -1;
+    }
+
+    ssize_t nwritten;
+    do {
+        nwritten = write(io->fd, buf, len);
+    } while (nwritten == -1 && errno == EINTR);
+    if (nwritten > 0) {
+        io->pos += nwritten;
+    }
+    return nwritten;
+}
+
+static int64_t stream_size(rombp_io* io) {
+    errno = ESPIPE;
+    return -1;
+}
+
+static int stream_resize(rombp_io* io, uint64_t size) {
+    errno = ESPIPE;
+    return -1;
+}
+
+static void stream_close(rombp_io* io) {
+    free(io->data);
+    io->data = NULL;
+    io->data_size = 0;
+}
+
+static const rombp_io_ops STREAM_OPS = {
+    .name = "stream",
+    .concurrent_reads = 0,
+    .sequential = 1,
+    .read_at = stream_read_at,
+    .write_at = stream_write_at,
+    .size = stream_size,
+    .resize = stream_resize,
+    .map = NULL,
+    .close = stream_close,
+};
+
+// Memory backend: a caller owned read-only buffer, or a growable buffer
+// owned by the backend.
+
+static ssize_t mem_read_at(rombp_io* io, void* buf, size_t len, uint64_t offset) {
+    if (offset >= io->data_size) {
+        return 0;
+    }
+    len = MIN(len, io->data_size - offset);
+    memcpy(buf, io->data + offset, len);
+    return len;
+}
+
+static int mem_reserve(rombp_io* io, uint64_t size) {
+    if (size <= io->capacity) {
+        return 0;
+    }
+
+    uint64_t capacity = MAX(io->capacity * 2, size);
+    uint8_t* data = capacity <= SIZE_MAX ? realloc(io->data, capacity) : NULL;
+    if (data == NULL) {
+        rombp_log_err("Failed to grow output buffer to %ld bytes\n", (long)capacity);
+        return -1;
+    }
+    io->data = data;
+    io->capacity = capacity;
+
+    return 0;
+}
+
+static int mem_resize(rombp_io* io, uint64_t size) {
+    if (!io->writable) {
+        errno = EBADF;
+        return -1;
+    }
+    if (mem_reserve(io, size) != 0) {
+        return -1;
+    }
+    if (size > io->data_size) {
+        memset(io->data + io->data_size, 0, size - io->data_size);
+    }
+    io->data_size = size;
+
+    return 0;
+}
+
+static ssize_t mem_write_at(rombp_io* io, const void* buf, size_t len, uint64_t offset) {
+    if (offset + len > io->data_size && mem_resize(io, offset + len) != 0) {
+        return -1;
+    }
+    memcpy(io->data + offset, buf, len);
+    return len;
+}
+
+static int64_t mem_size(rombp_io* io) {
+    return io->data_size;
+}
+
+static uint8_t* mem_map(rombp_io* io, uint64_t offset, size_t len) {
+    if (offset + len > io->data_size) {
+        return NULL;
+    }
+    return io->data + offset;
+}
+
+static void mem_close(rombp_io* io) {
+    if (io->writable) {
+        free(io->data);
+    }
+    io->data = NULL;
+    io->data_size = 0;
+    io->capacity = 0;
+}
+
+static const rombp_io_ops MEM_OPS = {
+    .name = "memory",
+    .concurrent_reads = 1,
+    .sequential = 0,
+    .read_at = mem_read_at,
+    .write_at = mem_write_at,
+    .size = mem_size,
+    .resize = mem_resize,
+    .map = mem_map,
+    .close = mem_close,
+};
+
+static const char* BACKEND_NAMES[] = {
+    "auto",
+    "stdio",
+    "fd",
+    "mmap",
+};
+
+// Returns -1 for unknown backend names.
+rombp_io_backend rombp_io_backend_from_name(const char* name) {
+    for (int i = 0; i < sizeof(BACKEND_NAMES) / sizeof(BACKEND_NAMES[0]); i++) {
+        if (strcmp(name, BACKEND_NAMES[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Open an I/O backend for an already open file. Files that can't be mapped
+// fall back from the mmap backend to the fd backend. The automatic choice
+// is the fd backend. Pipes always get the stream backend. map_limit caps
+// the bytes the mmap backend maps at once, 0 maps files whole when possible.
+int rombp_io_open_file(rombp_io* io, FILE* file, rombp_io_backend backend, int writable, uint64_t map_limit) {
+    if (lseek(fileno(file), 0, SEEK_CUR) == -1 && errno == ESPIPE) {
+        return rombp_io_open_stream(io, fileno(file));
+    }
+
+    switch (backend) {
+        case ROMBP_IO_STDIO:
+            return rombp_io_open_stdio(io, file);
+        case ROMBP_IO_MMAP:
+            if (rombp_io_open_mmap(io, fileno(file), writable, map_limit) == 0) {
+                return 0;
+            }
+            rombp_io_close(io);
+            rombp_log_info("Could not memory map file, using file descriptor I/O\n");
+            return rombp_io_open_fd(io, fileno(file));
+        case ROMBP_IO_FD:
+        case ROMBP_IO_AUTO:
+        default:
+            return rombp_io_open_fd(io, fileno(file));
+    }
+}
+
+int rombp_io_open_stdio(rombp_io* io, FILE* file) {
+    io_reset(io, &STDIO_OPS);
+    io->file = file;
+    return 0;
+}
+
+int rombp_io_open_fd(rombp_io* io, int fd) {
+    io_reset(io, &FD_OPS);
+    io->fd = fd;
+    return 0;
+}
+
+// Map the whole file, or windows of it when it's bigger than map_limit or
+// can't be mapped whole. Fails if the file size is unknown, in which case
+// the caller should fall back to another backend.
+int rombp_io_open_mmap(rombp_io* io, int fd, int writable, uint64_t map_limit) {
+    io_reset(io, &MMAP_OPS);
+    io->fd = fd;
+    io->map_fd = fd;
+    io->writable = writable;
+    io->map_limit = map_limit;
+
+    int64_t size = fd_size(fd);
+    if (size == -1) {
+        return -1;
+    }
+    mmap_remap(io, size);
+
+    return 0;
+}
+
+int rombp_io_open_stream(rombp_io* io, int fd) {
+    io_reset(io, &STREAM_OPS);
+    io->fd = fd;
+    io->data = malloc(STREAM_HEAD_SIZE);
+    if (io->data == NULL) {
+        rombp_log_err("Failed to allocate stream buffer\n");
+        return -1;
+    }
+    return 0;
+}
+
+void rombp_io_open_mem(rombp_io* io, const uint8_t* data, size_t size) {
+    io_reset(io, &MEM_OPS);
+    io->data = (uint8_t*)data;
+    io->data_size = size;
+    io->capacity = size;
+}
+
+int rombp_io_open_mem_growable(rombp_io* io, size_t capacity) {
+    io_reset(io, &MEM_OPS);
+    io->writable = 1;
+    return mem_reserve(io, MAX(capacity, 1));
+}
+
+// Hand the buffer of a growable memory backend over to the caller, who must
+// free it. The backend is left empty.
+uint8_t* rombp_io_mem_take(rombp_io* io, size_t* size) {
+    uint8_t* data = io->data;
+    *size = io->data_size;
+    io->data = NULL;
+    io->data_size = 0;
+    io->capacity = 0;
+    return data;
+}
+
+void rombp_io_close(rombp_io* io) {
+    io->ops->close(io);
+}
+
+// Read exactly len bytes at offset. Returns -1 on error or short read.
+int rombp_io_read_full(rombp_io* io, void* buf, size_t len, uint64_t offset) {
+    size_t total = 0;
+
+    while (total < len) {
+        ssize_t nread = rombp_io_read_at(io, (uint8_t*)buf + total, len - total, offset + total);
+        if (nread <= 0) {
+            return -1;
+        }
+        total += nread;
+    }
+
+    return 0;
+}
+
+int rombp_io_write_full(rombp_io* io, const void* buf, size_t len, uint64_t offset) {
+    size_t total = 0;
+
+    while (total < len) {
+        ssize_t nwritten = rombp_io_write_at(io, (const uint8_t*)buf + total, len - total, offset + total);
+        if (nwritten <= 0) {
+            return -1;
+        }
+        total += nwritten;
+    }
+
+    return 0;
+}
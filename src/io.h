@@ -0,0 +1,110 @@
+#ifndef ROMBP_IO_H_
+#define ROMBP_IO_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Pluggable I/O backend for the patch engines. The engines only ever read and
+// write at explicit offsets, so the same format code runs against stdio
+// streams, raw file descriptors, memory mapped files or memory buffers.
+typedef struct rombp_io rombp_io;
+
+// Files bigger than the mmap backend's map limit are mapped this many
+// windows at a time.
+#define ROMBP_IO_MAP_WINDOWS 4
+
+typedef struct rombp_io_map_window {
+    uint8_t* data;     // NULL if the window isn't mapped
+    uint64_t offset;
+    uint64_t last_use;
+} rombp_io_map_window;
+
+typedef struct rombp_io_ops {
+    const char* name;
+    // Whether read_at can be called from another thread while the backend is
+    // in use. Memory backends only qualify as long as nobody writes to them.
+    int concurrent_reads;
+    // Data can only be read and written in order, and the size is unknown.
+    int sequential;
+    // Read up to len bytes at offset. Returns the number of bytes read, 0 at
+    // the end of the data, or -1 on error.
+    ssize_t (*read_at)(rombp_io* io, void* buf, size_t len, uint64_t offset);
+    // Write up to len bytes at offset, growing the data if needed. Returns
+    // the number of bytes written, or -1 on error.
+    ssize_t (*write_at)(rombp_io* io, const void* buf, size_t len, uint64_t offset);
+    int64_t (*size)(rombp_io* io);
+    int (*resize)(rombp_io* io, uint64_t size);
+    // Optional: a direct pointer to the bytes [offset, offset + len), or NULL
+    // if the range can't be mapped. Writes through the pointer are only
+    // allowed for writable backends.
+    uint8_t* (*map)(rombp_io* io, uint64_t offset, size_t len);
+    void (*close)(rombp_io* io);
+} rombp_io_ops;
+
+struct rombp_io {
+    const rombp_io_ops* ops;
+    FILE* file;         // stdio backend
+    int fd;             // fd and mmap backends, where the descriptor can be used directly
+    int map_fd;         // mmap backend
+    uint8_t* data;      // mmap and memory backends
+    uint64_t data_size; // Valid bytes in data
+    uint64_t capacity;  // Allocated or mapped bytes
+    uint64_t pos;       // stream backend, bytes read or written so far
+    int writable;
+    uint64_t map_limit; // mmap backend, most bytes mapped at once, 0 for no limit
+    size_t window_size; // mmap backend, when mapping windows
+    uint64_t window_clock;
+    rombp_io_map_window windows[ROMBP_IO_MAP_WINDOWS];
+};
+
+typedef enum rombp_io_backend {
+    ROMBP_IO_AUTO = 0,
+    ROMBP_IO_STDIO = 1,
+    ROMBP_IO_FD = 2,
+    ROMBP_IO_MMAP = 3,
+} rombp_io_backend;
+
+int rombp_io_open_file(rombp_io* io, FILE* file, rombp_io_backend backend, int writable, uint64_t map_limit);
+rombp_io_backend rombp_io_backend_from_name(const char* name);
+int rombp_io_open_stdio(rombp_io* io, FILE* file);
+int rombp_io_open_fd(rombp_io* io, int fd);
+int rombp_io_open_mmap(rombp_io* io, int fd, int writable, uint64_t map_limit);
+int rombp_io_open_stream(rombp_io* io, int fd);
+void rombp_io_open_mem(rombp_io* io, const uint8_t* data, size_t size);
+int rombp_io_open_mem_growable(rombp_io* io, size_t capacity);
+uint8_t* rombp_io_mem_take(rombp_io* io, size_t* size);
+void rombp_io_close(rombp_io* io);
+
+int rombp_io_read_full(rombp_io* io, void* buf, size_t len, uint64_t offset);
+int rombp_io_write_full(rombp_io* io, const void* buf, size_t len, uint64_t offset);
+
+static inline const char* rombp_io_name(rombp_io* io) {
+    return io->ops->name;
+}
+
+static inline ssize_t rombp_io_read_at(rombp_io* io, void* buf, size_t len, uint64_t offset) {
+    return io->ops->read_at(io, buf, len, offset);
+}
+
+static inline ssize_t rombp_io_write_at(rombp_io* io, const void* buf, size_t len, uint64_t offset) {
+    return io->ops->write_at(io, buf, len, offset);
+}
+
+static inline int64_t rombp_io_size(rombp_io* io) {
+    return io->ops->size(io);
+}
+
+static inline int rombp_io_resize(rombp_io* io, uint64_t size) {
+    return io->ops->resize(io, size);
+}
+
+static inline uint8_t* rombp_io_map(rombp_io* io, uint64_t offset, uint64_t len) {
+    // Ranges beyond the address space, on 32-bit targets, can't be mapped.
+    if (io->ops->map == NULL || len == 0 || len > SIZE_MAX) {
+        return NULL;
+    }
+    return io->ops->map(io, offset, len);
+}
+
+#endif
@@ -1,50 +1,80 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
 #include <sys/param.h>
-#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
 
 #include "ips.h"
 #include "log.h"
 
 static const size_t BUF_SIZE = 32768;
+// In kernel copies are split, so the lengths fit a 32-bit size_t.
+static const size_t COPY_CHUNK_SIZE = 1024 * 1024 * 1024;
+
+typedef enum copy_method {
+    COPY_REFLINK = 0,
+    COPY_FILE_RANGE = 1,
+    COPY_SENDFILE = 2,
+    COPY_BUFFERED = 3,
+} copy_method;
+
+static const char* COPY_METHOD_NAMES[] = {
+    "reflink",
+    "copy_file_range",
+    "sendfile",
+    "buffered copy",
+};
 
-// Copy the input file to the output file, it is assumed
-// that both files will be at position 0 before this function
-// is called.
-static int copy_file(FILE* input_file, FILE* output_file) {
-    uint8_t buf[BUF_SIZE];
-    int rc;
+// Share the input file's extents with the output file (btrfs, XFS). This is
+// instant, since the data is only copied when either file is modified.
+static int copy_reflink(int infd, int outfd) {
+#ifdef FICLONE
+    return ioctl(outfd, FICLONE, infd);
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
 
-    int infd = fileno(input_file);
-    if (infd == -1) {
-        rombp_log_err("Bad input file, is the stream closed?\n");
-        return infd;
-    }
-    struct stat input_file_stat;
-    rc = fstat(infd, &input_file_stat);
-    if (rc == -1) {
-        rombp_log_err("Failed to stat input file, errno: %d\n", errno);
-        return rc;
-    }
-
-    off_t input_file_size = input_file_stat.st_size;
-    size_t total_read = 0;
-    while (1) {
-        size_t nread = fread(&buf, 1, BUF_SIZE, input_file);
-        total_read += nread;
-        if (nread < BUF_SIZE) {
-            if (total_read < input_file_size) {
-                rombp_log_err("Failed to read the entire input file, read: %ld bytes, input file size: %ld\n", (long int)total_read, (long int)input_file_size);
-                return -1;
-            } else {
-                return 0;
-            }
+// Copy inside the kernel, which can also offload the copy to the filesystem
+// or storage when supported.
+static int copy_range(int infd, int outfd, off_t size) {
+#ifdef __NR_copy_file_range
+    loff_t in_offset = 0;
+    loff_t out_offset = 0;
+
+    while (out_offset < size) {
+        size_t amount = MIN(size - out_offset, COPY_CHUNK_SIZE);
+        ssize_t ncopied = syscall(__NR_copy_file_range, infd, &in_offset, outfd, &out_offset, amount, 0);
+        if (ncopied <= 0) {
+            return -1;
         }
-        size_t nwritten = fwrite(&buf, 1, nread, output_file);
-        if (nwritten < nread) {
-            rombp_log_err("Tried to copy %ld bytes to the output file, but only copied: %ld\n", (long int)nread, (long int)nwritten);
+    }
+
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int copy_sendfile(int infd, int outfd, off_t size) {
+    off_t in_offset = 0;
+
+    if (lseek(outfd, 0, SEEK_SET) == -1) {
+        return -1;
+    }
+    while (in_offset < size) {
+        ssize_t ncopied = sendfile(outfd, infd, &in_offset, MIN(size - in_offset, COPY_CHUNK_SIZE));
+        if (ncopied <= 0) {
             return -1;
         }
     }
@@ -52,15 +82,61 @@ static int copy_file(FILE* input_file, FILE* output_file) {
     return 0;
 }
 
-rombp_patch_err ips_start(FILE* input_file, FILE* output_file) {
-    // Once the header is verified, copy the input to output
-    int rc = copy_file(input_file, output_file);
-    if (rc != 0) {
-        rombp_log_err("Failed to seek to copy input file to output file: %d\n", rc);
-        return PATCH_ERR_IO;
+// Copy through a userland buffer, or straight out of the input mapping
+// when the backend has one.
+static int copy_buffered(rombp_io* input, rombp_io* output, uint64_t input_size) {
+    const uint8_t* map = rombp_io_map(input, 0, input_size);
+    if (map != NULL) {
+        return rombp_io_write_full(output, map, input_size, 0);
     }
 
-    return PATCH_OK;
+    uint8_t buf[BUF_SIZE];
+    uint64_t total = 0;
+    while (total < input_size) {
+        size_t amount = MIN(BUF_SIZE, input_size - total);
+        if (rombp_io_read_full(input, buf, amount, total) != 0) {
+            rombp_log_err("Failed to read the entire input file, read: %ld bytes, input file size: %ld\n", (long int)total, (long int)input_size);
+            return -1;
+        }
+        if (rombp_io_write_full(output, buf, amount, total) != 0) {
+            rombp_log_err("Tried to copy %ld bytes to the output file, but failed, errno: %d\n", (long int)amount, errno);
+            return -1;
+        }
+        total += amount;
+    }
+
+    return 0;
+}
+
+// Copy the input to the output. Tries the fastest method first: a reflink,
+// then in kernel copies, and finally copying through a userland buffer. The
+// kernel methods need both backends to be plain file descriptors. Returns
+// the method that copied the file, or -1.
+static int copy_file(rombp_io* input, rombp_io* output) {
+    copy_method method;
+
+    int64_t input_size = rombp_io_size(input);
+    if (input_size == -1) {
+        rombp_log_err("Failed to get input file size, errno: %d\n", errno);
+        return -1;
+    }
+
+    int infd = input->fd;
+    int outfd = output->fd;
+    if (infd != -1 && outfd != -1 && copy_reflink(infd, outfd) == 0) {
+        method = COPY_REFLINK;
+    } else if (infd != -1 && outfd != -1 && copy_range(infd, outfd, input_size) == 0) {
+        method = COPY_FILE_RANGE;
+    } else if (infd != -1 && outfd != -1 && copy_sendfile(infd, outfd, input_size) == 0) {
+        method = COPY_SENDFILE;
+    } else {
+        if (copy_buffered(input, output, input_size) != 0) {
+            return -1;
+        }
+        method = COPY_BUFFERED;
+    }
+
+    return method;
 }
 
 static const uint8_t IPS_EXPECTED_MARKER[] = {
@@ -68,10 +144,6 @@ static const uint8_t IPS_EXPECTED_MARKER[] = {
 };
 static const size_t IPS_MARKER_SIZE = sizeof(IPS_EXPECTED_MARKER) / sizeof(uint8_t);
 
-rombp_patch_err ips_verify_marker(FILE* ips_file) {
-    return patch_verify_marker(ips_file, IPS_EXPECTED_MARKER, IPS_MARKER_SIZE);
-}
-
 static const size_t HUNK_PREAMBLE_BYTE_SIZE = 5;
 
 static const inline uint32_t be_24bit_int(uint8_t *buf) {
@@ -87,20 +159,13 @@ static const inline uint16_t be_16bit_int(uint8_t *buf) {
 
 static const size_t RLE_PAYLOAD_BYTE_SIZE = 3;
 // Extract the RLE length, as well as the byte value that needs to repeated (rle_length times)
-static int ips_get_rle_payload(FILE* ips_file, uint32_t* rle_length, uint8_t* rle_value) {
+static int ips_get_rle_payload(rombp_patch_cursor* cursor, uint32_t* rle_length, uint8_t* rle_value) {
     uint8_t buf[RLE_PAYLOAD_BYTE_SIZE];
 
-    size_t nread = fread(&buf, 1, RLE_PAYLOAD_BYTE_SIZE, ips_file);
+    size_t nread = patch_cursor_read(cursor, &buf, RLE_PAYLOAD_BYTE_SIZE);
     if (nread < RLE_PAYLOAD_BYTE_SIZE) {
-        int err = ferror(ips_file);
-        if (err != 0) {
-            rombp_log_err("Error reading from IPS file for RLE payload, error: %d\n", err);
-            return -1;
-        }
-        if (feof(ips_file) != 0) {
-            rombp_log_err("Unexpectedly reached EOF while trying to read the RLE payload\n");
-            return -1;
-        }
+        rombp_log_err("Unexpectedly reached EOF while trying to read the RLE payload\n");
+        return -1;
     }
 
     *rle_length = be_16bit_int(buf);
@@ -109,7 +174,7 @@ static int ips_get_rle_payload(FILE* ips_file, uint32_t* rle_length, uint8_t* rl
     return 0;
 }
 
-static int ips_next_hunk_header(FILE* ips_file, ips_hunk_header* header) {
+static int ips_next_hunk_header(rombp_patch_cursor* cursor, ips_hunk_header* header) {
     uint8_t buf[HUNK_PREAMBLE_BYTE_SIZE];
 
     assert(header != NULL);
@@ -117,16 +182,10 @@ static int ips_next_hunk_header(FILE* ips_file, ips_hunk_header* header) {
     // Read the hunk preamble
     // 3 byte offset
     // 2 byte payload length.
-    size_t nread = fread(&buf, 1, HUNK_PREAMBLE_BYTE_SIZE, ips_file);
+    size_t nread = patch_cursor_read(cursor, &buf, HUNK_PREAMBLE_BYTE_SIZE);
     if (nread < HUNK_PREAMBLE_BYTE_SIZE) {
-        int err = ferror(ips_file);
-        if (err != 0) {
-            rombp_log_err("Error reading from IPS file, error: %d\n", err);
-            return HUNK_ERR_IO;
-        }
-        if (feof(ips_file) != 0) {
-            return HUNK_DONE;
-        }
+        // Only the trailing EOF marker is left
+        return HUNK_DONE;
     }
 
     // We have a 5 byte buffer of the hunk preamble, decode values:
@@ -136,122 +195,659 @@ static int ips_next_hunk_header(FILE* ips_file, ips_hunk_header* header) {
     return HUNK_NEXT;
 }
 
-// Write the rle_value to the output_file rle_hunk_length times. By the time this function is
-// called, we should assume that output_file has already been seeked to the correct position
-// in the file.
-static int ips_write_rle_hunk(FILE* output_file, uint32_t rle_hunk_length, uint8_t rle_value) {
-    // It'd be sweet if we could do this in one fwrite call. Oh well.
-    size_t nwritten;
+// Write the rle_value to the output rle_hunk_length times, starting at offset.
+static int ips_write_rle_hunk(rombp_io* output, uint32_t offset, uint32_t rle_hunk_length, uint8_t rle_value) {
+    uint8_t buf[BUF_SIZE];
 
-    for (int i = 0; i < rle_hunk_length; i++) {
-        nwritten = fwrite(&rle_value, sizeof(uint8_t), 1, output_file);
-        if (nwritten == 0) {
-            rombp_log_err("Failed to write RLE byte value, length: %d, value: %d, i: %d\n",
-                    rle_hunk_length, rle_value, i);
+    memset(buf, rle_value, MIN(BUF_SIZE, rle_hunk_length));
+    uint32_t done = 0;
+    while (done < rle_hunk_length) {
+        size_t amount = MIN(BUF_SIZE, rle_hunk_length - done);
+        if (rombp_io_write_full(output, buf, amount, offset + done) != 0) {
+            rombp_log_err("Failed to write RLE byte value, length: %d, value: %d, written: %d\n",
+                    rle_hunk_length, rle_value, done);
             return -1;
         }
+        done += amount;
     }
 
     return 0;
 }
- 
-// For normal hunks (non-RLE encoded), copy payload values from the IPS file to the output.
-// By the time this function is called, the ips_file should be positioned at the start of the payload
-// and the output file should already be seeked to the destination file position.
-static int ips_write_hunk(FILE* ips_file, FILE* output_file, uint32_t hunk_length) {
-    uint8_t buf[BUF_SIZE];
 
-    size_t length_remaining = hunk_length;
-    size_t nread;
-    size_t nwritten;
-    while (length_remaining > 0) {
-        size_t amount_to_copy = MIN(BUF_SIZE, length_remaining);
-
-        nread = fread(&buf, 1, amount_to_copy, ips_file);
-        if (nread < amount_to_copy) {
-            int err = ferror(ips_file);
-            if (err != 0) {
-                rombp_log_err("Error reading payload IPS file, error: %d\n", err);
-                return -1;
+// A hunk as it appears in the patch, seq is its position in the patch.
+typedef struct ips_patch_hunk {
+    uint32_t offset;
+    uint32_t length;
+    uint64_t payload;
+    uint32_t seq;
+} ips_patch_hunk;
+
+static int ips_patch_hunk_compare(const void* a, const void* b) {
+    const ips_patch_hunk* left = a;
+    const ips_patch_hunk* right = b;
+    if (left->offset != right->offset) {
+        return left->offset < right->offset ? -1 : 1;
+    }
+    return left->seq < right->seq ? -1 : left->seq > right->seq;
+}
+
+static int uint32_compare(const void* a, const void* b) {
+    uint32_t left = *(const uint32_t*)a;
+    uint32_t right = *(const uint32_t*)b;
+    return left < right ? -1 : left > right;
+}
+
+// Append a run of output bytes to the program. Runs are appended in output
+// order, and a run that continues the previous one is merged into it: the
+// same RLE byte, or the next payload bytes of the patch.
+static void ips_program_emit(ips_program* program, uint32_t offset, uint32_t length, uint64_t payload) {
+    if (program->hunk_count > 0) {
+        ips_hunk* last = &program->hunks[program->hunk_count - 1];
+        int continues = last->offset + last->length == offset &&
+            (payload & IPS_HUNK_RLE ? payload == last->payload :
+             !(last->payload & IPS_HUNK_RLE) && last->payload + last->length == payload);
+        if (continues) {
+            last->length += length;
+            return;
+        }
+    }
+    program->hunks[program->hunk_count++] = (ips_hunk){ offset, length, payload };
+}
+
+// Max heap of indexes into the offset sorted patch hunks, ordered by their
+// position in the patch.
+static void ips_heap_push(uint32_t* heap, size_t* size, const ips_patch_hunk* hunks, uint32_t idx) {
+    size_t i = (*size)++;
+    while (i > 0 && hunks[heap[(i - 1) / 2]].seq < hunks[idx].seq) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = idx;
+}
+
+static void ips_heap_pop(uint32_t* heap, size_t* size, const ips_patch_hunk* hunks) {
+    uint32_t idx = heap[--(*size)];
+    size_t i = 0;
+    while (2 * i + 1 < *size) {
+        size_t child = 2 * i + 1;
+        if (child + 1 < *size && hunks[heap[child + 1]].seq > hunks[heap[child]].seq) {
+            child++;
+        }
+        if (hunks[heap[child]].seq < hunks[idx].seq) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = idx;
+}
+
+// Resolve overlapping hunks: sweep the hunk boundaries in output order,
+// keeping the hunks that cover the current position in a heap. Each run
+// between two boundaries goes to the covering hunk that is latest in the
+// patch, which is the one a sequential apply would have written last.
+static int ips_program_resolve(ips_program* program, ips_patch_hunk* hunks, size_t count) {
+    uint32_t* points = malloc(sizeof(uint32_t) * count * 2);
+    uint32_t* heap = malloc(sizeof(uint32_t) * count);
+    if (points == NULL || heap == NULL) {
+        rombp_log_err("Failed to allocate IPS overlap resolution for %ld hunks\n", (long)count);
+        free(points);
+        free(heap);
+        return -1;
+    }
+
+    qsort(hunks, count, sizeof(ips_patch_hunk), ips_patch_hunk_compare);
+    size_t npoints = 0;
+    for (size_t i = 0; i < count; i++) {
+        points[npoints++] = hunks[i].offset;
+        points[npoints++] = hunks[i].offset + hunks[i].length;
+    }
+    qsort(points, npoints, sizeof(uint32_t), uint32_compare);
+
+    size_t heap_size = 0;
+    size_t next = 0;
+    for (size_t i = 0; i + 1 < npoints; i++) {
+        uint32_t at = points[i];
+        if (at == points[i + 1]) {
+            continue;
+        }
+        while (next < count && hunks[next].offset == at) {
+            ips_heap_push(heap, &heap_size, hunks, next++);
+        }
+        // Hunks that ended are only dropped once they reach the top, the
+        // top is always the latest hunk still covering at.
+        while (heap_size > 0 && hunks[heap[0]].offset + hunks[heap[0]].length <= at) {
+            ips_heap_pop(heap, &heap_size, hunks);
+        }
+        if (heap_size > 0) {
+            const ips_patch_hunk* top = &hunks[heap[0]];
+            uint64_t payload = top->payload & IPS_HUNK_RLE ? top->payload : top->payload + (at - top->offset);
+            ips_program_emit(program, at, points[i + 1] - at, payload);
+        }
+    }
+
+    free(points);
+    free(heap);
+    return 0;
+}
+
+// Read the whole patch into a program: hunks sorted by output offset that
+// don't overlap, with adjacent hunks merged. Overlaps are resolved the way
+// a sequential apply would, the last hunk in the patch wins. Payloads are
+// referenced in place, out of the patch mapping or an in memory copy of
+// the patch.
+rombp_patch_err ips_compile(ips_program* program, rombp_io* patch) {
+    rombp_patch_cursor cursor;
+    rombp_io patch_mem;
+    ips_hunk_header header;
+    ips_patch_hunk* hunks = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    int sorted = 1;
+
+    program->hunks = NULL;
+    program->hunk_count = 0;
+    program->patch_hunk_count = 0;
+    program->output_end = 0;
+    program->patch_buf = NULL;
+
+    int64_t patch_size = rombp_io_size(patch);
+    if (patch_size == -1) {
+        rombp_log_err("Failed to get IPS patch size, errno: %d\n", errno);
+        return PATCH_ERR_IO;
+    }
+    if (patch_size < IPS_MARKER_SIZE) {
+        rombp_log_err("IPS file is too short: %ld bytes\n", (long)patch_size);
+        return PATCH_INVALID_HEADER;
+    }
+    program->patch_data = rombp_io_map(patch, 0, patch_size);
+    if (program->patch_data == NULL) {
+        program->patch_buf = malloc(patch_size);
+        if (program->patch_buf == NULL || rombp_io_read_full(patch, program->patch_buf, patch_size, 0) != 0) {
+            rombp_log_err("Failed to read %ld byte IPS patch into memory\n", (long)patch_size);
+            ips_program_release(program);
+            return PATCH_ERR_IO;
+        }
+        program->patch_data = program->patch_buf;
+    }
+
+    rombp_io_open_mem(&patch_mem, program->patch_data, patch_size);
+    if (patch_cursor_init(&cursor, &patch_mem, IPS_MARKER_SIZE) != 0) {
+        ips_program_release(program);
+        return PATCH_ERR_IO;
+    }
+
+    rombp_patch_err err = PATCH_OK;
+    while (ips_next_hunk_header(&cursor, &header) == HUNK_NEXT) {
+        uint32_t length = header.length;
+        uint64_t payload;
+        // 0 length header means the hunk is run length encoded (RLE).
+        if (length == 0) {
+            uint8_t rle_value;
+            if (ips_get_rle_payload(&cursor, &length, &rle_value) < 0) {
+                err = PATCH_ERR_IO;
+                break;
+            }
+            payload = IPS_HUNK_RLE | rle_value;
+        } else {
+            payload = patch_cursor_pos(&cursor);
+            if (patch_cursor_skip(&cursor, length) != 0) {
+                rombp_log_err("IPS hunk payload is truncated, hunk: %ld, offset: %d, length: %d\n",
+                              (long)program->patch_hunk_count, header.offset, length);
+                err = PATCH_ERR_IO;
+                break;
             }
-            if (feof(ips_file) != 0) {
-                rombp_log_err("Unexpected EOF while trying to read payload from IPS file, remaining: %ld, ips file pos: %ld, nread: %ld\n", (long int)length_remaining, ftell(ips_file), (long int)nread);
-                return -1;
+        }
+        program->patch_hunk_count++;
+        if (length == 0) {
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = MAX(capacity * 2, 256);
+            ips_patch_hunk* grown = realloc(hunks, sizeof(ips_patch_hunk) * capacity);
+            if (grown == NULL) {
+                rombp_log_err("Failed to grow the IPS hunk index to %ld hunks\n", (long)capacity);
+                err = PATCH_ERR_IO;
+                break;
             }
+            hunks = grown;
+        }
+        if (count > 0 && header.offset < hunks[count - 1].offset + hunks[count - 1].length) {
+            sorted = 0;
+        }
+        hunks[count] = (ips_patch_hunk){ header.offset, length, payload, count };
+        count++;
+        program->output_end = MAX(program->output_end, (uint64_t)header.offset + length);
+    }
+    patch_cursor_destroy(&cursor);
+
+    // Resolving overlaps splits a hunk at most once per boundary, so there
+    // are at most twice as many runs as hunks.
+    if (err == PATCH_OK && count > 0) {
+        program->hunks = malloc(sizeof(ips_hunk) * (sorted ? count : count * 2));
+        if (program->hunks == NULL) {
+            rombp_log_err("Failed to allocate the IPS program for %ld hunks\n", (long)count);
+            err = PATCH_ERR_IO;
+        } else if (sorted) {
+            for (size_t i = 0; i < count; i++) {
+                ips_program_emit(program, hunks[i].offset, hunks[i].length, hunks[i].payload);
+            }
+        } else if (ips_program_resolve(program, hunks, count) != 0) {
+            err = PATCH_ERR_IO;
+        }
+    }
+    free(hunks);
+    if (err != PATCH_OK) {
+        ips_program_release(program);
+        return err;
+    }
+
+    rombp_log_info("Compiled IPS patch, hunks: %ld, runs: %ld, overlapping: %s, output end: %ld\n",
+                   (long)program->patch_hunk_count, (long)program->hunk_count,
+                   sorted ? "no" : "yes", (long)program->output_end);
+
+    return PATCH_OK;
+}
+
+void ips_program_release(ips_program* program) {
+    free(program->hunks);
+    free(program->patch_buf);
+    program->hunks = NULL;
+    program->hunk_count = 0;
+    program->patch_buf = NULL;
+    program->patch_data = NULL;
+}
+
+// Size the output for the program, and map it when the backend can.
+static rombp_patch_err ips_prepare_output(ips_context* ctx, rombp_io* output, uint64_t size) {
+    ctx->output = output;
+    ctx->next_hunk = 0;
+
+    // Hunks past the end of the file grow it, any gap reads as zeroes.
+    size = MAX(size, ctx->program.output_end);
+    if (rombp_io_resize(output, size) != 0) {
+        rombp_log_err("Failed to resize output file to: %ld, errno: %d\n", (long)size, errno);
+        return PATCH_ERR_IO;
+    }
+    ctx->output_map = rombp_io_map(output, 0, size);
+
+    // Runs never overlap, so they can be written from several threads at
+    // once, straight into the mapping. The undo journal is already written.
+    ctx->threads = ctx->output_map != NULL ? patch_worker_count() : 1;
+    rombp_log_info("IPS output is %s, threads: %d\n", ctx->output_map != NULL ? "memory mapped" : "written positionally", ctx->threads);
+
+    return PATCH_OK;
+}
+
+// Start patching input into output: the whole patch is compiled first, so a
+// broken patch is rejected before anything is written.
+rombp_patch_err ips_start(ips_context* ctx, rombp_io* input, rombp_io* output, rombp_io* patch) {
+    rombp_patch_err err = ips_compile(&ctx->program, patch);
+    if (err != PATCH_OK) {
+        return err;
+    }
+    ctx->journal_file = NULL;
+
+    // Copy the input to output, the hunks are applied on top of it
+    int method = copy_file(input, output);
+    if (method == -1) {
+        rombp_log_err("Failed to copy input file to output file\n");
+        ips_release(ctx);
+        return PATCH_ERR_IO;
+    }
+    ctx->copy_method = COPY_METHOD_NAMES[method];
+    int64_t input_size = rombp_io_size(input);
+    if (input_size == -1) {
+        rombp_log_err("Failed to get input file size, errno: %d\n", errno);
+        ips_release(ctx);
+        return PATCH_ERR_IO;
+    }
+    rombp_log_info("Copied %ld byte input file to output file using: %s\n", (long int)input_size, ctx->copy_method);
+
+    err = ips_prepare_output(ctx, output, input_size);
+    if (err != PATCH_OK) {
+        ips_release(ctx);
+    }
+    return err;
+}
+
+static const uint8_t JOURNAL_MARKER[] = {
+    0x52, 0x42, 0x50, 0x55 // RBPU
+};
+static const size_t JOURNAL_MARKER_SIZE = sizeof(JOURNAL_MARKER) / sizeof(uint8_t);
+static const size_t JOURNAL_HEADER_SIZE = 12;
+static const size_t JOURNAL_ENTRY_HEADER_SIZE = 8;
+
+static void le_32bit_put(uint8_t* buf, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        buf[i] = (value >> (i * 8)) & 0xFF;
+    }
+}
+
+static uint32_t le_32bit_int(const uint8_t* buf) {
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+// Save the original bytes a run is going to overwrite. Bytes past the
+// original end of the file don't need saving, rollback truncates them.
+static int ips_journal_hunk(ips_context* ctx, rombp_io* target, uint32_t offset, uint32_t length) {
+    uint8_t buf[BUF_SIZE];
+
+    if (offset >= ctx->original_size) {
+        return 0;
+    }
+    length = MIN(length, ctx->original_size - offset);
+
+    uint8_t entry_header[JOURNAL_ENTRY_HEADER_SIZE];
+    le_32bit_put(entry_header, offset);
+    le_32bit_put(entry_header + 4, length);
+    if (fwrite(entry_header, 1, JOURNAL_ENTRY_HEADER_SIZE, ctx->journal_file) < JOURNAL_ENTRY_HEADER_SIZE) {
+        rombp_log_err("Failed to write undo journal entry, errno: %d\n", errno);
+        return -1;
+    }
+
+    uint32_t done = 0;
+    while (done < length) {
+        size_t amount = MIN(BUF_SIZE, length - done);
+        if (rombp_io_read_full(target, buf, amount, offset + done) != 0) {
+            rombp_log_err("Failed to read original bytes for undo journal, errno: %d\n", errno);
+            return -1;
         }
-        nwritten = fwrite(&buf, 1, nread, output_file);
-        if (nwritten < nread) {
-            rombp_log_err("Failed to write all data to output file, expected to write: %ld bytes, wrote: %ld\n", (long int)nread, (long int)nwritten);
+        if (fwrite(buf, 1, amount, ctx->journal_file) < amount) {
+            rombp_log_err("Failed to write undo journal data, errno: %d\n", errno);
             return -1;
         }
-        length_remaining -= nwritten;
+        done += amount;
     }
 
     return 0;
 }
 
-static int ips_patch_hunk(ips_hunk_header* hunk_header, FILE* input_file, FILE* output_file, FILE* ips_file) {
-    // Seek the output file to the specified hunk offset
-    int rc = fseek(output_file, hunk_header->offset, SEEK_SET);
-    if (rc == -1) {
-        rombp_log_err("Error seeking output file to offset: %d, error: %d\n",
-                      hunk_header->offset, errno);
-        return rc;
-    }
-
-    rombp_log_info("Hunk RLE: %d, offset: %d, length: %d, ips_offset: %ld\n",
-                   hunk_header->length == 0,
-                   hunk_header->offset,
-                   hunk_header->length,
-                   ftell(ips_file));
-
-    // 0 length header means the hunk is run length encoded (RLE).
-    // We have to look into the payload to determine how big the hunk
-    // is.
-    if (hunk_header->length == 0) {
-        uint32_t rle_hunk_length;
-        uint8_t rle_value;
-        rc = ips_get_rle_payload(ips_file, &rle_hunk_length, &rle_value);
-        if (rc < 0) {
-            rombp_log_err("Failed to find RLE payload length, err: %d\n", rc);
-            return rc;
+// Journal every run of the program, and get the journal to disk before
+// the target is touched: whenever patching stops, the journal holds all
+// the bytes that could have been overwritten.
+static int ips_journal_program(ips_context* ctx, rombp_io* target) {
+    uint8_t header[JOURNAL_HEADER_SIZE];
+
+    memcpy(header, JOURNAL_MARKER, JOURNAL_MARKER_SIZE);
+    le_32bit_put(header + 4, ctx->original_size & 0xFFFFFFFF);
+    le_32bit_put(header + 8, (uint64_t)ctx->original_size >> 32);
+    if (fwrite(header, 1, JOURNAL_HEADER_SIZE, ctx->journal_file) < JOURNAL_HEADER_SIZE) {
+        rombp_log_err("Failed to write undo journal header, errno: %d\n", errno);
+        return -1;
+    }
+    for (size_t i = 0; i < ctx->program.hunk_count; i++) {
+        const ips_hunk* hunk = &ctx->program.hunks[i];
+        if (ips_journal_hunk(ctx, target, hunk->offset, hunk->length) != 0) {
+            return -1;
         }
-        rc = ips_write_rle_hunk(output_file, rle_hunk_length, rle_value);
-        if (rc < 0) {
-            rombp_log_err("Failed to write RLE hunk value to output, rle length: %d, rle value: %d\n",
-                          rle_hunk_length, rle_value);
-            return rc;
+    }
+    if (fflush(ctx->journal_file) != 0 || fsync(fileno(ctx->journal_file)) != 0) {
+        rombp_log_err("Failed to sync undo journal, errno: %d\n", errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Patch the target file directly, instead of copying the input first. IPS
+// hunks only overwrite or extend the file, so the output of in place patching
+// is identical to regular patching. When journal_file is not NULL, the bytes
+// every run overwrites are saved to it before anything is patched, so
+// ips_rollback() can restore the original file. ctx->program is compiled by
+// the caller with ips_compile() first, so the journal is only created for a
+// patch that applies, and is released on failure.
+//
+// Journal layout, all integers little endian:
+//   "RBPU", u64 original file size
+//   Per hunk: u32 offset, u32 length, <length> original bytes
+rombp_patch_err ips_start_in_place(ips_context* ctx, rombp_io* target, FILE* journal_file) {
+    int64_t target_size = rombp_io_size(target);
+    if (target_size == -1) {
+        rombp_log_err("Failed to get target file size, errno: %d\n", errno);
+        ips_release(ctx);
+        return PATCH_ERR_IO;
+    }
+    ctx->original_size = target_size;
+    ctx->journal_file = journal_file;
+    ctx->copy_method = NULL;
+
+    if (journal_file != NULL && ips_journal_program(ctx, target) != 0) {
+        ips_release(ctx);
+        return PATCH_ERR_IO;
+    }
+
+    rombp_patch_err err = ips_prepare_output(ctx, target, target_size);
+    if (err != PATCH_OK) {
+        ips_release(ctx);
+        return err;
+    }
+    rombp_log_info("Patching IPS in place, undo journal: %s\n", journal_file != NULL ? "yes" : "no");
+
+    return PATCH_OK;
+}
+
+// Restore a file patched in place from its undo journal. Entries are undone
+// newest first, so bytes touched by several hunks end up with their
+// original value. A journal cut short is rolled back as far as its complete
+// entries go.
+rombp_patch_err ips_rollback(rombp_io* target, FILE* journal_file) {
+    uint8_t header[JOURNAL_HEADER_SIZE];
+    rombp_patch_err err = PATCH_OK;
+
+    if (fseeko(journal_file, 0, SEEK_END) == -1) {
+        rombp_log_err("Failed to seek undo journal, errno: %d\n", errno);
+        return PATCH_ERR_IO;
+    }
+    off_t journal_size = ftello(journal_file);
+    if (journal_size < (off_t)JOURNAL_HEADER_SIZE || fseeko(journal_file, 0, SEEK_SET) == -1) {
+        rombp_log_err("Undo journal is too short: %ld\n", (long)journal_size);
+        return PATCH_INVALID_HEADER;
+    }
+
+    uint8_t* journal = malloc(journal_size);
+    if (journal == NULL) {
+        rombp_log_err("Failed to allocate %ld bytes for the undo journal\n", (long)journal_size);
+        return PATCH_ERR_IO;
+    }
+    if (fread(journal, 1, journal_size, journal_file) < journal_size) {
+        rombp_log_err("Failed to read undo journal, errno: %d\n", errno);
+        free(journal);
+        return PATCH_ERR_IO;
+    }
+    memcpy(header, journal, JOURNAL_HEADER_SIZE);
+    if (memcmp(header, JOURNAL_MARKER, JOURNAL_MARKER_SIZE) != 0) {
+        rombp_log_err("Not a rombp undo journal\n");
+        free(journal);
+        return PATCH_INVALID_HEADER;
+    }
+    uint64_t original_size = le_32bit_int(header + 4) | ((uint64_t)le_32bit_int(header + 8) << 32);
+
+    // Index the entries, so they can be replayed in reverse.
+    size_t entry_count = 0;
+    size_t pos = JOURNAL_HEADER_SIZE;
+    while (pos + JOURNAL_ENTRY_HEADER_SIZE <= journal_size &&
+           le_32bit_int(journal + pos + 4) <= journal_size - pos - JOURNAL_ENTRY_HEADER_SIZE) {
+        pos += JOURNAL_ENTRY_HEADER_SIZE + le_32bit_int(journal + pos + 4);
+        entry_count++;
+    }
+    if (pos != journal_size) {
+        rombp_log_err("Undo journal is truncated, rolling back its %ld complete entries\n", (long)entry_count);
+    }
+    size_t* entries = malloc(sizeof(size_t) * (entry_count + 1));
+    if (entries == NULL) {
+        rombp_log_err("Failed to allocate undo journal index\n");
+        free(journal);
+        return PATCH_ERR_IO;
+    }
+    pos = JOURNAL_HEADER_SIZE;
+    for (size_t i = 0; i < entry_count; i++) {
+        entries[i] = pos;
+        pos += JOURNAL_ENTRY_HEADER_SIZE + le_32bit_int(journal + pos + 4);
+    }
+
+    for (size_t i = entry_count; i > 0; i--) {
+        const uint8_t* entry = journal + entries[i - 1];
+        uint32_t offset = le_32bit_int(entry);
+        uint32_t length = le_32bit_int(entry + 4);
+        if (rombp_io_write_full(target, entry + JOURNAL_ENTRY_HEADER_SIZE, length, offset) != 0) {
+            rombp_log_err("Failed to restore %d bytes at offset: %d, errno: %d\n", length, offset, errno);
+            err = PATCH_ERR_IO;
+            goto out;
         }
-    } else {
-        rc = ips_write_hunk(ips_file, output_file, hunk_header->length);
-        if (rc < 0) {
-            rombp_log_err("Failed writing non-RLE hunk value to output, length: %d\n",
-                          hunk_header->length);
-            return rc;
+    }
+    if (rombp_io_resize(target, original_size) != 0) {
+        rombp_log_err("Failed to truncate target back to %ld bytes, errno: %d\n", (long)original_size, errno);
+        err = PATCH_ERR_IO;
+        goto out;
+    }
+    rombp_log_info("Rolled back %ld hunks\n", (long)entry_count);
+
+out:
+    free(entries);
+    free(journal);
+    return err;
+}
+
+static int ips_apply_hunk(ips_context* ctx, const ips_hunk* hunk) {
+    if (hunk->payload & IPS_HUNK_RLE) {
+        uint8_t rle_value = hunk->payload & 0xFF;
+        if (ctx->output_map != NULL) {
+            memset(ctx->output_map + hunk->offset, rle_value, hunk->length);
+            return 0;
         }
+        return ips_write_rle_hunk(ctx->output, hunk->offset, hunk->length, rle_value);
     }
 
+    const uint8_t* payload = ctx->program.patch_data + hunk->payload;
+    if (ctx->output_map != NULL) {
+        memcpy(ctx->output_map + hunk->offset, payload, hunk->length);
+        return 0;
+    }
+    if (rombp_io_write_full(ctx->output, payload, hunk->length, hunk->offset) != 0) {
+        rombp_log_err("Failed to write all data to output file, expected to write: %d bytes, errno: %d\n",
+                      hunk->length, errno);
+        return -1;
+    }
     return 0;
 }
 
-rombp_hunk_iter_status ips_next(FILE* input_file, FILE* output_file, FILE* ips_file) {
-    ips_hunk_header hunk_header;
+// Runs [first, last) of the program, applied by one worker.
+typedef struct ips_worker {
+    ips_context* ctx;
+    size_t first;
+    size_t last;
+    int rc;
+    pthread_t thread;
+    int started;
+} ips_worker;
+
+static void* ips_worker_run(void* arg) {
+    ips_worker* worker = arg;
+
+    worker->rc = 0;
+    for (size_t i = worker->first; i < worker->last; i++) {
+        if (ips_apply_hunk(worker->ctx, &worker->ctx->program.hunks[i]) != 0) {
+            worker->rc = -1;
+            break;
+        }
+    }
 
-    int rc = ips_next_hunk_header(ips_file, &hunk_header);
-    if (rc < 0) {
-        rombp_log_err("Error getting next hunk, at hunk count: %d\n", rc);
-        return HUNK_ERR_IO;
-    } else if (rc == HUNK_DONE) {
-        return HUNK_DONE;
-    } else {
-        assert(rc == HUNK_NEXT);
-        rc = ips_patch_hunk(&hunk_header, input_file, output_file, ips_file);
-        if (rc < 0) {
-            rombp_log_err("Failed to patch next hunk: %d\n", rc);
-            return HUNK_ERR_IO;
+    return NULL;
+}
+
+// Every run costs about this many bytes of copying on top of its length.
+static const uint64_t IPS_RUN_COST = 64;
+static const uint64_t IPS_BATCH_COST = 16 * 1024 * 1024;
+static const uint64_t IPS_MIN_WORKER_COST = 256 * 1024;
+
+// Apply the next batch of runs on up to ctx->threads threads. The batch is
+// split into consecutive runs of about the same cost, and since runs are
+// sorted and don't overlap, every worker writes its own region of the output.
+// The calling thread takes the first region.
+static rombp_hunk_iter_status ips_next_parallel(ips_context* ctx) {
+    ips_worker workers[ctx->threads];
+    const ips_hunk* hunks = ctx->program.hunks;
+
+    uint64_t cost = 0;
+    size_t end = ctx->next_hunk;
+    while (end < ctx->program.hunk_count && cost < IPS_BATCH_COST) {
+        cost += hunks[end++].length + IPS_RUN_COST;
+    }
+
+    size_t count = MIN((uint64_t)ctx->threads, MAX(cost / IPS_MIN_WORKER_COST, 1));
+    uint64_t done = 0;
+    size_t first = ctx->next_hunk;
+    for (size_t w = 0; w < count; w++) {
+        size_t last = first;
+        uint64_t target = cost * (w + 1) / count;
+        while (last < end && (done < target || w == count - 1)) {
+            done += hunks[last++].length + IPS_RUN_COST;
+        }
+        workers[w] = (ips_worker){ .ctx = ctx, .first = first, .last = last, .rc = 0, .started = 0 };
+        if (w > 0) {
+            workers[w].started = pthread_create(&workers[w].thread, NULL, ips_worker_run, &workers[w]) == 0;
         }
+        first = last;
+    }
+
+    int rc = 0;
+    for (size_t w = 0; w < count; w++) {
+        if (workers[w].started) {
+            pthread_join(workers[w].thread, NULL);
+        } else {
+            ips_worker_run(&workers[w]);
+        }
+        if (workers[w].rc != 0) {
+            rombp_log_err("Failed to patch runs %ld to %ld\n", (long)workers[w].first, (long)workers[w].last);
+            rc = -1;
+        }
+    }
+    ctx->next_hunk = end;
+
+    return rc == 0 ? HUNK_NEXT : HUNK_ERR_IO;
+}
+
+// Apply the next run of the compiled patch, or the next batch of runs when
+// applying on several threads. Runs come in output order.
+rombp_hunk_iter_status ips_next(ips_context* ctx) {
+    if (ctx->next_hunk == ctx->program.hunk_count) {
+        return HUNK_DONE;
+    }
+    if (ctx->threads > 1) {
+        return ips_next_parallel(ctx);
+    }
 
-        return HUNK_NEXT;
+    const ips_hunk* hunk = &ctx->program.hunks[ctx->next_hunk++];
+    if (ips_apply_hunk(ctx, hunk) != 0) {
+        rombp_log_err("Failed to patch hunk at offset: %d, length: %d\n", hunk->offset, hunk->length);
+        return HUNK_ERR_IO;
     }
+
+    return HUNK_NEXT;
+}
+
+void ips_release(ips_context* ctx) {
+    ips_program_release(&ctx->program);
+}
+
+rombp_patch_err ips_verify_marker(rombp_io* patch) {
+    return patch_verify_marker(patch, IPS_EXPECTED_MARKER, IPS_MARKER_SIZE);
+}
+
+// Check a patch without applying it: every hunk has to be complete. IPS has
+// no checksums, so that is all that can be verified. Only the patch is read.
+rombp_patch_err ips_validate(rombp_io* patch) {
+    ips_program program;
+
+    rombp_patch_err err = ips_compile(&program, patch);
+    if (err != PATCH_OK) {
+        return err;
+    }
+    rombp_log_info("IPS patch is valid, hunks: %ld, patched up to: %ld bytes\n",
+                   (long)program.patch_hunk_count, (long)program.output_end);
+    ips_program_release(&program);
+
+    return PATCH_OK;
 }
- 
@@ -4,6 +4,8 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include "cursor.h"
+#include "io.h"
 #include "patch.h"
 
 typedef struct ips_hunk_header {
@@ -11,8 +13,53 @@ typedef struct ips_hunk_header {
     uint16_t length;
 } ips_hunk_header;
 
-rombp_patch_err ips_verify_marker(FILE* ips_file);
-rombp_patch_err ips_start(FILE* input_file, FILE* output_file);
-rombp_hunk_iter_status ips_next(FILE* input_file, FILE* output_file, FILE* ips_file);
+// Payload of an RLE hunk: this flag, and the byte to repeat in the low bits.
+#define IPS_HUNK_RLE ((uint64_t)1 << 63)
+
+// A run of output bytes in a compiled patch.
+typedef struct ips_hunk {
+    uint32_t offset;
+    uint32_t length;
+    // Patch position of the payload bytes, or IPS_HUNK_RLE | the byte to repeat
+    uint64_t payload;
+} ips_hunk;
+
+// A whole patch, compiled by ips_compile() into runs that are sorted by
+// output offset and don't overlap.
+typedef struct ips_program {
+    ips_hunk* hunks;
+    size_t hunk_count;
+    size_t patch_hunk_count;   // Hunks in the patch file
+    uint64_t output_end;       // End of the furthest hunk
+    const uint8_t* patch_data; // The whole patch, indexed by hunk payloads
+    uint8_t* patch_buf;        // Copy of the patch, when its backend can't map it
+} ips_program;
+
+typedef struct ips_context {
+    ips_program program;
+    size_t next_hunk;
+    rombp_io* output;
+    uint8_t* output_map;       // NULL when the output backend can't map
+    // Threads ips_next() applies runs on, 1 unless the output is mapped.
+    // Picked by ips_start(), and can be changed before the first ips_next()
+    // while output_map is set.
+    int threads;
+    // How ips_start() copied the input to the output, NULL in place
+    const char* copy_method;
+
+    // In place patching only, see ips_start_in_place()
+    FILE* journal_file;
+    uint64_t original_size;
+} ips_context;
+
+rombp_patch_err ips_verify_marker(rombp_io* patch);
+rombp_patch_err ips_compile(ips_program* program, rombp_io* patch);
+void ips_program_release(ips_program* program);
+rombp_patch_err ips_start(ips_context* ctx, rombp_io* input, rombp_io* output, rombp_io* patch);
+rombp_patch_err ips_start_in_place(ips_context* ctx, rombp_io* target, FILE* journal_file);
+rombp_patch_err ips_rollback(rombp_io* target, FILE* journal_file);
+rombp_hunk_iter_status ips_next(ips_context* ctx);
+void ips_release(ips_context* ctx);
+rombp_patch_err ips_validate(rombp_io* patch);
 
 #endif
@@ -0,0 +1,521 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "ips_create.h"
+#include "log.h"
+
+// IPS encoder. The source and target are compared a block at a time by
+// vector kernels, which also flag the target bytes that repeat the one
+// before them. Unchanged stretches are skipped with a plain compare, and
+// the masks of the changed ones give the hunks and their runs of one byte.
+
+static const uint8_t IPS_MARKER[] = { 'P', 'A', 'T', 'C', 'H' };
+static const uint8_t IPS_FOOTER[] = { 'E', 'O', 'F' };
+// Hunk offsets are 24-bit, and lengths 16-bit
+static const uint64_t IPS_MAX_OFFSET = 0xFFFFFF;
+static const uint64_t IPS_MAX_LENGTH = 0xFFFF;
+// A hunk at this offset would read as the footer
+static const uint64_t IPS_EOF_OFFSET = 0x454F46;
+static const uint64_t IPS_HEADER_SIZE = 5;
+// An RLE hunk is a header with a length of 0, the run length and the byte
+static const uint64_t IPS_RLE_SIZE = 8;
+#define IPS_WRITER_BUF_SIZE (64 * 1024)
+// Past the end of the source, the target is compared against zeroes
+#define IPS_ZEROES_SIZE 4096
+
+static const uint8_t IPS_ZEROES[IPS_ZEROES_SIZE];
+
+static size_t ips_mismatch_portable(const uint8_t* a, const uint8_t* b, size_t len) {
+    size_t i = 0;
+
+    // A word at a time, then the bytes of the word that differs.
+    while (i + sizeof(uint64_t) <= len) {
+        uint64_t x;
+        uint64_t y;
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        if (x != y) {
+            break;
+        }
+        i += sizeof(uint64_t);
+    }
+    while (i < len && a[i] == b[i]) {
+        i++;
+    }
+
+    return i;
+}
+
+static void ips_scan_portable(const uint8_t* source, const uint8_t* target, uint64_t* differs, uint64_t* repeats) {
+    uint64_t d = 0;
+    uint64_t r = 0;
+
+    for (int i = 0; i < IPS_DIFF_BLOCK; i++) {
+        d |= (uint64_t)(source[i] != target[i]) << i;
+        r |= (uint64_t)(target[i] == target[i - 1]) << i;
+    }
+    *differs = d;
+    *repeats = r;
+}
+
+#if defined(__x86_64__)
+
+// SSE2 is part of x86-64, it needs no check. One bit per equal byte.
+static inline uint64_t ips_equal_sse2(const uint8_t* a, const uint8_t* b) {
+    uint64_t mask = 0;
+
+    for (int i = 0; i < 4; i++) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + 16 * i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + 16 * i));
+        mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) << (16 * i);
+    }
+
+    return mask;
+}
+
+static size_t ips_mismatch_sse2(const uint8_t* a, const uint8_t* b, size_t len) {
+    size_t i = 0;
+
+    while (i + IPS_DIFF_BLOCK <= len) {
+        __m128i e0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+        __m128i e1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 16)), _mm_loadu_si128((const __m128i*)(b + i + 16)));
+        __m128i e2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 32)), _mm_loadu_si128((const __m128i*)(b + i + 32)));
+        __m128i e3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 48)), _mm_loadu_si128((const __m128i*)(b + i + 48)));
+        __m128i all = _mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3));
+        if (_mm_movemask_epi8(all) != 0xFFFF) {
+            return i + __builtin_ctzll(~ips_equal_sse2(a + i, b + i));
+        }
+        i += IPS_DIFF_BLOCK;
+    }
+
+    return i + ips_mismatch_portable(a + i, b + i, len - i);
+}
+
+static void ips_scan_sse2(const uint8_t* source, const uint8_t* target, uint64_t* differs, uint64_t* repeats) {
+    *differs = ~ips_equal_sse2(source, target);
+    *repeats = ips_equal_sse2(target, target - 1);
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t ips_equal_avx2(const uint8_t* a, const uint8_t* b) {
+    __m256i lo = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)a), _mm256_loadu_si256((const __m256i*)b));
+    __m256i hi = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + 32)), _mm256_loadu_si256((const __m256i*)(b + 32)));
+    return (uint32_t)_mm256_movemask_epi8(lo) | (uint64_t)(uint32_t)_mm256_movemask_epi8(hi) << 32;
+}
+
+__attribute__((target("avx2")))
+static size_t ips_mismatch_avx2(const uint8_t* a, const uint8_t* b, size_t len) {
+    size_t i = 0;
+
+    while (i + IPS_DIFF_BLOCK <= len) {
+        __m256i lo = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+        __m256i hi = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i + 32)), _mm256_loadu_si256((const __m256i*)(b + i + 32)));
+        if ((uint32_t)_mm256_movemask_epi8(_mm256_and_si256(lo, hi)) != UINT32_MAX) {
+            return i + __builtin_ctzll(~ips_equal_avx2(a + i, b + i));
+        }
+        i += IPS_DIFF_BLOCK;
+    }
+
+    return i + ips_mismatch_portable(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void ips_scan_avx2(const uint8_t* source, const uint8_t* target, uint64_t* differs, uint64_t* repeats) {
+    *differs = ~ips_equal_avx2(source, target);
+    *repeats = ips_equal_avx2(target, target - 1);
+}
+
+static int ips_avx2_supported() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#elif defined(__aarch64__)
+
+// NEON is part of AArch64, it needs no check. It has no movemask: the
+// equal lanes are weighted by their bit, and added pairwise down to a bit
+// per byte.
+static inline uint64_t ips_equal_neon(const uint8_t* a, const uint8_t* b) {
+    static const uint8_t WEIGHTS[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t weights = vld1q_u8(WEIGHTS);
+
+    uint8x16_t e0 = vandq_u8(vceqq_u8(vld1q_u8(a), vld1q_u8(b)), weights);
+    uint8x16_t e1 = vandq_u8(vceqq_u8(vld1q_u8(a + 16), vld1q_u8(b + 16)), weights);
+    uint8x16_t e2 = vandq_u8(vceqq_u8(vld1q_u8(a + 32), vld1q_u8(b + 32)), weights);
+    uint8x16_t e3 = vandq_u8(vceqq_u8(vld1q_u8(a + 48), vld1q_u8(b + 48)), weights);
+    uint8x16_t sum = vpaddq_u8(vpaddq_u8(e0, e1), vpaddq_u8(e2, e3));
+    sum = vpaddq_u8(sum, sum);
+
+    return vgetq_lane_u64(vreinterpretq_u64_u8(sum), 0);
+}
+
+static size_t ips_mismatch_neon(const uint8_t* a, const uint8_t* b, size_t len) {
+    size_t i = 0;
+
+    while (i + IPS_DIFF_BLOCK <= len) {
+        uint8x16_t e0 = vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        uint8x16_t e1 = vceqq_u8(vld1q_u8(a + i + 16), vld1q_u8(b + i + 16));
+        uint8x16_t e2 = vceqq_u8(vld1q_u8(a + i + 32), vld1q_u8(b + i + 32));
+        uint8x16_t e3 = vceqq_u8(vld1q_u8(a + i + 48), vld1q_u8(b + i + 48));
+        if (vminvq_u8(vandq_u8(vandq_u8(e0, e1), vandq_u8(e2, e3))) != 0xFF) {
+            return i + __builtin_ctzll(~ips_equal_neon(a + i, b + i));
+        }
+        i += IPS_DIFF_BLOCK;
+    }
+
+    return i + ips_mismatch_portable(a + i, b + i, len - i);
+}
+
+static void ips_scan_neon(const uint8_t* source, const uint8_t* target, uint64_t* differs, uint64_t* repeats) {
+    *differs = ~ips_equal_neon(source, target);
+    *repeats = ips_equal_neon(target, target - 1);
+}
+
+#endif
+
+static ips_diff_impl ips_diff_supported[3];
+static size_t ips_diff_supported_count;
+static pthread_once_t ips_diff_once = PTHREAD_ONCE_INIT;
+
+// Runs once, the first time a diff kernel is needed.
+static void ips_diff_select() {
+    size_t n = 0;
+#if defined(__x86_64__)
+    if (ips_avx2_supported()) {
+        ips_diff_supported[n++] = (ips_diff_impl){ "avx2", ips_mismatch_avx2, ips_scan_avx2 };
+    }
+    ips_diff_supported[n++] = (ips_diff_impl){ "sse2", ips_mismatch_sse2, ips_scan_sse2 };
+#elif defined(__aarch64__)
+    ips_diff_supported[n++] = (ips_diff_impl){ "neon", ips_mismatch_neon, ips_scan_neon };
+#endif
+    ips_diff_supported[n++] = (ips_diff_impl){ "portable", ips_mismatch_portable, ips_scan_portable };
+    ips_diff_supported_count = n;
+}
+
+size_t ips_diff_impls(const ips_diff_impl** impls) {
+    pthread_once(&ips_diff_once, ips_diff_select);
+    *impls = ips_diff_supported;
+    return ips_diff_supported_count;
+}
+
+typedef enum ips_mask {
+    IPS_MASK_DIFFERS = 0,
+    IPS_MASK_REPEATS = 1,
+} ips_mask;
+
+typedef struct ips_creator {
+    const ips_diff_impl* impl;
+    const uint8_t* source;
+    uint64_t source_size;
+    const uint8_t* target;
+    uint64_t target_size;
+
+    // Masks of the block at mask_offset
+    uint64_t mask_offset;
+    uint64_t masks[2];
+
+    rombp_io* output;
+    uint8_t* buf;
+    size_t buf_len;
+    ips_create_stats* stats;
+} ips_creator;
+
+// The masks of the block at offset. Past the end of the source, the target
+// is compared against zeroes, which is what a file grown by a hunk reads as.
+static void ips_creator_scan(ips_creator* creator, uint64_t offset, uint64_t* differs, uint64_t* repeats) {
+    const uint8_t* target = creator->target + offset;
+
+    if (offset > 0 && offset + IPS_DIFF_BLOCK <= creator->target_size) {
+        if (offset + IPS_DIFF_BLOCK <= creator->source_size) {
+            creator->impl->scan(creator->source + offset, target, differs, repeats);
+            return;
+        }
+        if (offset >= creator->source_size) {
+            creator->impl->scan(IPS_ZEROES, target, differs, repeats);
+            return;
+        }
+    }
+
+    // The first block, the one across the end of the source, and the last one
+    *differs = 0;
+    *repeats = 0;
+    uint64_t len = MIN(IPS_DIFF_BLOCK, creator->target_size - offset);
+    for (uint64_t i = 0; i < len; i++) {
+        uint8_t source = offset + i < creator->source_size ? creator->source[offset + i] : 0;
+        *differs |= (uint64_t)(source != target[i]) << i;
+        if (offset + i > 0) {
+            *repeats |= (uint64_t)(target[i] == target[(int64_t)i - 1]) << i;
+        }
+    }
+}
+
+
+// First offset in [offset, limit) whose bit in the mask is set, or clear,
+// or limit if there is none.
+static uint64_t ips_creator_find(ips_creator* creator, uint64_t offset, uint64_t limit, ips_mask which, int set) {
+    while (offset < limit) {
+        uint64_t block = offset & ~(uint64_t)(IPS_DIFF_BLOCK - 1);
+        if (block != creator->mask_offset) {
+            creator->mask_offset = block;
+            ips_creator_scan(creator, block, &creator->masks[IPS_MASK_DIFFERS], &creator->masks[IPS_MASK_REPEATS]);
+        }
+        uint64_t mask = set ? creator->masks[which] : ~creator->masks[which];
+        mask &= UINT64_MAX << (offset - block);
+        if (mask != 0) {
+            return MIN(block + __builtin_ctzll(mask), limit);
+        }
+        offset = block + IPS_DIFF_BLOCK;
+    }
+
+    return limit;
+}
+
+// The next changed byte from offset on, or the end of the target. Whole
+// unchanged stretches are skipped with the mismatch kernel.
+static uint64_t ips_creator_next_difference(ips_creator* creator, uint64_t offset) {
+    const ips_diff_impl* impl = creator->impl;
+
+    uint64_t block_end = MIN((offset | (IPS_DIFF_BLOCK - 1)) + 1, creator->target_size);
+    offset = ips_creator_find(creator, offset, block_end, IPS_MASK_DIFFERS, 1);
+    if (offset < block_end) {
+        return offset;
+    }
+
+    if (offset < creator->source_size) {
+        uint64_t len = creator->source_size - offset;
+        uint64_t same = impl->mismatch(creator->source + offset, creator->target + offset, len);
+        offset += same;
+        if (same < len) {
+            return offset;
+        }
+    }
+    while (offset < creator->target_size) {
+        uint64_t len = MIN(IPS_ZEROES_SIZE, creator->target_size - offset);
+        uint64_t same = impl->mismatch(IPS_ZEROES, creator->target + offset, len);
+        offset += same;
+        if (same < len) {
+            return offset;
+        }
+    }
+
+    return creator->target_size;
+}
+
+// End of the changes from the one at offset on: the first stretch of more
+// unchanged bytes than a hunk header, or the end of the target. Shorter
+// stretches are cheaper to rewrite than to start a new hunk after.
+static uint64_t ips_creator_changes_end(ips_creator* creator, uint64_t offset) {
+    while (1) {
+        uint64_t same = ips_creator_find(creator, offset, creator->target_size, IPS_MASK_DIFFERS, 0);
+        if (same == creator->target_size) {
+            return same;
+        }
+        uint64_t limit = MIN(same + IPS_HEADER_SIZE + 1, creator->target_size);
+        offset = ips_creator_find(creator, same, limit, IPS_MASK_DIFFERS, 1);
+        if (offset == limit) {
+            return same;
+        }
+    }
+}
+
+static int ips_creator_flush(ips_creator* creator) {
+    if (creator->buf_len == 0) {
+        return 0;
+    }
+    if (rombp_io_write_full(creator->output, creator->buf, creator->buf_len, creator->stats->patch_size) != 0) {
+        rombp_log_err("Failed to write IPS patch at: %ld\n", (long)creator->stats->patch_size);
+        return -1;
+    }
+    creator->stats->patch_size += creator->buf_len;
+    creator->buf_len = 0;
+
+    return 0;
+}
+
+static int ips_creator_write(ips_creator* creator, const uint8_t* data, size_t len) {
+    while (len > 0) {
+        if (creator->buf_len == IPS_WRITER_BUF_SIZE && ips_creator_flush(creator) != 0) {
+            return -1;
+        }
+        size_t amount = MIN(len, IPS_WRITER_BUF_SIZE - creator->buf_len);
+        memcpy(creator->buf + creator->buf_len, data, amount);
+        creator->buf_len += amount;
+        data += amount;
+        len -= amount;
+    }
+
+    return 0;
+}
+
+static int ips_creator_header(ips_creator* creator, uint64_t offset, uint64_t length) {
+    uint8_t header[IPS_HEADER_SIZE];
+
+    header[0] = offset >> 16;
+    header[1] = offset >> 8;
+    header[2] = offset;
+    header[3] = length >> 8;
+    header[4] = length;
+    creator->stats->hunks++;
+
+    return ips_creator_write(creator, header, IPS_HEADER_SIZE);
+}
+
+// Hunks that copy the target bytes in [start, end).
+static rombp_patch_err ips_creator_literal(ips_creator* creator, uint64_t start, uint64_t end) {
+    // Rewriting target bytes is harmless, so changes just past the offset
+    // limit can still be reached from the last offset.
+    if (start > IPS_MAX_OFFSET && end - IPS_MAX_OFFSET <= IPS_MAX_LENGTH) {
+        start = IPS_MAX_OFFSET;
+    }
+
+    while (start < end) {
+        if (start == IPS_EOF_OFFSET) {
+            start--;
+        }
+        if (start > IPS_MAX_OFFSET) {
+            rombp_log_err("The target changes at: %ld, past the 24-bit offsets of IPS, a BPS patch is needed\n", (long)start);
+            return PATCH_INVALID_OUTPUT_SIZE;
+        }
+        uint64_t length = MIN(end - start, IPS_MAX_LENGTH);
+        if (ips_creator_header(creator, start, length) != 0 ||
+            ips_creator_write(creator, creator->target + start, length) != 0) {
+            return PATCH_ERR_IO;
+        }
+        start += length;
+    }
+
+    return PATCH_OK;
+}
+
+// RLE hunks that repeat the target byte at start up to end.
+static rombp_patch_err ips_creator_rle(ips_creator* creator, uint64_t start, uint64_t end) {
+    uint8_t value = creator->target[start];
+
+    while (start < end) {
+        if (start > IPS_MAX_OFFSET) {
+            return ips_creator_literal(creator, start, end);
+        }
+        if (start == IPS_EOF_OFFSET) {
+            rombp_patch_err err = ips_creator_literal(creator, start, start + 1);
+            if (err != PATCH_OK) {
+                return err;
+            }
+            start++;
+            continue;
+        }
+        uint64_t length = MIN(end - start, IPS_MAX_LENGTH);
+        uint8_t payload[] = { length >> 8, length, value };
+        if (ips_creator_header(creator, start, 0) != 0 || ips_creator_write(creator, payload, sizeof(payload)) != 0) {
+            return PATCH_ERR_IO;
+        }
+        creator->stats->rle_hunks++;
+        start += length;
+    }
+
+    return PATCH_OK;
+}
+
+// Hunks for the changes in [start, end). Runs of one byte become RLE hunks
+// when that's shorter than leaving them in the literal hunk around them,
+// which has to be split for them.
+static rombp_patch_err ips_creator_changes(ips_creator* creator, uint64_t start, uint64_t end) {
+    rombp_patch_err err;
+    uint64_t literal = start;
+    uint64_t offset = start;
+
+    while (1) {
+        uint64_t repeat = ips_creator_find(creator, offset + 1, end, IPS_MASK_REPEATS, 1);
+        if (repeat >= end) {
+            break;
+        }
+        uint64_t run_start = repeat - 1;
+        uint64_t run_end = ips_creator_find(creator, repeat, end, IPS_MASK_REPEATS, 0);
+        uint64_t split = (run_start > literal ? IPS_HEADER_SIZE : 0) + (run_end < end ? IPS_HEADER_SIZE : 0);
+        if (run_end - run_start > IPS_RLE_SIZE - IPS_HEADER_SIZE + split) {
+            if ((err = ips_creator_literal(creator, literal, run_start)) != PATCH_OK ||
+                (err = ips_creator_rle(creator, run_start, run_end)) != PATCH_OK) {
+                return err;
+            }
+            literal = run_end;
+        }
+        offset = run_end;
+    }
+
+    return ips_creator_literal(creator, literal, end);
+}
+
+rombp_patch_err ips_create_with(const ips_diff_impl* impl,
+                                const uint8_t* source, uint64_t source_size,
+                                const uint8_t* target, uint64_t target_size,
+                                rombp_io* output, ips_create_stats* stats) {
+    rombp_patch_err err = PATCH_OK;
+
+    memset(stats, 0, sizeof(ips_create_stats));
+    if (target_size < source_size) {
+        rombp_log_err("IPS patches can't shrink a file, source: %ld bytes, target: %ld bytes\n",
+                      (long)source_size, (long)target_size);
+        return PATCH_INVALID_OUTPUT_SIZE;
+    }
+
+    ips_creator creator = {
+        .impl = impl,
+        .source = source,
+        .source_size = source_size,
+        .target = target,
+        .target_size = target_size,
+        .mask_offset = UINT64_MAX,
+        .output = output,
+        .buf = malloc(IPS_WRITER_BUF_SIZE),
+        .stats = stats,
+    };
+    if (creator.buf == NULL) {
+        rombp_log_err("Failed to allocate IPS writer buffer\n");
+        return PATCH_ERR_IO;
+    }
+    if (ips_creator_write(&creator, IPS_MARKER, sizeof(IPS_MARKER)) != 0) {
+        err = PATCH_ERR_IO;
+        goto out;
+    }
+
+    uint64_t offset = 0;
+    while ((offset = ips_creator_next_difference(&creator, offset)) < target_size) {
+        uint64_t end = ips_creator_changes_end(&creator, offset);
+        if ((err = ips_creator_changes(&creator, offset, end)) != PATCH_OK) {
+            goto out;
+        }
+        offset = end;
+    }
+    // A file is only grown up to the end of its last hunk, which has to
+    // reach the end of the target even when its last bytes are zeroes.
+    if (target_size > source_size && ips_creator_find(&creator, target_size - 1, target_size, IPS_MASK_DIFFERS, 1) != target_size - 1 &&
+        (err = ips_creator_literal(&creator, target_size - 1, target_size)) != PATCH_OK) {
+        goto out;
+    }
+    if (ips_creator_write(&creator, IPS_FOOTER, sizeof(IPS_FOOTER)) != 0 || ips_creator_flush(&creator) != 0) {
+        err = PATCH_ERR_IO;
+        goto out;
+    }
+
+    rombp_log_info("Created IPS patch with the %s kernels, hunks: %ld, RLE: %ld, size: %ld\n", impl->name,
+                   (long)stats->hunks, (long)stats->rle_hunks, (long)stats->patch_size);
+
+out:
+    free(creator.buf);
+    return err;
+}
+
+rombp_patch_err ips_create(const uint8_t* source, uint64_t source_size,
+                           const uint8_t* target, uint64_t target_size,
+                           rombp_io* output, ips_create_stats* stats) {
+    const ips_diff_impl* impls;
+    ips_diff_impls(&impls);
+    return ips_create_with(&impls[0], source, source_size, target, target_size, output, stats);
+}
@@ -0,0 +1,52 @@
+#ifndef ROMBP_IPS_CREATE_H_
+#define ROMBP_IPS_CREATE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "io.h"
+#include "patch.h"
+
+// Bytes the diff kernels compare at once
+#define IPS_DIFF_BLOCK 64
+
+// First index where a and b differ, or len if they don't.
+typedef size_t (*ips_mismatch_fn)(const uint8_t* a, const uint8_t* b, size_t len);
+// Compare IPS_DIFF_BLOCK bytes of source and target. Bit i of *differs is
+// set when source[i] != target[i], and bit i of *repeats when
+// target[i] == target[i - 1], so target[-1] has to be readable.
+typedef void (*ips_scan_fn)(const uint8_t* source, const uint8_t* target, uint64_t* differs, uint64_t* repeats);
+
+typedef struct ips_diff_impl {
+    const char* name;
+    ips_mismatch_fn mismatch;
+    ips_scan_fn scan;
+} ips_diff_impl;
+
+// The diff kernels the CPU supports, fastest first. The portable one is
+// always last. For testing and benchmarking them against each other.
+size_t ips_diff_impls(const ips_diff_impl** impls);
+
+typedef struct ips_create_stats {
+    uint64_t hunks;
+    // Hunks that repeat one byte, counted in hunks as well
+    uint64_t rle_hunks;
+    uint64_t patch_size;
+} ips_create_stats;
+
+// Write an IPS patch from source to target to output, with the fastest diff
+// kernels. Differences close together share a hunk, and runs of one byte
+// are written as RLE hunks where they're shorter. IPS can't shrink a file,
+// and its offsets are 24-bit, so the target can't be smaller than the source
+// or differ from it much past 16MB.
+rombp_patch_err ips_create(const uint8_t* source, uint64_t source_size,
+                           const uint8_t* target, uint64_t target_size,
+                           rombp_io* output, ips_create_stats* stats);
+
+// Same as ips_create(), with the given diff kernels.
+rombp_patch_err ips_create_with(const ips_diff_impl* impl,
+                                const uint8_t* source, uint64_t source_size,
+                                const uint8_t* target, uint64_t target_size,
+                                rombp_io* output, ips_create_stats* stats);
+
+#endif
@@ -0,0 +1,79 @@
+#include <stdlib.h>
+
+#include "bps.h"
+#include "io.h"
+#include "ips.h"
+#include "librombp.h"
+#include "log.h"
+
+static rombp_patch_err apply_ips(rombp_io* source, rombp_io* output, rombp_io* patch) {
+    ips_context ctx;
+    rombp_hunk_iter_status status;
+
+    rombp_patch_err err = ips_start(&ctx, source, output, patch);
+    if (err != PATCH_OK) {
+        return err;
+    }
+    do {
+        status = ips_next(&ctx);
+    } while (status == HUNK_NEXT);
+    ips_release(&ctx);
+
+    return status == HUNK_DONE ? PATCH_OK : PATCH_ERR_IO;
+}
+
+static rombp_patch_err apply_bps(rombp_io* source, rombp_io* output, rombp_io* patch) {
+    bps_file_header header;
+    rombp_hunk_iter_status status;
+
+    rombp_patch_err err = bps_start(&header, source, output, patch);
+    if (err != PATCH_OK) {
+        return err;
+    }
+    do {
+        status = bps_next(&header);
+    } while (status == HUNK_NEXT);
+    if (status != HUNK_DONE) {
+        bps_release(&header);
+        return PATCH_ERR_IO;
+    }
+
+    return bps_end(&header);
+}
+
+// Runs the same engines as the command line tool, on memory backends.
+rombp_patch_err rombp_apply(const uint8_t* source, size_t source_size,
+                            const uint8_t* patch, size_t patch_size,
+                            uint8_t** output, size_t* output_size) {
+    rombp_io source_io;
+    rombp_io patch_io;
+    rombp_io output_io;
+    rombp_patch_err err;
+
+    rombp_io_open_mem(&source_io, source, source_size);
+    rombp_io_open_mem(&patch_io, patch, patch_size);
+    if (rombp_io_open_mem_growable(&output_io, source_size) != 0) {
+        return PATCH_ERR_IO;
+    }
+
+    if (ips_verify_marker(&patch_io) == PATCH_OK) {
+        rombp_log_info("Detected patch type: IPS\n");
+        err = apply_ips(&source_io, &output_io, &patch_io);
+    } else if (bps_verify_marker(&patch_io) == PATCH_OK) {
+        rombp_log_info("Detected patch type: BPS\n");
+        err = apply_bps(&source_io, &output_io, &patch_io);
+    } else {
+        rombp_log_err("Unknown patch type\n");
+        err = PATCH_UNKNOWN_TYPE;
+    }
+
+    if (err == PATCH_OK) {
+        *output = rombp_io_mem_take(&output_io, output_size);
+    }
+    rombp_io_close(&output_io);
+    return err;
+}
+
+void rombp_free(uint8_t* output) {
+    free(output);
+}
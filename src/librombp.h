@@ -0,0 +1,30 @@
+#ifndef ROMBP_LIBROMBP_H_
+#define ROMBP_LIBROMBP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "patch.h"
+
+// Public API of librombp, for applying patches to ROMs that are
+// already in memory.
+
+// Apply an IPS or BPS patch to the source ROM. The patch type is detected
+// from its marker. On PATCH_OK, *output points to the patched ROM of
+// *output_size bytes, which must be released with rombp_free(). Nothing
+// touches the filesystem.
+rombp_patch_err rombp_apply(const uint8_t* source, size_t source_size,
+                            const uint8_t* patch, size_t patch_size,
+                            uint8_t** output, size_t* output_size);
+
+// Fold a chain of IPS and BPS patches, applied in order to the source ROM,
+// into one BPS patch from the source to the final image. The result is
+// checked against the chain before it's returned in *output, which must be
+// released with rombp_free().
+rombp_patch_err rombp_compose(const uint8_t* source, size_t source_size,
+                              const uint8_t* const* patches, const size_t* patch_sizes, int patch_count,
+                              uint8_t** output, size_t* output_size);
+
+void rombp_free(uint8_t* output);
+
+#endif
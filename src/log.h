@@ -2,8 +2,8 @@
 #define LOG_H_
 
 #define rombp_log_err(MSG, ...) fprintf(stderr, MSG, ##__VA_ARGS__)
-#ifdef TARGET_RG350
-// Disable info logging when on device.
+#if defined(TARGET_RG350) || defined(ROMBP_NO_INFO_LOG)
+// Disable info logging when on device, in the benchmarks and in librombp.
 #define rombp_log_info(MSG, ...) {};
 #else
 #define rombp_log_info(MSG, ...) fprintf(stdout, MSG, ##__VA_ARGS__)
@@ -1,20 +1,22 @@
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "log.h"
 #include "patch.h"
 
-rombp_patch_err patch_verify_marker(FILE* patch_file, const uint8_t* expected_header, const size_t header_size) {
+rombp_patch_err patch_verify_marker(rombp_io* patch, const uint8_t* expected_header, const size_t header_size) {
     uint8_t buf[header_size];
 
-    size_t nread = fread(&buf, 1, header_size, patch_file);
-    if (nread < header_size) {
+    ssize_t nread = rombp_io_read_at(patch, &buf, header_size, 0);
+    if (nread < (ssize_t)header_size) {
         rombp_log_err("Header malformed, expected to get at least %ld bytes in the patch file, read: %ld\n", (long int)header_size, (long int)nread);
         return PATCH_INVALID_HEADER;
     }
 
     for (int i = 0; i < header_size; i++) {
         if (expected_header[i] != buf[i]) {
-            rombp_log_err("Marker at byte %d doesn't match. Value: %d\n", i, buf[i]);
+            rombp_log_info("Marker at byte %d doesn't match. Value: %d\n", i, buf[i]);
             return PATCH_INVALID_HEADER;
         }
     }
@@ -22,6 +24,28 @@ rombp_patch_err patch_verify_marker(FILE* patch_file, const uint8_t* expected_he
     return PATCH_OK;
 }
 
+static const char* PATCH_TYPE_NAMES[] = {
+    "ips",
+    "bps",
+};
+
+// Returns PATCH_TYPE_UNKNOWN for unknown patch formats.
+rombp_patch_type patch_type_from_name(const char* name) {
+    for (int i = 0; i < sizeof(PATCH_TYPE_NAMES) / sizeof(PATCH_TYPE_NAMES[0]); i++) {
+        if (strcmp(name, PATCH_TYPE_NAMES[i]) == 0) {
+            return i;
+        }
+    }
+    return PATCH_TYPE_UNKNOWN;
+}
+
+// Number of threads worth using for the parallel parts of patching: one per
+// online CPU.
+int patch_worker_count() {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count < 1 ? 1 : count;
+}
+
 void patch_status_reset(rombp_patch_status* status) {
     status->is_done = 0;
     status->iter_status = HUNK_NONE;
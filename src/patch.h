@@ -5,6 +5,8 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include "io.h"
+
 typedef enum rombp_patch_type {
     PATCH_TYPE_UNKNOWN = -1,
     PATCH_TYPE_IPS = 0,
@@ -22,6 +24,7 @@ typedef enum rombp_patch_err {
     PATCH_INVALID_OUTPUT_CHECKSUM = -6,
     PATCH_UNKNOWN_TYPE = -7,
     PATCH_FAILED_TO_START = -8,
+    PATCH_INVALID_PATCH_CHECKSUM = -9,
 } rombp_patch_err;
 
 // Status code used during hunk iteration.
@@ -41,7 +44,9 @@ typedef struct rombp_patch_status {
     int hunk_count;
 } rombp_patch_status;
 
-rombp_patch_err patch_verify_marker(FILE* patch_file, const uint8_t* expected_header, const size_t header_size);
+rombp_patch_type patch_type_from_name(const char* name);
+rombp_patch_err patch_verify_marker(rombp_io* patch, const uint8_t* expected_header, const size_t header_size);
+int patch_worker_count();
 void patch_status_init(rombp_patch_status* status);
 void patch_status_copy(rombp_patch_status* dest, rombp_patch_status* src);
 void patch_status_reset(rombp_patch_status* status);
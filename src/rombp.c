@@ -1,16 +1,29 @@
 #include <errno.h>
+#include <getopt.h>
+#include <glob.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
 
 #include "bps.h"
+#include "bps_create.h"
 #include "ips.h"
+#include "ips_create.h"
+#include "librombp.h"
 #include "log.h"
 #include "ui.h"
 
 static const char* PATCH_NEXT_MESSAGE = "Patching. Wrote %d hunks";
 static const char* PATCH_SUCCESS_MESSAGE = "Success! Wrote %d hunks";
+static const char* ROLLBACK_SUCCESS_MESSAGE = "Success! Rolled back the ROM";
 static const char* PATCH_FAIL_INVALID_OUTPUT_SIZE_MESSAGE = "ERR: Invalid output size!";
 static const char* PATCH_FAIL_INVALID_OUTPUT_CHECKSUM_MESSAGE = "ERR: Invalid output checksum!";
+static const char* PATCH_FAIL_INVALID_INPUT_CHECKSUM_MESSAGE = "ERR: Wrong input ROM for patch!";
+static const char* PATCH_FAIL_INVALID_PATCH_CHECKSUM_MESSAGE = "ERR: Patch file is corrupt!";
 static const char* PATCH_FAIL_ERR_IO = "ERR: Failed to open file!";
 static const char* PATCH_FAIL_START = "ERR: Failed to start!";
 static const char* PATCH_FAIL_UNKNOWN_TYPE = "ERR: Unknown patch type!";
@@ -18,6 +31,22 @@ static const char* PATCH_UNKNOWN_ERROR_MESSAGE = "ERR: Unknown end error!";
 
 static const int DEFAULT_SLEEP = 16;
 
+// A patch or output file name of "-" is stdin or stdout.
+static const char* STDIO_FILE_NAME = "-";
+
+// First argument that composes patches, instead of applying them.
+static const char* COMPOSE_COMMAND = "compose";
+// First argument that creates a patch from two ROM files.
+static const char* CREATE_COMMAND = "create";
+
+// The handheld's 32-bit address space and small RAM can't hold the mapping
+// of a whole disc image.
+#ifdef TARGET_RG350
+static const size_t DEFAULT_MAP_LIMIT = 192 * 1024 * 1024;
+#else
+static const size_t DEFAULT_MAP_LIMIT = 0;
+#endif
+
 static void close_files(FILE* input_file, FILE* output_file, FILE* ips_file) {
     if (input_file != NULL) {
         fclose(input_file);
@@ -30,23 +59,17 @@ static void close_files(FILE* input_file, FILE* output_file, FILE* ips_file) {
     }
 }
 
-static rombp_patch_type detect_patch_type(FILE* patch_file) {
+static rombp_patch_type detect_patch_type(rombp_io* patch) {
     rombp_log_info("Trying to detect patch type\n");
-    int rc = ips_verify_marker(patch_file);
+    int rc = ips_verify_marker(patch);
 
     if (rc == 0) {
         rombp_log_info("Detected patch type: IPS\n");
         return PATCH_TYPE_IPS;
     }
 
-    rc = fseek(patch_file, 0, SEEK_SET);
-    if (rc == -1) {
-        rombp_log_err("Error seeking patch file to beginning\n");
-        return PATCH_TYPE_UNKNOWN;
-    }
-
     rombp_log_info("Trying to detect BPS patch type\n");
-    rc = bps_verify_marker(patch_file);
+    rc = bps_verify_marker(patch);
     if (rc == 0) {
         rombp_log_info("Detected patch type: BPS\n");
         return PATCH_TYPE_BPS;
@@ -59,28 +82,162 @@ static rombp_patch_type detect_patch_type(FILE* patch_file) {
 // need to be passed into our start function.
 typedef union {
     bps_file_header bps_file_header;
+    ips_context ips_context;
 } rombp_patch_context;
 
-static int start_patch(rombp_patch_type patch_type, rombp_patch_context* ctx, FILE* input_file, FILE* patch_file, FILE* output_file) {
+// I/O backends for the files of one patch job. A backend is only closed if
+// it was opened, ops is NULL otherwise.
+typedef struct rombp_patch_io {
+    rombp_io input;
+    rombp_io output;
+    rombp_io patch;
+} rombp_patch_io;
+
+static void close_io(rombp_io* io) {
+    if (io->ops != NULL) {
+        rombp_io_close(io);
+        io->ops = NULL;
+    }
+}
+
+// Pick the backend for the files of a job. Unless one is forced, files are
+// memory mapped: the BPS mapped engine and parallel IPS runs write straight
+// into the mapping, and IPS inputs can still be copied inside the kernel
+// through the mapped file's descriptor.
+static rombp_io_backend patch_io_backend(rombp_patch_command* command) {
+    if (command->io_backend != ROMBP_IO_AUTO) {
+        return command->io_backend;
+    }
+    return ROMBP_IO_MMAP;
+}
+
+// The map limit is shared by the patch, input and output files.
+static uint64_t patch_map_limit(rombp_patch_command* command) {
+    return command->map_limit / 3;
+}
+
+static int open_patch_io(rombp_patch_io* pio, rombp_patch_command* command, FILE* input_file, FILE* output_file) {
+    rombp_io_backend backend = patch_io_backend(command);
+    uint64_t map_limit = patch_map_limit(command);
+
+    if (input_file != NULL && rombp_io_open_file(&pio->input, input_file, backend, 0, map_limit) != 0) {
+        return -1;
+    }
+    if (rombp_io_open_file(&pio->output, output_file, backend, 1, map_limit) != 0) {
+        return -1;
+    }
+    rombp_log_info("I/O backends, input: %s, output: %s, patch: %s\n",
+                   input_file != NULL ? rombp_io_name(&pio->input) : "none",
+                   rombp_io_name(&pio->output),
+                   rombp_io_name(&pio->patch));
+
+    return 0;
+}
+
+// The journal of an earlier patch is the only way back to the original ROM,
+// it's never overwritten.
+static rombp_patch_err open_journal(FILE** journal_file, const char* path) {
+    *journal_file = fopen(path, "wx");
+    if (*journal_file == NULL && errno == EEXIST) {
+        rombp_log_err("Undo journal already exists: %s, roll it back or move it first\n", path);
+        return PATCH_ERR_IO;
+    }
+    if (*journal_file == NULL) {
+        rombp_log_err("Failed to open undo journal: %s, errno: %d\n", path, errno);
+        return PATCH_ERR_IO;
+    }
+    return PATCH_OK;
+}
+
+// Drop a journal before anything it covers was written, it would only lock
+// the ROM out of in place patching.
+static void discard_journal(FILE** journal_file, const char* path) {
+    fclose(*journal_file);
+    *journal_file = NULL;
+    if (unlink(path) != 0) {
+        rombp_log_err("Failed to remove undo journal: %s, errno: %d\n", path, errno);
+    }
+}
+
+// Start an in place IPS patch. The patch is compiled before the journal is
+// created, so a patch that can't be applied leaves nothing behind.
+static rombp_patch_err start_in_place(ips_context* ctx, rombp_patch_command* command, rombp_io* target,
+                                      rombp_io* patch, FILE** journal_file) {
+    rombp_patch_err err = ips_compile(&ctx->program, patch);
+    if (err != PATCH_OK) {
+        return err;
+    }
+    if (journal_file != NULL && command->journal_file != NULL) {
+        err = open_journal(journal_file, command->journal_file);
+        if (err != PATCH_OK) {
+            ips_release(ctx);
+            return err;
+        }
+    }
+
+    err = ips_start_in_place(ctx, target, journal_file != NULL ? *journal_file : NULL);
+    if (err != PATCH_OK && journal_file != NULL && *journal_file != NULL) {
+        discard_journal(journal_file, command->journal_file);
+    }
+    return err;
+}
+
+// The engines pick one thread per CPU, cap them to the command's budget.
+static void limit_patch_threads(rombp_patch_type patch_type, rombp_patch_context* ctx, int threads) {
+    if (threads <= 0) {
+        return;
+    }
+    switch (patch_type) {
+        case PATCH_TYPE_IPS:
+            ctx->ips_context.threads = MIN(ctx->ips_context.threads, threads);
+            break;
+        case PATCH_TYPE_BPS:
+            ctx->bps_file_header.threads = MIN(ctx->bps_file_header.threads, threads);
+            ctx->bps_file_header.output_crc32_threads = MIN(ctx->bps_file_header.output_crc32_threads, threads);
+            break;
+        default:
+            break;
+    }
+}
+
+static int start_patch(rombp_patch_type patch_type, rombp_patch_context* ctx, rombp_patch_command* command,
+                       rombp_io* input, rombp_io* output, rombp_io* patch, FILE** journal_file) {
     int rc;
 
     rombp_log_info("Start patching\n");
 
+    if (command->in_place && patch_type != PATCH_TYPE_IPS) {
+        rombp_log_err("In place patching is only supported for IPS patches\n");
+        return -1;
+    }
+
     switch (patch_type) {
         case PATCH_TYPE_IPS:
             rombp_log_info("Patch type started with IPS!\n");
-            rc = ips_start(input_file, output_file);
+            if (command->in_place) {
+                rc = start_in_place(&ctx->ips_context, command, output, patch, journal_file);
+            } else {
+                rc = ips_start(&ctx->ips_context, input, output, patch);
+            }
             if (rc != PATCH_OK) {
                 rombp_log_err("Failed to start patching IPS file: %d\n", rc);
                 return -1;
             }
+            limit_patch_threads(patch_type, ctx, command->threads);
             return 0;
         case PATCH_TYPE_BPS:
-            rc = bps_start(patch_file, &ctx->bps_file_header);
+            if (command->stream_window > 0) {
+                rc = bps_start_stream(&ctx->bps_file_header, input, output, patch, command->stream_window);
+            } else {
+                rc = bps_start(&ctx->bps_file_header, input, output, patch);
+            }
             if (rc != PATCH_OK) {
                 rombp_log_err("Failed to start patching BPS file: %d\n", rc);
-                return -1;
+                // BPS patches are checked before anything is written, keep
+                // reporting a corrupt patch as such.
+                return rc == PATCH_INVALID_PATCH_CHECKSUM ? rc : -1;
             }
+            limit_patch_threads(patch_type, ctx, command->threads);
             return 0;
         default:
             rombp_log_err("Cannot start unknown patch type\n");
@@ -88,69 +245,416 @@ static int start_patch(rombp_patch_type patch_type, rombp_patch_context* ctx, FI
     }
 }
 
-static rombp_patch_err end_patch(rombp_patch_type patch_type, rombp_patch_context* ctx, FILE* patch_file) {
+static rombp_patch_err end_patch(rombp_patch_type patch_type, rombp_patch_context* ctx) {
     rombp_log_info("End patching\n");
     switch (patch_type) {
-        case PATCH_TYPE_BPS: return bps_end(&ctx->bps_file_header, patch_file);
+        case PATCH_TYPE_BPS: return bps_end(&ctx->bps_file_header);
         case PATCH_TYPE_IPS:
         default:
             return PATCH_OK; // No cleanup work for IPS patches, by default nothing left to do.
     }
 }
 
-static rombp_hunk_iter_status next_hunk(rombp_patch_type patch_type, rombp_patch_context* patch_ctx, FILE* input_file, FILE* output_file, FILE* patch_file) {
+// Release any patch type specific resources, once patching is done
+// or was aborted.
+static void cleanup_patch(rombp_patch_type patch_type, rombp_patch_context* ctx) {
+    switch (patch_type) {
+        case PATCH_TYPE_BPS:
+            bps_release(&ctx->bps_file_header);
+            break;
+        case PATCH_TYPE_IPS:
+            ips_release(&ctx->ips_context);
+            break;
+        default:
+            break;
+    }
+}
+
+static rombp_hunk_iter_status next_hunk(rombp_patch_type patch_type, rombp_patch_context* patch_ctx) {
     switch (patch_type) {
-        case PATCH_TYPE_IPS: return ips_next(input_file, output_file, patch_file);
-        case PATCH_TYPE_BPS: return bps_next(&patch_ctx->bps_file_header, input_file, output_file, patch_file);
+        case PATCH_TYPE_IPS: return ips_next(&patch_ctx->ips_context);
+        case PATCH_TYPE_BPS: return bps_next(&patch_ctx->bps_file_header);
         default: return HUNK_NONE;
     }
 }
 
-static rombp_patch_err open_patch_files(FILE** input_file, FILE** output_file, FILE** ips_file, rombp_patch_command* command) {
-    *input_file = fopen(command->input_file, "r");
-    if (*input_file == NULL) {
-        rombp_log_err("Failed to open input file: %s, errno: %d\n", command->input_file, errno);
-        return PATCH_ERR_IO;
+// The patched output goes to stdout. Info logging goes there too, so stdout
+// is pointed at stderr, and the output gets its own copy of the descriptor.
+static FILE* open_stdout_output() {
+    int fd = dup(STDOUT_FILENO);
+    if (fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+        rombp_log_err("Failed to redirect stdout, errno: %d\n", errno);
+        return NULL;
     }
+    return fdopen(fd, "w");
+}
 
-    *output_file = fopen(command->output_file, "w+");
-    if (*output_file == NULL) {
-        rombp_log_err("Failed to open output file: %d\n", errno);
-        close_files(*input_file, NULL, NULL);
-        return PATCH_ERR_IO;
+static FILE* open_patch_file(const char* path) {
+    if (strcmp(path, STDIO_FILE_NAME) == 0) {
+        return stdin;
     }
+    return fopen(path, "r");
+}
+
+// Any file that couldn't be opened is left NULL. When patching in place,
+// there's no separate input file: the input is opened as the output.
+static rombp_patch_err open_patch_files(FILE** input_file, FILE** output_file, FILE** ips_file, rombp_patch_command* command) {
+    if (command->in_place) {
+        *output_file = fopen(command->input_file, "r+");
+        if (*output_file == NULL) {
+            rombp_log_err("Failed to open input file for in place patching: %s, errno: %d\n", command->input_file, errno);
+            return PATCH_ERR_IO;
+        }
+    } else {
+        *input_file = fopen(command->input_file, "r");
+        if (*input_file == NULL) {
+            rombp_log_err("Failed to open input file: %s, errno: %d\n", command->input_file, errno);
+            return PATCH_ERR_IO;
+        }
 
-    *ips_file = fopen(command->ips_file, "r");
+        if (strcmp(command->output_file, STDIO_FILE_NAME) == 0) {
+            *output_file = open_stdout_output();
+        } else {
+            *output_file = fopen(command->output_file, "w+");
+        }
+        if (*output_file == NULL) {
+            rombp_log_err("Failed to open output file: %d\n", errno);
+            return PATCH_ERR_IO;
+        }
+    }
+
+    *ips_file = open_patch_file(command->ips_file);
     if (*ips_file == NULL) {
         rombp_log_err("Failed to open IPS file: %d\n", errno);
-        close_files(*input_file, *output_file, NULL);
         return PATCH_ERR_IO;
     }
 
     return PATCH_OK;
 }
 
+// Undo an in place patch from its journal. The journal is used up once the
+// ROM is restored, so the ROM can be patched in place again.
+static rombp_patch_err execute_rollback(rombp_patch_command* command) {
+    FILE* target_file = fopen(command->input_file, "r+");
+    if (target_file == NULL) {
+        rombp_log_err("Failed to open file to roll back: %s, errno: %d\n", command->input_file, errno);
+        return PATCH_ERR_IO;
+    }
+    FILE* journal_file = fopen(command->rollback_file, "r");
+    if (journal_file == NULL) {
+        rombp_log_err("Failed to open undo journal: %s, errno: %d\n", command->rollback_file, errno);
+        fclose(target_file);
+        return PATCH_ERR_IO;
+    }
+
+    rombp_io target;
+    rombp_io_open_fd(&target, fileno(target_file));
+    rombp_patch_err err = ips_rollback(&target, journal_file);
+
+    rombp_io_close(&target);
+    fclose(journal_file);
+    if (fclose(target_file) != 0 && err == PATCH_OK) {
+        rombp_log_err("Failed to close rolled back file: %s, errno: %d\n", command->input_file, errno);
+        err = PATCH_ERR_IO;
+    }
+    if (err == PATCH_OK && unlink(command->rollback_file) != 0) {
+        rombp_log_err("Failed to remove undo journal: %s, errno: %d\n", command->rollback_file, errno);
+    }
+    return err;
+}
+
+static const char* BPS_COMMAND_NAMES[] = {
+    "SourceRead",
+    "TargetRead",
+    "SourceCopy",
+    "TargetCopy",
+};
+
+// Print what a BPS patch does, from its plan.
+static rombp_patch_err print_bps_info(rombp_io* patch) {
+    bps_file_header file_header;
+    uint64_t counts[4] = { 0 };
+    uint64_t bytes[4] = { 0 };
+    uint64_t overlapping = 0;
+
+    rombp_patch_err err = bps_plan_patch(&file_header, patch);
+    if (err != PATCH_OK) {
+        return err;
+    }
+
+    const bps_plan* plan = &file_header.plan;
+    for (size_t i = 0; i < plan->count; i++) {
+        counts[plan->opcode[i]]++;
+        bytes[plan->opcode[i]] += plan->length[i];
+        if (plan->opcode[i] == BPS_TARGET_COPY && plan->output_offset[i] - plan->read_offset[i] < plan->length[i]) {
+            overlapping++;
+        }
+    }
+
+    printf("Format: BPS\n");
+    printf("Source size: %lu, CRC32: %08x\n", (unsigned long)file_header.source_size, file_header.expected_source_crc32);
+    printf("Target size: %lu, CRC32: %08x\n", (unsigned long)file_header.target_size, file_header.expected_target_crc32);
+    printf("Patch size: %lu, CRC32: %08x\n", (unsigned long)file_header.patch_size, file_header.expected_patch_crc32);
+    printf("Metadata size: %lu\n", (unsigned long)file_header.metadata_size);
+    printf("Commands: %lu\n", (unsigned long)plan->count);
+    for (int op = 0; op < 4; op++) {
+        printf("  %-10s %10lu commands, %12lu bytes\n", BPS_COMMAND_NAMES[op],
+               (unsigned long)counts[op], (unsigned long)bytes[op]);
+    }
+    printf("Overlapping TargetCopy commands: %lu\n", (unsigned long)overlapping);
+    printf("Source bytes read: [0, %lu)\n", (unsigned long)plan->source_end);
+
+    bps_release(&file_header);
+    return PATCH_OK;
+}
+
+// Print what an IPS patch does, from its compiled program.
+static rombp_patch_err print_ips_info(rombp_io* patch) {
+    ips_program program;
+    uint64_t rle_runs = 0;
+    uint64_t bytes = 0;
+
+    rombp_patch_err err = ips_compile(&program, patch);
+    if (err != PATCH_OK) {
+        return err;
+    }
+
+    for (size_t i = 0; i < program.hunk_count; i++) {
+        if (program.hunks[i].payload & IPS_HUNK_RLE) {
+            rle_runs++;
+        }
+        bytes += program.hunks[i].length;
+    }
+
+    printf("Format: IPS\n");
+    printf("Hunks: %lu\n", (unsigned long)program.patch_hunk_count);
+    printf("Runs after resolving overlaps: %lu, RLE: %lu\n", (unsigned long)program.hunk_count, (unsigned long)rle_runs);
+    printf("Bytes written: %lu\n", (unsigned long)bytes);
+    printf("Output end: %lu\n", (unsigned long)program.output_end);
+
+    ips_program_release(&program);
+    return PATCH_OK;
+}
+
+// Check a patch file without applying it, or describe it with --info.
+static rombp_patch_err execute_validate(rombp_patch_command* command) {
+    rombp_patch_err err;
+    rombp_io patch;
+
+    FILE* patch_file = open_patch_file(command->ips_file);
+    if (patch_file == NULL) {
+        rombp_log_err("Failed to open patch file: %s, errno: %d\n", command->ips_file, errno);
+        return PATCH_ERR_IO;
+    }
+    if (rombp_io_open_file(&patch, patch_file, patch_io_backend(command), 0, patch_map_limit(command)) != 0) {
+        fclose(patch_file);
+        return PATCH_ERR_IO;
+    }
+
+    switch (detect_patch_type(&patch)) {
+        case PATCH_TYPE_IPS:
+            err = command->info ? print_ips_info(&patch) : ips_validate(&patch);
+            break;
+        case PATCH_TYPE_BPS:
+            err = command->info ? print_bps_info(&patch) : bps_validate(&patch);
+            break;
+        default:
+            err = PATCH_UNKNOWN_TYPE;
+            break;
+    }
+
+    rombp_io_close(&patch);
+    fclose(patch_file);
+    return err;
+}
+
 static void display_help() {
     fprintf(stderr, "rombp: IPS and BPS patcher\n\n");
     fprintf(stderr, "Usage:\n");
-    fprintf(stderr, "rombp [options]\n\n");
+    fprintf(stderr, "rombp [options]\n");
+    fprintf(stderr, "rombp compose -i [FILE] -p [FILE] [-p [FILE]...] -o [FILE]\n");
+    fprintf(stderr, "rombp create -o [FILE] [SOURCE] [TARGET]\n\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "\t-i [FILE], Input ROM file\n");
-    fprintf(stderr, "\t-p [FILE], IPS or BPS patch file\n");
-    fprintf(stderr, "\t-o [FILE], Patched output file\n\n");
+    fprintf(stderr, "\t-p [FILE], IPS or BPS patch file. Several are applied in order, and only the last\n");
+    fprintf(stderr, "\t          result is written\n");
+    fprintf(stderr, "\t-o [FILE], Patched output file\n");
+    fprintf(stderr, "\t--in-place, Patch the input ROM file directly (IPS only)\n");
+    fprintf(stderr, "\t-j [FILE], --journal [FILE], Save an undo journal when patching in place\n");
+    fprintf(stderr, "\t-r [FILE], --rollback [FILE], Undo an in place patch of the input ROM file\n");
+    fprintf(stderr, "\t--validate, Only check the patch file, no input or output is needed\n");
+    fprintf(stderr, "\t--info, Check the patch file, and print what it does\n");
+    fprintf(stderr, "\t--io [auto|stdio|fd|mmap], I/O backend used for all files\n");
+    fprintf(stderr, "\t--window [SIZE], Apply BPS patches in one pass, keeping SIZE bytes (K, M or G) of output\n");
+    fprintf(stderr, "\t                for target copies. Patches from stdin (-p -) or to stdout (-o -) always are streamed\n");
+    fprintf(stderr, "\t--map-limit [SIZE], Memory map at most SIZE bytes (K, M or G) of the files at once\n");
+    fprintf(stderr, "\t--batch [GLOB], Patch every input file matching GLOB, -o is then a name template\n");
+    fprintf(stderr, "\t                where {dir}, {name} and {ext} are parts of the input file name\n");
+    fprintf(stderr, "\t--manifest [FILE], Patch every input file listed in FILE, one per line\n");
+    fprintf(stderr, "\t--jobs [N], Batch jobs to run at once, one per CPU by default\n");
+    fprintf(stderr, "\t--memory [SIZE], Most working memory (K, M or G) for creating a patch. Half of the RAM\n");
+    fprintf(stderr, "\t                 by default for suffix, 64M for stream\n");
+    fprintf(stderr, "\t--method [auto|suffix|stream], How a patch is created: suffix arrays find the most\n");
+    fprintf(stderr, "\t                 moved data, stream takes a fixed amount of memory for huge files. auto\n");
+    fprintf(stderr, "\t                 streams files the suffix arrays don't fit in memory for\n");
+    fprintf(stderr, "\t--format [bps|ips], Format of a created patch, BPS by default. IPS patches only\n");
+    fprintf(stderr, "\t                 change bytes in place, the target can't be smaller than the source\n\n");
+    fprintf(stderr, "rombp compose folds the patches, applied in order to the input ROM file, into one\n");
+    fprintf(stderr, "BPS patch for it, written to the output file\n");
+    fprintf(stderr, "rombp create writes a BPS or IPS patch that makes the TARGET ROM file from the SOURCE one\n\n");
     fprintf(stderr, "Running rombp with no option arguments launches the SDL UI\n");
 }
 
+enum {
+    OPT_IN_PLACE = 256,
+    OPT_IO = 257,
+    OPT_VALIDATE = 258,
+    OPT_INFO = 259,
+    OPT_WINDOW = 260,
+    OPT_MAP_LIMIT = 261,
+    OPT_BATCH = 262,
+    OPT_MANIFEST = 263,
+    OPT_JOBS = 264,
+    OPT_MEMORY = 265,
+    OPT_METHOD = 266,
+    OPT_FORMAT = 267,
+};
+
+static const struct option LONG_OPTIONS[] = {
+    { "in-place", no_argument, NULL, OPT_IN_PLACE },
+    { "io", required_argument, NULL, OPT_IO },
+    { "journal", required_argument, NULL, 'j' },
+    { "rollback", required_argument, NULL, 'r' },
+    { "validate", no_argument, NULL, OPT_VALIDATE },
+    { "info", no_argument, NULL, OPT_INFO },
+    { "window", required_argument, NULL, OPT_WINDOW },
+    { "map-limit", required_argument, NULL, OPT_MAP_LIMIT },
+    { "batch", required_argument, NULL, OPT_BATCH },
+    { "manifest", required_argument, NULL, OPT_MANIFEST },
+    { "jobs", required_argument, NULL, OPT_JOBS },
+    { "memory", required_argument, NULL, OPT_MEMORY },
+    { "method", required_argument, NULL, OPT_METHOD },
+    { "format", required_argument, NULL, OPT_FORMAT },
+    { NULL, 0, NULL, 0 },
+};
+
+// Parse a size like 512, 64K, 16M or 1G. Returns -1 on garbage.
+static int parse_size(const char* arg, size_t* size) {
+    char* end;
+    errno = 0;
+    unsigned long long value = strtoull(arg, &end, 10);
+    if (errno != 0 || end == arg) {
+        return -1;
+    }
+    switch (*end) {
+        case 'G': value <<= 10; // fall through
+        case 'M': value <<= 10; // fall through
+        case 'K': value <<= 10; end++; break;
+        default: break;
+    }
+    if (*end != '\0' || value > SIZE_MAX / 2) {
+        return -1;
+    }
+    *size = value;
+    return 0;
+}
+
 static int parse_command_line(int argc, char** argv, rombp_patch_command* command) {
     int c;
 
-    while ((c = getopt(argc, argv, "i:p:o:")) != -1) {
+    while ((c = getopt_long(argc, argv, "i:p:o:j:r:", LONG_OPTIONS, NULL)) != -1) {
         switch (c) {
+            case OPT_IN_PLACE:
+                command->in_place = 1;
+                break;
+            case OPT_IO:
+                command->io_backend = rombp_io_backend_from_name(optarg);
+                if (command->io_backend == -1) {
+                    rombp_log_err("Unknown I/O backend: %s\n", optarg);
+                    display_help();
+                    return -1;
+                }
+                break;
+            case OPT_VALIDATE:
+                command->validate = 1;
+                break;
+            case OPT_INFO:
+                command->validate = 1;
+                command->info = 1;
+                break;
+            case OPT_WINDOW:
+                if (parse_size(optarg, &command->stream_window) != 0 || command->stream_window == 0) {
+                    rombp_log_err("Invalid output window size: %s\n", optarg);
+                    display_help();
+                    return -1;
+                }
+                break;
+            case OPT_MAP_LIMIT:
+                if (parse_size(optarg, &command->map_limit) != 0 || command->map_limit == 0) {
+                    rombp_log_err("Invalid map limit: %s\n", optarg);
+                    display_help();
+                    return -1;
+                }
+                break;
+            case OPT_BATCH:
+                command->batch_pattern = optarg;
+                break;
+            case OPT_MANIFEST:
+                command->manifest_file = optarg;
+                break;
+            case OPT_JOBS:
+                command->jobs = atoi(optarg);
+                if (command->jobs <= 0) {
+                    rombp_log_err("Invalid number of jobs: %s\n", optarg);
+                    display_help();
+                    return -1;
+                }
+                break;
+            case OPT_MEMORY:
+                if (parse_size(optarg, &command->memory_limit) != 0 || command->memory_limit == 0) {
+                    rombp_log_err("Invalid memory limit: %s\n", optarg);
+                    display_help();
+                    return -1;
+                }
+                break;
+            case OPT_METHOD:
+                command->create_method = bps_create_method_from_name(optarg);
+                if (command->create_method == -1) {
+                    rombp_log_err("Unknown patch creation method: %s\n", optarg);
+                    display_help();
+                    return -1;
+                }
+                break;
+            case OPT_FORMAT:
+                command->create_format = patch_type_from_name(optarg);
+                if (command->create_format == PATCH_TYPE_UNKNOWN) {
+                    rombp_log_err("Unknown patch format: %s\n", optarg);
+                    display_help();
+                    return -1;
+                }
+                break;
+            case 'j':
+                command->journal_file = optarg;
+                break;
+            case 'r':
+                command->rollback_file = optarg;
+                break;
             case 'i':
                 command->input_file = optarg;
                 break;
             case 'p':
-                command->ips_file = optarg;
+                if (command->ips_file == NULL) {
+                    command->ips_file = optarg;
+                    break;
+                }
+                if (command->stack_files == NULL) {
+                    command->stack_files = malloc(argc * sizeof(char*));
+                    if (command->stack_files == NULL) {
+                        rombp_log_err("Failed to allocate stacked patch list\n");
+                        return -1;
+                    }
+                }
+                command->stack_files[command->stack_count++] = optarg;
                 break;
             case 'o':
                 command->output_file = optarg;
@@ -167,6 +671,105 @@ static int parse_command_line(int argc, char** argv, rombp_patch_command* comman
     rombp_log_info("rombp arguments. input: %s, patch: %s, output: %s\n",
                    command->input_file, command->ips_file, command->output_file);
 
+    if (command->mode == ROMBP_MODE_CREATE) {
+        if (argc - optind != 2 || command->input_file != NULL || command->ips_file != NULL ||
+            command->validate || command->in_place || command->journal_file != NULL ||
+            command->rollback_file != NULL || command->batch_pattern != NULL || command->manifest_file != NULL) {
+            rombp_log_err("Creating a patch only takes the source and target files, and an output file\n");
+            display_help();
+            return -1;
+        }
+        if (command->create_format == PATCH_TYPE_IPS && command->create_method != BPS_CREATE_AUTO) {
+            rombp_log_err("The creation method only applies to BPS patches\n");
+            display_help();
+            return -1;
+        }
+        command->input_file = argv[optind];
+        command->target_file = argv[optind + 1];
+        if (command->output_file == NULL) {
+            rombp_log_err("An output file is required\n");
+            display_help();
+            return -1;
+        }
+        if (strcmp(command->input_file, STDIO_FILE_NAME) == 0 ||
+            strcmp(command->target_file, STDIO_FILE_NAME) == 0 ||
+            strcmp(command->output_file, STDIO_FILE_NAME) == 0) {
+            rombp_log_err("Patches can't be created from stdin or to stdout\n");
+            display_help();
+            return -1;
+        }
+        return 0;
+    }
+    if (command->mode == ROMBP_MODE_COMPOSE) {
+        if (command->validate || command->in_place || command->journal_file != NULL ||
+            command->rollback_file != NULL || command->batch_pattern != NULL || command->manifest_file != NULL) {
+            rombp_log_err("Composing only takes an input file, patch files and an output file\n");
+            display_help();
+            return -1;
+        }
+        if (command->input_file == NULL || command->ips_file == NULL || command->output_file == NULL) {
+            rombp_log_err("An input file, a patch file and an output file are required\n");
+            display_help();
+            return -1;
+        }
+        int stdio = strcmp(command->input_file, STDIO_FILE_NAME) == 0 ||
+                    strcmp(command->ips_file, STDIO_FILE_NAME) == 0 ||
+                    strcmp(command->output_file, STDIO_FILE_NAME) == 0;
+        for (int i = 0; i < command->stack_count; i++) {
+            stdio |= strcmp(command->stack_files[i], STDIO_FILE_NAME) == 0;
+        }
+        if (stdio) {
+            rombp_log_err("Patches can't be composed from stdin or to stdout\n");
+            display_help();
+            return -1;
+        }
+        return 0;
+    }
+    if (command->stack_count > 0 && (command->validate || command->in_place || command->rollback_file != NULL)) {
+        rombp_log_err("Several patches can only be stacked into a new output file\n");
+        display_help();
+        return -1;
+    }
+    if (command->validate) {
+        if (command->ips_file == NULL) {
+            rombp_log_err("A patch file is required\n");
+            display_help();
+            return -1;
+        }
+        return 0;
+    }
+    if (command->batch_pattern != NULL || command->manifest_file != NULL) {
+        if (command->input_file != NULL || command->journal_file != NULL || command->rollback_file != NULL) {
+            rombp_log_err("Batch mode takes its input files from --batch or --manifest, without journals\n");
+            display_help();
+            return -1;
+        }
+        if (command->ips_file == NULL || (command->output_file == NULL && !command->in_place)) {
+            rombp_log_err("A patch file and an output name template (or --in-place) are required\n");
+            display_help();
+            return -1;
+        }
+        if (strcmp(command->ips_file, STDIO_FILE_NAME) == 0 ||
+            (command->output_file != NULL && strcmp(command->output_file, STDIO_FILE_NAME) == 0)) {
+            rombp_log_err("Batch mode can't patch from stdin or to stdout\n");
+            display_help();
+            return -1;
+        }
+        return 0;
+    }
+    if (command->input_file == NULL) {
+        rombp_log_err("An input file is required\n");
+        display_help();
+        return -1;
+    }
+    if (command->rollback_file == NULL) {
+        if (command->ips_file == NULL || (command->output_file == NULL && !command->in_place)) {
+            rombp_log_err("A patch file and an output file (or --in-place) are required\n");
+            display_help();
+            return -1;
+        }
+    }
+
     return 0;
 }
 
@@ -202,65 +805,256 @@ static void rombp_read_patch_status(rombp_patch_status* shared, rombp_patch_stat
     }
 }
 
+// Apply every hunk of a started patch, and finish it.
+static rombp_patch_err run_patch(rombp_patch_type patch_type, rombp_patch_context* patch_ctx,
+                                 rombp_patch_status* local_status, rombp_patch_status* status) {
+    local_status->iter_status = HUNK_NEXT;
+
+    while (1) {
+        switch (local_status->iter_status) {
+            case HUNK_NEXT: {
+                local_status->iter_status = next_hunk(patch_type, patch_ctx);
+                if (local_status->iter_status == HUNK_NEXT) {
+                    local_status->hunk_count++;
+                    rombp_log_info("Got next hunk, hunk count: %d\n", local_status->hunk_count);
+                }
+                
+                rombp_update_patch_status(status, local_status);
+                break;
+            }
+            case HUNK_DONE:
+                return end_patch(patch_type, patch_ctx);
+            case HUNK_ERR_IO:
+                rombp_log_err("I/O error during hunk iteration\n");
+                return PATCH_ERR_IO;
+            case HUNK_NONE:
+                break;
+        }
+    }
+}
+
+// Stacked patches: the first patch is applied to the input, and every other
+// patch to the result of the one before. Intermediate images live in memory,
+// or in mapped scratch files when the map limit is set, so big images don't
+// have to fit in RAM. IPS patches after the first are applied in place on
+// the image, and only the last patch writes the output file.
+
+// An intermediate image. file is the scratch file, or NULL in memory.
+typedef struct rombp_stack_image {
+    rombp_io io;
+    FILE* file;
+} rombp_stack_image;
+
+static int stack_image_open(rombp_stack_image* image, rombp_patch_command* command) {
+    image->file = NULL;
+    if (command->map_limit == 0) {
+        return rombp_io_open_mem_growable(&image->io, 0);
+    }
+
+    image->file = tmpfile();
+    if (image->file == NULL) {
+        rombp_log_err("Failed to create scratch file, errno: %d\n", errno);
+        return -1;
+    }
+    return rombp_io_open_mmap(&image->io, fileno(image->file), 1, patch_map_limit(command));
+}
+
+static void stack_image_close(rombp_stack_image* image) {
+    close_io(&image->io);
+    if (image->file != NULL) {
+        fclose(image->file);
+        image->file = NULL;
+    }
+}
+
+// Apply the stage'th patch, from the current image (or the input file for
+// the first stage) to the next image (or the output file for the last).
+static rombp_patch_err execute_stage(rombp_patch_command* command, int stage, FILE* input_file, FILE* output_file,
+                                     rombp_stack_image* images, int* current,
+                                     rombp_patch_status* local_status, rombp_patch_status* status) {
+    rombp_patch_context patch_ctx;
+    rombp_patch_io pio = { .input.ops = NULL, .output.ops = NULL, .patch.ops = NULL };
+    rombp_patch_command stage_command = *command;
+    rombp_patch_err err;
+    int next = -1;
+    int last = stage == command->stack_count;
+
+    stage_command.ips_file = stage == 0 ? command->ips_file : command->stack_files[stage - 1];
+    rombp_log_info("Stacked patch %d of %d: %s\n", stage + 1, command->stack_count + 1, stage_command.ips_file);
+
+    FILE* patch_file = open_patch_file(stage_command.ips_file);
+    if (patch_file == NULL) {
+        rombp_log_err("Failed to open patch file: %s, errno: %d\n", stage_command.ips_file, errno);
+        return PATCH_ERR_IO;
+    }
+    if (rombp_io_open_file(&pio.patch, patch_file, patch_io_backend(command), 0, patch_map_limit(command)) != 0) {
+        err = PATCH_ERR_IO;
+        goto done;
+    }
+    rombp_patch_type patch_type = detect_patch_type(&pio.patch);
+    if (patch_type == PATCH_TYPE_UNKNOWN) {
+        err = PATCH_UNKNOWN_TYPE;
+        goto done;
+    }
+
+    rombp_io* input = &images[*current].io;
+    rombp_io* output = NULL;
+    if (stage == 0 && rombp_io_open_file(&pio.input, input_file, patch_io_backend(command), 0, patch_map_limit(command)) != 0) {
+        err = PATCH_ERR_IO;
+        goto done;
+    }
+    if (stage == 0) {
+        input = &pio.input;
+    }
+    if (last) {
+        if (rombp_io_open_file(&pio.output, output_file, patch_io_backend(command), 1, patch_map_limit(command)) != 0) {
+            err = PATCH_ERR_IO;
+            goto done;
+        }
+        output = &pio.output;
+    } else if (patch_type == PATCH_TYPE_IPS && stage > 0) {
+        stage_command.in_place = 1;
+        output = input;
+    } else {
+        next = *current == 0 ? 1 : 0;
+        if (stack_image_open(&images[next], command) != 0) {
+            err = PATCH_ERR_IO;
+            goto done;
+        }
+        output = &images[next].io;
+    }
+
+    int rc = start_patch(patch_type, &patch_ctx, &stage_command, input, output, &pio.patch, NULL);
+    if (rc < 0) {
+        err = rc == PATCH_INVALID_PATCH_CHECKSUM ? rc : PATCH_FAILED_TO_START;
+        goto done;
+    }
+    err = run_patch(patch_type, &patch_ctx, local_status, status);
+    cleanup_patch(patch_type, &patch_ctx);
+
+done:
+    if (next != -1) {
+        if (err == PATCH_OK) {
+            if (stage > 0) {
+                stack_image_close(&images[*current]);
+            }
+            *current = next;
+        } else {
+            stack_image_close(&images[next]);
+        }
+    }
+    close_io(&pio.input);
+    close_io(&pio.output);
+    close_io(&pio.patch);
+    if (patch_file != stdin) {
+        fclose(patch_file);
+    }
+    return err;
+}
+
+static int execute_stack(rombp_patch_command* command, rombp_patch_status* status) {
+    rombp_patch_status local_status;
+    rombp_stack_image images[2] = { { .io.ops = NULL, .file = NULL }, { .io.ops = NULL, .file = NULL } };
+    int current = 0;
+
+    FILE* input_file = NULL;
+    FILE* output_file = NULL;
+    FILE* patch_file = NULL;
+
+    patch_status_init(&local_status);
+
+    local_status.err = open_patch_files(&input_file, &output_file, &patch_file, command);
+    // Each stage opens its own patch file.
+    if (patch_file != NULL && patch_file != stdin) {
+        fclose(patch_file);
+    }
+    for (int stage = 0; stage <= command->stack_count && local_status.err == PATCH_OK; stage++) {
+        local_status.err = execute_stage(command, stage, input_file, output_file, images, &current,
+                                         &local_status, status);
+        if (local_status.err != PATCH_OK) {
+            rombp_log_err("Stacked patch %d failed: %d\n", stage + 1, local_status.err);
+        }
+    }
+
+    local_status.iter_status = HUNK_DONE;
+    local_status.is_done = 1;
+    stack_image_close(&images[0]);
+    stack_image_close(&images[1]);
+    close_files(input_file, output_file, NULL);
+    rombp_update_patch_status(status, &local_status);
+    rombp_patch_err err = local_status.err;
+    patch_status_destroy(&local_status);
+    return err;
+}
+
 static int execute_patch(rombp_patch_command* command, rombp_patch_status* status) {
     int rc;
     rombp_patch_type patch_type = PATCH_TYPE_UNKNOWN;
     rombp_patch_context patch_ctx;
+    rombp_patch_io pio = { .input.ops = NULL, .output.ops = NULL, .patch.ops = NULL };
     rombp_patch_status local_status;
 
-    FILE* input_file;
-    FILE* output_file;
-    FILE* patch_file;
+    FILE* input_file = NULL;
+    FILE* output_file = NULL;
+    FILE* patch_file = NULL;
+    FILE* journal_file = NULL;
+
+    if (command->stack_count > 0) {
+        return execute_stack(command, status);
+    }
 
     patch_status_init(&local_status);
 
+    // The UI rolls back on the patch thread too.
+    if (command->rollback_file != NULL) {
+        local_status.err = execute_rollback(command);
+        local_status.iter_status = HUNK_DONE;
+        goto done;
+    }
+
     local_status.err = open_patch_files(&input_file, &output_file, &patch_file, command);
     if (local_status.err == PATCH_ERR_IO) {
         local_status.iter_status = HUNK_DONE;
         goto done;
     }
-    patch_type = detect_patch_type(patch_file);
+    rc = rombp_io_open_file(&pio.patch, patch_file, patch_io_backend(command), 0, patch_map_limit(command));
+    if (rc != 0) {
+        local_status.iter_status = HUNK_DONE;
+        local_status.err = PATCH_ERR_IO;
+        goto done;
+    }
+    patch_type = detect_patch_type(&pio.patch);
     if (patch_type == PATCH_TYPE_UNKNOWN) {
         local_status.iter_status = HUNK_DONE;
         local_status.err = PATCH_UNKNOWN_TYPE;
         goto done;
     }
-    rc = start_patch(patch_type, &patch_ctx, input_file, patch_file, output_file);
-    if (rc < 0) {
+    rc = open_patch_io(&pio, command, input_file, output_file);
+    if (rc != 0) {
         local_status.iter_status = HUNK_DONE;
-        local_status.err = PATCH_FAILED_TO_START;
+        local_status.err = PATCH_ERR_IO;
+        patch_type = PATCH_TYPE_UNKNOWN;
         goto done;
     }
-    local_status.iter_status = HUNK_NEXT;
-
-    while (1) {
-        switch (local_status.iter_status) {
-            case HUNK_NEXT: {
-                local_status.iter_status = next_hunk(patch_type, &patch_ctx, input_file, output_file, patch_file);
-                if (local_status.iter_status == HUNK_NEXT) {
-                    local_status.hunk_count++;
-                    rombp_log_info("Got next hunk, hunk count: %d\n", local_status.hunk_count);
-                }
-                
-                rombp_update_patch_status(status, &local_status);
-                break;
-            }
-            case HUNK_DONE: {
-                local_status.err = end_patch(patch_type, &patch_ctx, patch_file);
-                goto done;
-            }
-            case HUNK_ERR_IO:
-                local_status.err = PATCH_ERR_IO;
-                rombp_log_err("I/O error during hunk iteration\n");
-                goto done;
-            case HUNK_NONE:
-                break;
-        }
+    rc = start_patch(patch_type, &patch_ctx, command, &pio.input, &pio.output, &pio.patch, &journal_file);
+    if (rc < 0) {
+        local_status.iter_status = HUNK_DONE;
+        local_status.err = rc == PATCH_INVALID_PATCH_CHECKSUM ? rc : PATCH_FAILED_TO_START;
+        patch_type = PATCH_TYPE_UNKNOWN;
+        goto done;
     }
+    local_status.err = run_patch(patch_type, &patch_ctx, &local_status, status);
 
 done:
     local_status.is_done = 1;
+    cleanup_patch(patch_type, &patch_ctx);
+    close_io(&pio.input);
+    close_io(&pio.output);
+    close_io(&pio.patch);
     close_files(input_file, output_file, patch_file);
+    if (journal_file != NULL) {
+        fclose(journal_file);
+    }
     rombp_update_patch_status(status, &local_status);
     rombp_patch_err err = local_status.err;
     patch_status_destroy(&local_status);
@@ -355,6 +1149,10 @@ static int ui_loop(pthread_t* patch_thread, rombp_patch_command* command) {
                     if (local_status.is_done) {
                         switch (local_status.err) {
                             case PATCH_OK:
+                                if (command->rollback_file != NULL) {
+                                    ui_status_bar_reset_text(&ui, &ui.bottom_bar, ROLLBACK_SUCCESS_MESSAGE);
+                                    break;
+                                }
                                 sprintf(tmp_buf, PATCH_SUCCESS_MESSAGE, local_status.hunk_count);
                                 ui_status_bar_reset_text(&ui, &ui.bottom_bar, tmp_buf);
                                 rombp_log_info("Done patching file, hunk count: %d\n", thread_args.status.hunk_count);
@@ -367,6 +1165,14 @@ static int ui_loop(pthread_t* patch_thread, rombp_patch_command* command) {
                                 ui_status_bar_reset_text(&ui, &ui.bottom_bar, PATCH_FAIL_INVALID_OUTPUT_CHECKSUM_MESSAGE);
                                 rombp_log_err("Invalid output checksum\n");
                                 break;
+                            case PATCH_INVALID_INPUT_CHECKSUM:
+                                ui_status_bar_reset_text(&ui, &ui.bottom_bar, PATCH_FAIL_INVALID_INPUT_CHECKSUM_MESSAGE);
+                                rombp_log_err("Invalid input checksum\n");
+                                break;
+                            case PATCH_INVALID_PATCH_CHECKSUM:
+                                ui_status_bar_reset_text(&ui, &ui.bottom_bar, PATCH_FAIL_INVALID_PATCH_CHECKSUM_MESSAGE);
+                                rombp_log_err("Invalid patch checksum\n");
+                                break;
                             case PATCH_ERR_IO:
                                 ui_status_bar_reset_text(&ui, &ui.bottom_bar, PATCH_FAIL_ERR_IO);
                                 rombp_log_err("Failed to open files for patching: %d\n", thread_args.status.err);
@@ -421,14 +1227,600 @@ out:
     return rc;
 }
 
+// Batch mode: the same patch applied to many input files, by a fixed pool
+// of workers that each run whole jobs through execute_patch().
+
+typedef struct rombp_batch_job {
+    char* input_file;
+    char* output_file;
+    rombp_patch_err err;
+    uint64_t output_size;
+    double seconds;
+} rombp_batch_job;
+
+typedef struct rombp_batch {
+    rombp_patch_command* command;
+    rombp_batch_job* jobs;
+    size_t count;
+    size_t capacity;
+    // Next job to hand out, guarded by lock
+    size_t next;
+    // Threads each job patches on, so the jobs together use about one
+    // thread per CPU
+    int job_threads;
+    pthread_mutex_t lock;
+} rombp_batch;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char* patch_err_message(rombp_patch_err err) {
+    switch (err) {
+        case PATCH_OK: return "OK";
+        case PATCH_INVALID_INPUT_SIZE: return "Invalid input size";
+        case PATCH_INVALID_OUTPUT_SIZE: return "Invalid output size";
+        case PATCH_INVALID_OUTPUT_CHECKSUM: return "Invalid output checksum";
+        case PATCH_INVALID_INPUT_CHECKSUM: return "Invalid input checksum";
+        case PATCH_INVALID_PATCH_CHECKSUM: return "Invalid patch checksum";
+        case PATCH_ERR_IO: return "Failed to open files for patching";
+        case PATCH_UNKNOWN_TYPE: return "Bad patch file type";
+        case PATCH_FAILED_TO_START: return "Failed to start patching";
+        default: return "Unknown end error";
+    }
+}
+
+static int batch_add(rombp_batch* batch, const char* input_file) {
+    if (batch->count == batch->capacity) {
+        size_t capacity = MAX(batch->capacity * 2, 64);
+        rombp_batch_job* jobs = realloc(batch->jobs, capacity * sizeof(rombp_batch_job));
+        if (jobs == NULL) {
+            rombp_log_err("Failed to grow the batch to %ld jobs\n", (long)capacity);
+            return -1;
+        }
+        batch->jobs = jobs;
+        batch->capacity = capacity;
+    }
+
+    rombp_batch_job* job = &batch->jobs[batch->count];
+    job->input_file = strdup(input_file);
+    job->output_file = NULL;
+    job->err = PATCH_OK;
+    job->output_size = 0;
+    job->seconds = 0;
+    if (job->input_file == NULL) {
+        rombp_log_err("Failed to allocate batch job\n");
+        return -1;
+    }
+    batch->count++;
+
+    return 0;
+}
+
+static int batch_add_glob(rombp_batch* batch, const char* pattern) {
+    glob_t matches;
+    int rc = glob(pattern, 0, NULL, &matches);
+    if (rc == GLOB_NOMATCH) {
+        rombp_log_err("No input files match: %s\n", pattern);
+        return -1;
+    }
+    if (rc != 0) {
+        rombp_log_err("Failed to expand input files: %s, error: %d\n", pattern, rc);
+        return -1;
+    }
+
+    rc = 0;
+    for (size_t i = 0; i < matches.gl_pathc && rc == 0; i++) {
+        rc = batch_add(batch, matches.gl_pathv[i]);
+    }
+    globfree(&matches);
+
+    return rc;
+}
+
+// One input file per line. Blank lines and lines starting with # are skipped.
+static int batch_add_manifest(rombp_batch* batch, const char* manifest_file) {
+    FILE* manifest = fopen(manifest_file, "r");
+    if (manifest == NULL) {
+        rombp_log_err("Failed to open manifest: %s, errno: %d\n", manifest_file, errno);
+        return -1;
+    }
+
+    int rc = 0;
+    char* line = NULL;
+    size_t line_capacity = 0;
+    ssize_t len;
+    while (rc == 0 && (len = getline(&line, &line_capacity, manifest)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len > 0 && line[0] != '#') {
+            rc = batch_add(batch, line);
+        }
+    }
+    if (rc == 0 && ferror(manifest)) {
+        rombp_log_err("Failed to read manifest: %s, errno: %d\n", manifest_file, errno);
+        rc = -1;
+    }
+    free(line);
+    fclose(manifest);
+
+    return rc;
+}
+
+// Expand the output name template for an input file. {dir} is the input's
+// directory, {name} its file name without the extension, and {ext} the
+// extension, with its dot. Returns NULL on unknown placeholders.
+static char* batch_output_name(const char* template, const char* input_file) {
+    const char* slash = strrchr(input_file, '/');
+    const char* name = slash != NULL ? slash + 1 : input_file;
+    const char* dot = strrchr(name, '.');
+    if (dot == NULL || dot == name) {
+        dot = name + strlen(name);
+    }
+    const char* dir = ".";
+    size_t dir_len = 1;
+    if (slash != NULL) {
+        dir = input_file;
+        // Keep the slash of the root directory.
+        dir_len = MAX(slash - input_file, 1);
+    }
+
+    // No placeholder expands to more than the input file name.
+    size_t capacity = strlen(template) * (strlen(input_file) + 1) + 2;
+    char* output = malloc(capacity);
+    if (output == NULL) {
+        return NULL;
+    }
+
+    char* out = output;
+    for (const char* t = template; *t != '\0'; t++) {
+        const char* part = t;
+        size_t part_len = 1;
+        if (*t == '{') {
+            const char* end = strchr(t, '}');
+            size_t key_len = end != NULL ? (size_t)(end - t + 1) : 0;
+            if (key_len == 5 && strncmp(t, "{dir}", 5) == 0) {
+                part = dir;
+                part_len = dir_len;
+            } else if (key_len == 6 && strncmp(t, "{name}", 6) == 0) {
+                part = name;
+                part_len = dot - name;
+            } else if (key_len == 5 && strncmp(t, "{ext}", 5) == 0) {
+                part = dot;
+                part_len = strlen(dot);
+            } else {
+                rombp_log_err("Unknown placeholder in output name template: %s\n", template);
+                free(output);
+                return NULL;
+            }
+            t = end;
+        }
+        memcpy(out, part, part_len);
+        out += part_len;
+    }
+    *out = '\0';
+
+    return output;
+}
+
+// Name every job's output, and make sure no two jobs write the same file,
+// or over their own input.
+static int batch_name_outputs(rombp_batch* batch) {
+    rombp_patch_command* command = batch->command;
+    if (command->in_place) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < batch->count; i++) {
+        rombp_batch_job* job = &batch->jobs[i];
+        job->output_file = batch_output_name(command->output_file, job->input_file);
+        if (job->output_file == NULL) {
+            return -1;
+        }
+        if (strcmp(job->output_file, job->input_file) == 0) {
+            rombp_log_err("Output name template would overwrite input file: %s\n", job->input_file);
+            return -1;
+        }
+        for (size_t j = 0; j < i; j++) {
+            if (strcmp(job->output_file, batch->jobs[j].output_file) == 0) {
+                rombp_log_err("Input files %s and %s would both be patched to: %s\n",
+                              batch->jobs[j].input_file, job->input_file, job->output_file);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void batch_run_job(rombp_batch* batch, size_t i) {
+    rombp_batch_job* job = &batch->jobs[i];
+    rombp_patch_command command = *batch->command;
+    command.threads = batch->job_threads;
+    command.input_file = job->input_file;
+    command.output_file = job->output_file;
+
+    double start = now_seconds();
+    job->err = execute_patch(&command, NULL);
+    job->seconds = now_seconds() - start;
+
+    struct stat st;
+    const char* output_file = command.in_place ? job->input_file : job->output_file;
+    if (job->err == PATCH_OK && stat(output_file, &st) == 0) {
+        job->output_size = st.st_size;
+    }
+
+    if (job->err == PATCH_OK) {
+        printf("[%lu/%lu] OK %s -> %s, %.1f MB in %.2f s\n", (unsigned long)i + 1, (unsigned long)batch->count,
+               job->input_file, output_file, job->output_size / 1e6, job->seconds);
+    } else {
+        printf("[%lu/%lu] FAILED %s: %s (%d)\n", (unsigned long)i + 1, (unsigned long)batch->count,
+               job->input_file, patch_err_message(job->err), job->err);
+        // Don't leave a broken ROM behind, named like a good one
+        if (!command.in_place && unlink(job->output_file) != 0 && errno != ENOENT) {
+            rombp_log_err("Failed to remove output file: %s, errno: %d\n", job->output_file, errno);
+        }
+    }
+    fflush(stdout);
+}
+
+static void* batch_worker(void* arg) {
+    rombp_batch* batch = arg;
+
+    while (1) {
+        pthread_mutex_lock(&batch->lock);
+        size_t i = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        if (i >= batch->count) {
+            return NULL;
+        }
+        batch_run_job(batch, i);
+    }
+}
+
+static int execute_batch(rombp_patch_command* command) {
+    int rc = -1;
+    rombp_batch batch = { .command = command, .jobs = NULL, .count = 0, .capacity = 0, .next = 0 };
+    pthread_t* workers = NULL;
+    int started = 0;
+
+    if (command->batch_pattern != NULL && batch_add_glob(&batch, command->batch_pattern) != 0) {
+        goto out;
+    }
+    if (command->manifest_file != NULL && batch_add_manifest(&batch, command->manifest_file) != 0) {
+        goto out;
+    }
+    if (batch.count == 0) {
+        rombp_log_err("No input files to patch\n");
+        goto out;
+    }
+    if (batch_name_outputs(&batch) != 0) {
+        goto out;
+    }
+
+    int count = command->jobs > 0 ? command->jobs : patch_worker_count();
+    count = MIN((size_t)count, batch.count);
+    batch.job_threads = MAX(patch_worker_count() / count, 1);
+    workers = malloc(count * sizeof(pthread_t));
+    if (workers == NULL || pthread_mutex_init(&batch.lock, NULL) != 0) {
+        rombp_log_err("Failed to set up %d batch workers\n", count);
+        goto out;
+    }
+
+    rombp_log_info("Batch patching %ld files with %d workers, %d threads each\n", (long)batch.count, count,
+                   batch.job_threads);
+    double start = now_seconds();
+    for (; started < count; started++) {
+        int err = pthread_create(&workers[started], NULL, batch_worker, &batch);
+        if (err != 0) {
+            rombp_log_err("Failed to start batch worker: %d\n", err);
+            break;
+        }
+    }
+    // Without any worker, the jobs are run right here.
+    if (started == 0) {
+        batch_worker(&batch);
+    }
+    for (int w = 0; w < started; w++) {
+        pthread_join(workers[w], NULL);
+    }
+    double elapsed = now_seconds() - start;
+    pthread_mutex_destroy(&batch.lock);
+
+    size_t failed = 0;
+    uint64_t total_size = 0;
+    for (size_t i = 0; i < batch.count; i++) {
+        if (batch.jobs[i].err != PATCH_OK) {
+            failed++;
+        }
+        total_size += batch.jobs[i].output_size;
+    }
+    printf("Patched %lu of %lu files, %lu failed, %.1f MB in %.2f s, %.1f MB/s\n",
+           (unsigned long)(batch.count - failed), (unsigned long)batch.count, (unsigned long)failed,
+           total_size / 1e6, elapsed, elapsed > 0 ? total_size / elapsed / 1e6 : 0);
+    rc = failed == 0 ? 0 : -1;
+
+out:
+    for (size_t i = 0; i < batch.count; i++) {
+        free(batch.jobs[i].input_file);
+        free(batch.jobs[i].output_file);
+    }
+    free(batch.jobs);
+    free(workers);
+    return rc;
+}
+
+// A file opened for reading. Loaded files are whole in memory: mapped, or
+// read into buf when their backend can't map them.
+typedef struct rombp_loaded_file {
+    FILE* file;
+    rombp_io io;
+    const uint8_t* data;
+    uint8_t* buf;
+    size_t size;
+} rombp_loaded_file;
+
+// Open a file to read through an I/O backend, without loading it.
+static int open_file(rombp_loaded_file* loaded, const char* path, rombp_io_backend backend, uint64_t map_limit) {
+    loaded->io.ops = NULL;
+    loaded->buf = NULL;
+    loaded->file = fopen(path, "r");
+    if (loaded->file == NULL) {
+        rombp_log_err("Failed to open file: %s, errno: %d\n", path, errno);
+        return -1;
+    }
+    return rombp_io_open_file(&loaded->io, loaded->file, backend, 0, map_limit);
+}
+
+static int load_file(rombp_loaded_file* loaded, const char* path, rombp_patch_command* command) {
+    if (open_file(loaded, path, patch_io_backend(command), 0) != 0) {
+        return -1;
+    }
+
+    int64_t size = rombp_io_size(&loaded->io);
+    if (size < 0 || (uint64_t)size > SIZE_MAX) {
+        rombp_log_err("Failed to get the size of file: %s\n", path);
+        return -1;
+    }
+    loaded->size = size;
+    loaded->data = rombp_io_map(&loaded->io, 0, size);
+    if (loaded->data == NULL) {
+        loaded->buf = malloc(MAX(loaded->size, 1));
+        if (loaded->buf == NULL || rombp_io_read_full(&loaded->io, loaded->buf, loaded->size, 0) != 0) {
+            rombp_log_err("Failed to read file: %s\n", path);
+            return -1;
+        }
+        loaded->data = loaded->buf;
+    }
+
+    return 0;
+}
+
+static void unload_file(rombp_loaded_file* loaded) {
+    close_io(&loaded->io);
+    free(loaded->buf);
+    if (loaded->file != NULL) {
+        fclose(loaded->file);
+    }
+}
+
+static int execute_compose(rombp_patch_command* command) {
+    int patch_count = command->stack_count + 1;
+    rombp_loaded_file* files = calloc(patch_count + 1, sizeof(rombp_loaded_file));
+    const uint8_t** patches = calloc(patch_count, sizeof(uint8_t*));
+    size_t* patch_sizes = calloc(patch_count, sizeof(size_t));
+    uint8_t* composed = NULL;
+    size_t composed_size = 0;
+    rombp_patch_err err = PATCH_ERR_IO;
+    int loaded = 0;
+
+    if (files == NULL || patches == NULL || patch_sizes == NULL) {
+        rombp_log_err("Failed to allocate %d patches to compose\n", patch_count);
+        goto out;
+    }
+    // The input file first, then the patches in order
+    for (; loaded <= patch_count; loaded++) {
+        const char* path = loaded == 0 ? command->input_file :
+                           loaded == 1 ? command->ips_file : command->stack_files[loaded - 2];
+        if (load_file(&files[loaded], path, command) != 0) {
+            loaded++;
+            goto out;
+        }
+        if (loaded > 0) {
+            patches[loaded - 1] = files[loaded].data;
+            patch_sizes[loaded - 1] = files[loaded].size;
+        }
+    }
+
+    err = rombp_compose(files[0].data, files[0].size, patches, patch_sizes, patch_count, &composed, &composed_size);
+    if (err != PATCH_OK) {
+        rombp_log_err("Failed to compose %d patches: %s (%d)\n", patch_count, patch_err_message(err), err);
+        goto out;
+    }
+
+    FILE* output_file = fopen(command->output_file, "w");
+    if (output_file == NULL) {
+        rombp_log_err("Failed to open output file: %s, errno: %d\n", command->output_file, errno);
+        err = PATCH_ERR_IO;
+        goto out;
+    }
+    if (fwrite(composed, 1, composed_size, output_file) != composed_size) {
+        rombp_log_err("Failed to write output file: %s, errno: %d\n", command->output_file, errno);
+        err = PATCH_ERR_IO;
+    }
+    if (fclose(output_file) != 0 && err == PATCH_OK) {
+        rombp_log_err("Failed to close output file: %s, errno: %d\n", command->output_file, errno);
+        err = PATCH_ERR_IO;
+    }
+    if (err == PATCH_OK) {
+        rombp_log_info("Composed %d patches into %s, %ld bytes\n", patch_count, command->output_file, (long)composed_size);
+    }
+
+out:
+    for (int i = 0; i < loaded; i++) {
+        unload_file(&files[i]);
+    }
+    rombp_free(composed);
+    free(patch_sizes);
+    free(patches);
+    free(files);
+    return err;
+}
+
+// Half of the RAM, or no limit if it's unknown.
+static uint64_t default_memory_limit() {
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || page_size <= 0) {
+        return 0;
+    }
+    return (uint64_t)pages * page_size / 2;
+}
+
+// The suffix array encoder unless the files are too big for it to fit in
+// memory.
+static bps_create_method create_method(rombp_patch_command* command) {
+    struct stat source_st;
+    struct stat target_st;
+
+    if (command->create_method != BPS_CREATE_AUTO) {
+        return command->create_method;
+    }
+    if (stat(command->input_file, &source_st) != 0 || stat(command->target_file, &target_st) != 0) {
+        // Loading the files reports the error.
+        return BPS_CREATE_SUFFIX;
+    }
+    uint64_t memory_limit = command->memory_limit > 0 ? command->memory_limit : default_memory_limit();
+    uint64_t memory = bps_create_memory(source_st.st_size, target_st.st_size);
+    if (memory == UINT64_MAX || (memory_limit > 0 && memory > memory_limit) ||
+        (uint64_t)source_st.st_size > SIZE_MAX || (uint64_t)target_st.st_size > SIZE_MAX) {
+        rombp_log_info("The files are too big for suffix arrays, streaming instead\n");
+        return BPS_CREATE_STREAM;
+    }
+    return BPS_CREATE_SUFFIX;
+}
+
+static int execute_create(rombp_patch_command* command) {
+    rombp_loaded_file source = { 0 };
+    rombp_loaded_file target = { 0 };
+    rombp_io output;
+    rombp_patch_err err = PATCH_ERR_IO;
+    bps_create_method method = command->create_format == PATCH_TYPE_BPS ? create_method(command) : BPS_CREATE_AUTO;
+    int loaded;
+
+    if (method == BPS_CREATE_STREAM) {
+        // Streaming reads through its own buffers, mapping the files would
+        // only grow the resident memory.
+        rombp_io_backend backend = command->io_backend != ROMBP_IO_AUTO ? command->io_backend : ROMBP_IO_FD;
+        loaded = open_file(&source, command->input_file, backend, patch_map_limit(command)) == 0 &&
+                 open_file(&target, command->target_file, backend, patch_map_limit(command)) == 0;
+    } else {
+        loaded = load_file(&source, command->input_file, command) == 0 &&
+                 load_file(&target, command->target_file, command) == 0;
+    }
+    if (!loaded) {
+        goto out;
+    }
+    FILE* output_file = fopen(command->output_file, "w");
+    if (output_file == NULL) {
+        rombp_log_err("Failed to open output file: %s, errno: %d\n", command->output_file, errno);
+        goto out;
+    }
+    rombp_io_open_fd(&output, fileno(output_file));
+
+    bps_create_options options = {
+        .memory_limit = command->memory_limit,
+        .threads = patch_worker_count(),
+    };
+    bps_create_stats stats;
+    ips_create_stats ips_stats;
+    double start = now_seconds();
+    if (command->create_format == PATCH_TYPE_IPS) {
+        err = ips_create(source.data, source.size, target.data, target.size, &output, &ips_stats);
+        stats.memory = 0;
+        stats.patch_size = ips_stats.patch_size;
+    } else if (method == BPS_CREATE_STREAM) {
+        err = bps_create_stream(&source.io, &target.io, &output, &options, &stats);
+    } else {
+        if (options.memory_limit == 0) {
+            options.memory_limit = default_memory_limit();
+        }
+        err = bps_create(source.data, source.size, target.data, target.size, &output, &options, &stats);
+    }
+    double elapsed = now_seconds() - start;
+    rombp_io_close(&output);
+    if (fclose(output_file) != 0 && err == PATCH_OK) {
+        rombp_log_err("Failed to close output file: %s, errno: %d\n", command->output_file, errno);
+        err = PATCH_ERR_IO;
+    }
+
+    if (err == PATCH_OK) {
+        // Streamed targets aren't loaded, ask the backend for their size
+        int64_t target_size = MAX(rombp_io_size(&target.io), 0);
+        // On stdout like info, so it shows up where info logging is compiled out
+        printf("Created %s, %ld bytes, in %.2f s, %.1f MB/s, memory: %ld MB\n", command->output_file,
+               (long)stats.patch_size, elapsed, target_size / MAX(elapsed, 1e-9) / 1e6, (long)(stats.memory >> 20));
+    } else {
+        rombp_log_err("Failed to create patch: %s (%d)\n", patch_err_message(err), err);
+        // Don't leave an empty or partial patch behind
+        if (unlink(command->output_file) != 0) {
+            rombp_log_err("Failed to remove output file: %s, errno: %d\n", command->output_file, errno);
+        }
+    }
+
+out:
+    unload_file(&target);
+    unload_file(&source);
+    return err;
+}
+
 static int execute_command_line(int argc, char** argv, pthread_t* patch_thread, rombp_patch_command* command) {
     int rc;
 
+    if (strcmp(argv[1], COMPOSE_COMMAND) == 0 || strcmp(argv[1], CREATE_COMMAND) == 0) {
+        command->mode = strcmp(argv[1], COMPOSE_COMMAND) == 0 ? ROMBP_MODE_COMPOSE : ROMBP_MODE_CREATE;
+        argc--;
+        argv++;
+    }
     rc = parse_command_line(argc, argv, command);
     if (rc != 0) {
         return rc;
     }
 
+    if (command->mode == ROMBP_MODE_COMPOSE) {
+        return execute_compose(command);
+    }
+    if (command->mode == ROMBP_MODE_CREATE) {
+        return execute_create(command);
+    }
+
+    if (command->validate) {
+        rc = execute_validate(command);
+        if (rc == PATCH_OK && !command->info) {
+            rombp_log_info("Patch is valid\n");
+        } else if (rc == PATCH_INVALID_PATCH_CHECKSUM) {
+            rombp_log_err("Invalid patch checksum\n");
+        } else {
+            rombp_log_err("Patch is invalid: %d\n", rc);
+        }
+        return rc;
+    }
+
+    if (command->rollback_file != NULL) {
+        rc = execute_rollback(command);
+        if (rc != PATCH_OK) {
+            rombp_log_err("Failed to roll back: %d\n", rc);
+        }
+        return rc;
+    }
+
+    if (command->batch_pattern != NULL || command->manifest_file != NULL) {
+        return execute_batch(command);
+    }
+
     rombp_patch_thread_args thread_args;
     thread_args.command = command;
     thread_args.rc = 0;
@@ -465,6 +1857,12 @@ static int execute_command_line(int argc, char** argv, pthread_t* patch_thread,
         case PATCH_INVALID_OUTPUT_CHECKSUM:
             rombp_log_err("Invalid output checksum\n");
             break;
+        case PATCH_INVALID_INPUT_CHECKSUM:
+            rombp_log_err("Invalid input checksum\n");
+            break;
+        case PATCH_INVALID_PATCH_CHECKSUM:
+            rombp_log_err("Invalid patch checksum\n");
+            break;
         case PATCH_ERR_IO:
             rombp_log_err("Failed to open files for patching: %d\n", thread_args.status.err);
             break;
@@ -488,14 +1886,35 @@ int main(int argc, char** argv) {
     rombp_patch_command command;
     pthread_t patch_thread;
 
+    command.mode = ROMBP_MODE_PATCH;
     command.input_file = NULL;
     command.ips_file = NULL;
+    command.stack_files = NULL;
+    command.stack_count = 0;
     command.output_file = NULL;
+    command.target_file = NULL;
+    command.journal_file = NULL;
+    command.rollback_file = NULL;
+    command.in_place = 0;
+    command.validate = 0;
+    command.info = 0;
+    command.stream_window = 0;
+    command.map_limit = DEFAULT_MAP_LIMIT;
+    command.batch_pattern = NULL;
+    command.manifest_file = NULL;
+    command.jobs = 0;
+    command.threads = 0;
+    command.memory_limit = 0;
+    command.create_method = BPS_CREATE_AUTO;
+    command.create_format = PATCH_TYPE_BPS;
+    command.io_backend = ROMBP_IO_AUTO;
 
     if (argc > 1) {
         // If the user passed command line arguments, assume they don't want to launch
         // the SDL UI.
-        return execute_command_line(argc, argv, &patch_thread, &command);
+        int rc = execute_command_line(argc, argv, &patch_thread, &command);
+        free(command.stack_files);
+        return rc;
     } else {
         int rc = ui_loop(&patch_thread, &command);
         if (rc != 0) {
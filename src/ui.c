@@ -30,6 +30,9 @@ static const char* STATUS_BAR_TEXT_PATCH = "Select Patch file | A=select, B=back
 
 static const char* BOTTOM_BAR_TEXT = "rombp v0.0.4";
 static const char* BOTTOM_BAR_COULD_NOT_FIND_EXTENSION = "ERR: Could find patch file extension";
+static const char* BOTTOM_BAR_MODE_IN_PLACE = "Mode: patch ROM in place (IPS), Y=undo";
+static const char* BOTTOM_BAR_MODE_NEW_FILE = "Mode: patch to new file";
+static const char* UNDO_JOURNAL_EXTENSION = ".undo";
 
 static inline int get_texture_width(SDL_Texture* texture) {
     int width;
@@ -226,6 +229,7 @@ int ui_start(rombp_ui* ui) {
     ui->current_screen = SELECT_ROM;
     ui->selected_item = 0;
     ui->selected_offset = 0;
+    ui->in_place = 0;
     ui->sdl.screen_width = SCREEN_WIDTH;
     ui->sdl.screen_height = SCREEN_HEIGHT;
     ui->sdl.scaling_factor = SCALING_FACTOR;
@@ -431,6 +435,19 @@ static int ui_handle_select(rombp_ui* ui, rombp_patch_command* command) {
             }
         } else if (command->ips_file == NULL) {
             command->ips_file = concat_path(ui->current_directory, selected_item->d_name);
+            if (ui->in_place) {
+                // Patch the ROM itself, and keep an undo journal next to it.
+                size_t journal_size = strlen(command->input_file) + strlen(UNDO_JOURNAL_EXTENSION) + 1;
+                command->output_file = strdup(command->input_file);
+                command->journal_file = malloc(journal_size);
+                if (command->output_file == NULL || command->journal_file == NULL) {
+                    rombp_log_err("Failed to alloc in place output paths\n");
+                    return -1;
+                }
+                snprintf(command->journal_file, journal_size, "%s%s", command->input_file, UNDO_JOURNAL_EXTENSION);
+                command->in_place = 1;
+                return 0;
+            }
             char* copied_output = strdup(command->ips_file);
             if (copied_output == NULL) {
                 rombp_log_err("Failed to copy output_path string\n");
@@ -461,6 +478,31 @@ static int ui_handle_select(rombp_ui* ui, rombp_patch_command* command) {
     return 0;
 }
 
+// Roll the selected ROM back from the undo journal that in place patching
+// left next to it.
+static int ui_handle_rollback(rombp_ui* ui, rombp_patch_command* command) {
+    struct dirent* selected_item = ui->namelist[ui->selected_item + ui->selected_offset];
+
+    if (!ui->in_place || command->input_file != NULL || selected_item->d_type != DT_REG) {
+        return -1;
+    }
+    command->input_file = concat_path(ui->current_directory, selected_item->d_name);
+    if (command->input_file == NULL) {
+        rombp_log_err("Failed to alloc rollback input path\n");
+        return -1;
+    }
+    size_t journal_size = strlen(command->input_file) + strlen(UNDO_JOURNAL_EXTENSION) + 1;
+    command->rollback_file = malloc(journal_size);
+    if (command->rollback_file == NULL) {
+        rombp_log_err("Failed to alloc rollback journal path\n");
+        ui_free_command(command);
+        return -1;
+    }
+    snprintf(command->rollback_file, journal_size, "%s%s", command->input_file, UNDO_JOURNAL_EXTENSION);
+
+    return 0;
+}
+
 static void ui_handle_down(rombp_ui* ui, int amount) {
     int nitems = MIN(MENU_ITEM_COUNT, ui->namelist_size);
     // Don't allow any paging offset if the number of directory items fits on the screen at once. Otherwise,
@@ -499,6 +541,23 @@ void ui_free_command(rombp_patch_command* command) {
         free(command->output_file);
         command->output_file = NULL;
     }
+    if (command->journal_file != NULL) {
+        free(command->journal_file);
+        command->journal_file = NULL;
+    }
+    if (command->rollback_file != NULL) {
+        free(command->rollback_file);
+        command->rollback_file = NULL;
+    }
+    command->in_place = 0;
+}
+
+static void ui_toggle_in_place(rombp_ui* ui) {
+    ui->in_place = !ui->in_place;
+    int rc = ui_status_bar_reset_text(ui, &ui->bottom_bar, ui->in_place ? BOTTOM_BAR_MODE_IN_PLACE : BOTTOM_BAR_MODE_NEW_FILE);
+    if (rc != 0) {
+        rombp_log_err("Failed to reset status bar text");
+    }
 }
 
 rombp_ui_event ui_handle_event(rombp_ui* ui, rombp_patch_command* command) {
@@ -532,6 +591,16 @@ rombp_ui_event ui_handle_event(rombp_ui* ui, rombp_patch_command* command) {
                             return EV_PATCH_COMMAND;
                         }
                         break;
+                    case SDLK_x:
+                    case SDLK_LSHIFT: // X button on RG350
+                        ui_toggle_in_place(ui);
+                        break;
+                    case SDLK_r:
+                    case SDLK_SPACE: // Y button on RG350
+                        if (ui_handle_rollback(ui, command) == 0) {
+                            return EV_PATCH_COMMAND;
+                        }
+                        break;
                     case SDLK_RIGHT:
                         ui_handle_down(ui, 10);
                         break;
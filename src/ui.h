@@ -5,6 +5,9 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
 
+#include "bps_create.h"
+#include "io.h"
+
 typedef enum rombp_screen {
     SELECT_ROM = 0,
     SELECT_IPS = 1,
@@ -44,6 +47,9 @@ typedef struct rombp_ui {
 
     rombp_ui_status_bar bottom_bar;
     rombp_ui_status_bar nav_bar;
+
+    // Patch the selected ROM directly, instead of writing a new file
+    int in_place;
 } rombp_ui;
 
 typedef enum rombp_ui_event {
@@ -52,10 +58,54 @@ typedef enum rombp_ui_event {
     EV_QUIT,
 } rombp_ui_event;
 
+typedef enum rombp_command_mode {
+    // Apply the patches to the input file
+    ROMBP_MODE_PATCH = 0,
+    // Fold the patches into one BPS patch for the input file
+    ROMBP_MODE_COMPOSE = 1,
+    // Make a BPS or IPS patch from the input file to target_file
+    ROMBP_MODE_CREATE = 2,
+} rombp_command_mode;
+
 typedef struct rombp_patch_command {
+    rombp_command_mode mode;
     char* input_file;
     char* output_file;
+    // The ROM a created patch makes from input_file
+    char* target_file;
     char* ips_file;
+    // Patches applied after ips_file, in order, each to the result of the
+    // one before
+    char** stack_files;
+    int stack_count;
+    // Undo journal to write when patching in place, may be NULL
+    char* journal_file;
+    // Undo journal to roll the input file back with
+    char* rollback_file;
+    int in_place;
+    // Only check the patch file, nothing is written
+    int validate;
+    // With validate, also print what the patch does
+    int info;
+    // Apply BPS patches in one pass with this much output window, 0 if unset
+    size_t stream_window;
+    // Most bytes of the job's files memory mapped at once, 0 for no limit
+    size_t map_limit;
+    // Batch mode: patch every input matching the glob, or listed in the
+    // manifest, into outputs named by the output_file template
+    char* batch_pattern;
+    char* manifest_file;
+    // Batch jobs run at once, 0 for one per CPU
+    int jobs;
+    // Most threads one patch runs on, 0 for one per CPU
+    int threads;
+    // Most working memory for creating a patch, 0 for the default of
+    // create_method
+    size_t memory_limit;
+    bps_create_method create_method;
+    // Format of a created patch
+    rombp_patch_type create_format;
+    rombp_io_backend io_backend;
 } rombp_patch_command;
 
 int ui_start(rombp_ui* ui);
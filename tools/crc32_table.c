@@ -0,0 +1,56 @@
+// Generates src/crc32_table.h, the slicing-by-8 CRC32 tables. Run via:
+//
+//   $ make crc32_table
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Reflected CRC32 polynomial, as used by BPS, zip and PNG
+static const uint32_t CRC32_POLYNOMIAL = 0xEDB88320;
+static const int VALUES_PER_LINE = 6;
+
+static uint32_t table[8][256];
+
+int main() {
+    // The classic byte at a time table, one bit per step
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32_POLYNOMIAL : 0);
+        }
+        table[0][n] = crc;
+    }
+    // Each next table feeds one more zero byte
+    for (int k = 1; k < 8; k++) {
+        for (int n = 0; n < 256; n++) {
+            uint32_t crc = table[k - 1][n];
+            table[k][n] = (crc >> 8) ^ table[0][crc & 0xFF];
+        }
+    }
+
+    printf("#ifndef ROMBP_CRC32_TABLE_H_\n");
+    printf("#define ROMBP_CRC32_TABLE_H_\n\n");
+    printf("#include <stdint.h>\n\n");
+    printf("// Slicing-by-8 tables for the reflected CRC32 polynomial 0x%08X. Entry\n", CRC32_POLYNOMIAL);
+    printf("// [k][n] is the CRC register after feeding byte n followed by k zero bytes,\n");
+    printf("// so CRC32_TABLE[0] is the classic byte at a time table. Generated by\n");
+    printf("// tools/crc32_table.c, so there is no lazy initialization to race on.\n");
+    printf("static const uint32_t CRC32_TABLE[8][256] = {\n");
+    for (int k = 0; k < 8; k++) {
+        printf("    {\n");
+        for (int n = 0; n < 256; n++) {
+            if (n % VALUES_PER_LINE == 0) {
+                printf("       ");
+            }
+            printf(" 0x%08X,", table[k][n]);
+            if (n % VALUES_PER_LINE == VALUES_PER_LINE - 1 || n == 255) {
+                printf("\n");
+            }
+        }
+        printf("    },\n");
+    }
+    printf("};\n\n");
+    printf("#endif\n");
+
+    return 0;
+}